@@ -0,0 +1,108 @@
+// Interpreter benchmark: runs a few guest images through Processor::Run and
+// reports the instruction rate of the dispatch backend it was built with.
+#define X86_DEBUG_NO_MAIN
+#include "x86-debug.cpp"
+
+#include <chrono>
+
+#ifdef X86_DEBUG_THREADED_DISPATCH
+static const char* const kBackend = "threaded";
+#else
+static const char* const kBackend = "switch";
+#endif
+
+struct GuestImage
+{
+	const char* name;
+	vector<unsigned char> code;  // loaded at CS:0100, ends with INT 20h
+};
+
+static const GuestImage kImages[] = {
+	{ "alu-loop", {
+		0xbe, 0x14, 0x00,        //      mov  si, 20
+		0xb9, 0xff, 0xff,        // o:   mov  cx, 0FFFFh
+		0x01, 0xcb,              // i:   add  bx, cx
+		0x83, 0xd0, 0x00,        //      adc  ax, 0
+		0x31, 0xd3,              //      xor  bx, dx
+		0xe2, 0xf7,              //      loop i
+		0x4e,                    //      dec  si
+		0x75, 0xf1,              //      jnz  o
+		0xcd, 0x20,              //      int  20h
+	} },
+	{ "call-shift", {
+		0xbe, 0x00, 0x40,        //      mov  si, 4000h
+		0xe8, 0x11, 0x00,        // o:   call f
+		0xb8, 0x00, 0x20,        //      mov  ax, 2000h
+		0xbb, 0x07, 0x00,        //      mov  bx, 7
+		0xf7, 0xe3,              //      mul  bx
+		0xd1, 0xe0,              //      shl  ax, 1
+		0x50,                    //      push ax
+		0x5a,                    //      pop  dx
+		0x4e,                    //      dec  si
+		0x75, 0xee,              //      jnz  o
+		0xcd, 0x20,              //      int  20h
+		0x55,                    // f:   push bp
+		0x89, 0xe5,              //      mov  bp, sp
+		0xb9, 0x08, 0x00,        //      mov  cx, 8
+		0xd1, 0xfa,              // l:   sar  dx, 1
+		0xd1, 0xd0,              //      rcl  ax, 1
+		0xe2, 0xfa,              //      loop l
+		0x5d,                    //      pop  bp
+		0xc3,                    //      ret
+	} },
+	{ "string-ops", {
+		0xfc,                    //      cld
+		0xbd, 0x90, 0x01,        //      mov  bp, 400
+		0xbe, 0x00, 0x10,        // o:   mov  si, 1000h
+		0xbf, 0x00, 0x80,        //      mov  di, 8000h
+		0xb9, 0x00, 0x08,        //      mov  cx, 800h
+		0xf3, 0xa5,              //      rep movsw
+		0xbf, 0x00, 0x80,        //      mov  di, 8000h
+		0xb9, 0x00, 0x08,        //      mov  cx, 800h
+		0xb0, 0x55,              //      mov  al, 55h
+		0xf2, 0xae,              //      repne scasb
+		0x4d,                    //      dec  bp
+		0x75, 0xe8,              //      jnz  o
+		0xcd, 0x20,              //      int  20h
+	} },
+};
+
+int main()
+{
+	static const int kRepeats = 5;
+	static const unsigned short kSegment = 0x07BE;
+
+	Processor processor;
+	printf("%-8s %-12s %12s %10s %8s\n", "backend", "image", "instructions", "seconds", "MIPS");
+	for (const GuestImage& image : kImages) {
+		double best = 0;
+		unsigned long long executed = 0;
+		for (int i = 0; i < kRepeats; ++i) {
+			Registers& regs = processor.GetRegisters();
+			for (int r = Registers::MIN_REG_INDEX; r < Registers::MAX_REG_INDEX; ++r) {
+				regs.Set(r, 0);
+			}
+			regs.Set(Registers::FLAGS, 0);
+			for (int seg : { Registers::ES, Registers::CS, Registers::SS, Registers::DS }) {
+				regs.Set(seg, kSegment);
+			}
+			regs.Set(Registers::SP, 0xFFFE);
+			regs.Set(Registers::IP, 0x0100);
+			processor.GetMemory().PutData(kSegment, 0x0100, image.code);
+
+			auto start = chrono::steady_clock::now();
+			StopReason reason = processor.Run(~0ULL, {});
+			chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+			if (reason != StopReason::TERMINATED) {
+				fprintf(stderr, "%s: guest stopped unexpectedly (%d)\n", image.name, static_cast<int>(reason));
+				return 1;
+			}
+			if (i == 0 || elapsed.count() < best) {
+				best = elapsed.count();
+			}
+			executed = processor.GetExecuted();
+		}
+		printf("%-8s %-12s %12llu %10.4f %8.1f\n", kBackend, image.name, executed, best, executed / best / 1e6);
+	}
+	return 0;
+}
@@ -0,0 +1,227 @@
+// Microbenchmarks for the memory commands, the command parser, the
+// instruction decoder and the disassembler. Each benchmark runs with seeded
+// data at sizes from 16 bytes to 1MB; results go to standard output as JSON
+// in the layout Google Benchmark uses, so they can be tracked and compared
+// across builds.
+//
+//   ./microbench [name-filter]
+#define X86_DEBUG_NO_MAIN
+#include "x86-debug.cpp"
+
+#include <chrono>
+#include <random>
+
+namespace {
+
+const double kMinSeconds = 0.05;
+const unsigned long long kMaxIterations = 1000000000ULL;
+const unsigned kSizes[] = { 16, 256, 4 << 10, 64 << 10, 1 << 20 };
+const unsigned kSeed = 20240501;
+
+struct Result
+{
+	string name;
+	unsigned long long iterations;
+	double realNs;  // per iteration
+	double cpuNs;
+	unsigned long long bytes;  // processed per iteration, 0 if not meaningful
+};
+
+string filter;
+vector<Result> results;
+volatile unsigned sink;  // keeps results of side-effect free calls alive
+
+// Runs body in batches, growing the batch until it takes at least
+// kMinSeconds, and records the time per iteration of the last batch.
+template <typename Body>
+void Measure(const string& name, unsigned long long bytes, Body body)
+{
+	if (!filter.empty() && name.find(filter) == string::npos) {
+		return;
+	}
+	body();  // warm up: pages touched, buffers allocated
+	for (unsigned long long iterations = 1; ; ) {
+		auto start = chrono::steady_clock::now();
+		clock_t cpuStart = clock();
+		for (unsigned long long i = 0; i < iterations; ++i) {
+			body();
+		}
+		double cpu = static_cast<double>(clock() - cpuStart) / CLOCKS_PER_SEC;
+		chrono::duration<double> real = chrono::steady_clock::now() - start;
+		if (real.count() >= kMinSeconds || iterations >= kMaxIterations) {
+			results.push_back(Result{name, iterations, real.count() * 1e9 / iterations,
+					cpu * 1e9 / iterations, bytes});
+			return;
+		}
+		double scale = real.count() > 0 ? kMinSeconds * 1.4 / real.count() : 10;
+		iterations = min(kMaxIterations, static_cast<unsigned long long>(iterations * max(2.0, min(10.0, scale))));
+	}
+}
+
+// Memory commands address at most one 64KB segment: larger sizes are
+// covered one segment at a time.
+template <typename Span>
+void ForEachSegment(unsigned short seg, unsigned size, Span span)
+{
+	for (unsigned done = 0; done < size; done += 0x10000) {
+		unsigned length = min(size - done, 0x10000u);
+		span(static_cast<unsigned short>(seg + (done >> 4)), static_cast<unsigned short>(length - 1));
+	}
+}
+
+void WriteJson(FILE* out)
+{
+	time_t now = time(nullptr);
+	char date[32];
+	struct tm local;
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime_r(&now, &local));
+	fprintf(out, "{\n  \"context\": {\n");
+	fprintf(out, "    \"date\": \"%s\",\n", date);
+	fprintf(out, "    \"executable\": \"microbench\",\n");
+	fprintf(out, "    \"num_cpus\": %u,\n", thread::hardware_concurrency());
+	fprintf(out, "    \"seed\": %u\n", kSeed);
+	fprintf(out, "  },\n  \"benchmarks\": [");
+	for (size_t i = 0; i < results.size(); ++i) {
+		const Result& r = results[i];
+		fprintf(out, "%s\n    {\n", i ? "," : "");
+		fprintf(out, "      \"name\": \"%s\",\n", r.name.c_str());
+		fprintf(out, "      \"iterations\": %llu,\n", r.iterations);
+		fprintf(out, "      \"real_time\": %.3f,\n", r.realNs);
+		fprintf(out, "      \"cpu_time\": %.3f,\n", r.cpuNs);
+		if (r.bytes) {
+			fprintf(out, "      \"bytes_per_second\": %.0f,\n", r.bytes * 1e9 / r.realNs);
+		}
+		fprintf(out, "      \"time_unit\": \"ns\"\n    }");
+	}
+	fprintf(out, "\n  ]\n}\n");
+}
+
+} // namespace
+
+int main(int argc, char* const* argv)
+{
+	if (argc > 1) {
+		filter = argv[1];
+	}
+	// Dump, Compare and SearchData print their findings; that output goes to
+	// /dev/null while the results keep the original standard output.
+	fflush(stdout);
+	FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+	int null = open("/dev/null", O_WRONLY);
+	if (!out || null < 0) {
+		perror("microbench");
+		return 1;
+	}
+	dup2(null, STDOUT_FILENO);
+	close(null);
+
+	mt19937 random(kSeed);
+	Memory memory;
+	vector<unsigned char> image(Memory::MEMORY_SIZE);
+	for (unsigned char& byte : image) {
+		byte = static_cast<unsigned char>(random());
+	}
+	memory.CopyIn(0, image.data(), image.size());
+
+	char path[] = "/tmp/microbench-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("microbench");
+		return 1;
+	}
+	close(fd);
+
+	const vector<vector<unsigned char>> patterns = { { 0xDE, 0xAD, 0xBE, 0xEF } };
+	for (unsigned size : kSizes) {
+		string suffix = "/" + to_string(size);
+		// Ranges that need a second, disjoint range use at most half of memory.
+		unsigned half = min(size, static_cast<unsigned>(Memory::MEMORY_SIZE / 2));
+		string halfSuffix = "/" + to_string(half);
+
+		Measure("Memory::SearchData" + suffix, size, [&]() {
+			ForEachSegment(0, size, [&](unsigned short seg, unsigned short end) {
+				memory.SearchData(seg, 0, end, patterns);
+			});
+		});
+		Measure("Memory::Compare" + halfSuffix, half, [&]() {
+			ForEachSegment(0, half, [&](unsigned short seg, unsigned short end) {
+				memory.Compare(seg, 0, end, static_cast<unsigned short>(seg + 0x8000), 0, false);
+			});
+		});
+		Measure("Memory::Copy" + halfSuffix, half, [&]() {
+			ForEachSegment(0, half, [&](unsigned short seg, unsigned short end) {
+				memory.Copy(seg, 0, end, static_cast<unsigned short>(seg + 0x8000), 0);
+			});
+		});
+		Measure("Memory::FillData" + suffix, size, [&]() {
+			ForEachSegment(0, size, [&](unsigned short seg, unsigned short end) {
+				memory.FillData(seg, 0, end, patterns[0]);
+			});
+		});
+		memory.CopyIn(0, image.data(), image.size());
+		Measure("Memory::Dump" + suffix, size, [&]() {
+			memory.Dump(0, 0, size);
+		});
+		Measure("Memory::Write" + suffix, size, [&]() {
+			memory.Write(path, 0, 0, size);
+		});
+		Measure("Memory::Load" + suffix, size, [&]() {
+			unsigned loaded;
+			memory.Load(path, 0, 0, loaded);
+		});
+	}
+
+	static const char* const kCommands[] = {
+		"d 1000:0 l 80", "e 100 b8 34 12 cd 21", "s 0:0 ffff 'hello' 0d 0a",
+		"bp 0123 cx=0", "g =100 120 140", "r ax 1234",
+	};
+	Command cmd;
+	Measure("Command::Parse", 0, [&]() {
+		for (const char* text : kCommands) {
+			cmd.Parse(text);
+		}
+	});
+
+	static const char* const kRegisterNames[] = {
+		"AX", "BX", "CX", "DX", "SP", "BP", "SI", "DI", "DS", "ES", "SS", "CS", "IP"
+	};
+	Registers registers;
+	Measure("Registers::Get", 0, [&]() {
+		unsigned short value = 0;
+		for (const char* name : kRegisterNames) {
+			registers.Get(name, value);
+			sink = value;
+		}
+	});
+	Measure("Registers::Set", 0, [&]() {
+		for (const char* name : kRegisterNames) {
+			registers.Set(name, 0x1234);
+		}
+	});
+
+	// Decodes a stream of seeded random bytes, as a linear sweep would.
+	for (unsigned size : kSizes) {
+		Measure("Memory::ParseOneInstrument/" + to_string(size), size, [&]() {
+			Instruction ins;
+			unsigned decoded = 0;
+			for (unsigned offset = 0; offset < size; offset += max<unsigned>(ins.length, 1)) {
+				Memory::ParseOneInstrument(image.data() + offset, min<size_t>(16, size - offset), ins);
+				decoded += static_cast<unsigned>(ins.mnemonic);
+			}
+			sink = decoded;
+		});
+	}
+
+	// Recursive descent over the same bytes, listing everything it does not
+	// reach as data.
+	for (unsigned size : kSizes) {
+		Measure("Memory::Unassemble/" + to_string(size), size, [&]() {
+			memory.Unassemble(0, 0, size);
+		});
+	}
+
+	unlink(path);
+	WriteJson(out);
+	fclose(out);
+	return 0;
+}
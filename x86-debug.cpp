@@ -1,85 +1,546 @@
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <array>
 #include <map>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <algorithm>
+#include <bitset>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <locale>
 #include <utility>
 #include <cstdio>
 #include <cstring>
 #include <cstdarg>
 #include <cstdlib>
+#include <csignal>
+#include <cerrno>
+#include <ctime>
 #include <unistd.h>
 #include <termios.h>
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 using namespace std;
 
 enum class ProcessorType { PT_8086 = 0, PT_186, PT_286, PT_386, PT_486, PT_586, PT_686 };
 
 enum class CoProcessorType { CPT_NONE = 0, CPT_287, CPT_387 };
 
+#define MNEMONIC_LIST(X) \
+	X(DB, "DB") \
+	X(ADD, "ADD") X(OR, "OR") X(ADC, "ADC") X(SBB, "SBB") \
+	X(AND, "AND") X(SUB, "SUB") X(XOR, "XOR") X(CMP, "CMP") \
+	X(DAA, "DAA") X(DAS, "DAS") X(AAA, "AAA") X(AAS, "AAS") \
+	X(INC, "INC") X(DEC, "DEC") X(PUSH, "PUSH") X(POP, "POP") \
+	X(PUSHA, "PUSHA") X(POPA, "POPA") X(BOUND, "BOUND") \
+	X(JO, "JO") X(JNO, "JNO") X(JB, "JB") X(JNB, "JNB") \
+	X(JZ, "JZ") X(JNZ, "JNZ") X(JBE, "JBE") X(JA, "JA") \
+	X(JS, "JS") X(JNS, "JNS") X(JPE, "JPE") X(JPO, "JPO") \
+	X(JL, "JL") X(JGE, "JGE") X(JLE, "JLE") X(JG, "JG") \
+	X(TEST, "TEST") X(XCHG, "XCHG") X(MOV, "MOV") X(LEA, "LEA") \
+	X(NOP, "NOP") X(CBW, "CBW") X(CWD, "CWD") X(CALL, "CALL") \
+	X(CALLF, "CALL") X(WAIT, "WAIT") X(PUSHF, "PUSHF") X(POPF, "POPF") \
+	X(SAHF, "SAHF") X(LAHF, "LAHF") \
+	X(MOVSB, "MOVSB") X(MOVSW, "MOVSW") X(CMPSB, "CMPSB") X(CMPSW, "CMPSW") \
+	X(STOSB, "STOSB") X(STOSW, "STOSW") X(LODSB, "LODSB") X(LODSW, "LODSW") \
+	X(SCASB, "SCASB") X(SCASW, "SCASW") X(INSB, "INSB") X(INSW, "INSW") \
+	X(OUTSB, "OUTSB") X(OUTSW, "OUTSW") \
+	X(RET, "RET") X(RETF, "RETF") X(LES, "LES") X(LDS, "LDS") \
+	X(ENTER, "ENTER") X(LEAVE, "LEAVE") X(INT, "INT") X(INTO, "INTO") X(IRET, "IRET") \
+	X(ROL, "ROL") X(ROR, "ROR") X(RCL, "RCL") X(RCR, "RCR") \
+	X(SHL, "SHL") X(SHR, "SHR") X(SAR, "SAR") \
+	X(AAM, "AAM") X(AAD, "AAD") X(XLAT, "XLAT") X(ESC, "ESC") \
+	X(LOOPNZ, "LOOPNZ") X(LOOPZ, "LOOPZ") X(LOOP, "LOOP") X(JCXZ, "JCXZ") \
+	X(IN, "IN") X(OUT, "OUT") X(JMP, "JMP") X(JMPF, "JMP") \
+	X(HLT, "HLT") X(CMC, "CMC") X(NOT, "NOT") X(NEG, "NEG") \
+	X(MUL, "MUL") X(IMUL, "IMUL") X(DIV, "DIV") X(IDIV, "IDIV") \
+	X(CLC, "CLC") X(STC, "STC") X(CLI, "CLI") X(STI, "STI") \
+	X(CLD, "CLD") X(STD, "STD")
+
+enum class Mnemonic : unsigned char {
+#define X(name, text) name,
+	MNEMONIC_LIST(X)
+#undef X
+	COUNT
+};
+
+enum OperandType : unsigned char {
+	OT_NONE = 0,
+	OT_REG8,   // reg = AL, CL, DL, BL, AH, CH, DH, BH
+	OT_REG16,  // reg = AX, CX, DX, BX, SP, BP, SI, DI
+	OT_SREG,   // reg = ES, CS, SS, DS
+	OT_MEM,    // reg = r/m base (0..7), or MEM_DIRECT; size = displacement bytes
+	OT_IMM,    // size = 1, 2, or IMM_SIGNED for sign-extended byte
+	OT_REL,    // disp = relative displacement from the next instruction
+	OT_FAR     // seg:disp
+};
+
+struct Operand
+{
+	enum { MEM_DIRECT = 8, IMM_SIGNED = 0x81 };
+
+	OperandType type = OT_NONE;
+	unsigned char reg = 0;
+	unsigned char size = 0;
+	unsigned short disp = 0;
+	unsigned short seg = 0;
+};
+
+struct Instruction
+{
+	enum { NO_SEGMENT = 0xFF };
+	enum Repeat : unsigned char { REP_NONE = 0, REP_NZ, REP_Z };
+
+	Mnemonic mnemonic = Mnemonic::DB;
+	unsigned char length = 0;
+	unsigned char width = 1;   // operand size in bytes (1 or 2)
+	unsigned char segment = NO_SEGMENT;  // segment override (ES, CS, SS, DS)
+	Repeat repeat = REP_NONE;
+	bool lock = false;
+	Operand operands[3];
+
+	size_t Format(unsigned short ip, char* buf, size_t size) const;
+};
+
 class Registers
 {
 public:
+	// General and segment registers are kept in the order of their
+	// instruction encoding, so the execution core can index them directly.
 	enum {
 		FLAGS = 0,
 
-		AX, BX, CX, DX, SP, BP, SI, DI,
-		DS, ES, SS, CS, IP,
+		AX, CX, DX, BX, SP, BP, SI, DI,
+		ES, CS, SS, DS, IP,
 
 		MAX_REG_INDEX,
 		MIN_REG_INDEX = 1
 	};
 
+	enum Flag : unsigned {
+		FLAG_CF = 0x0001, FLAG_PF = 0x0004, FLAG_AF = 0x0010, FLAG_ZF = 0x0040,
+		FLAG_SF = 0x0080, FLAG_TF = 0x0100, FLAG_IF = 0x0200, FLAG_DF = 0x0400,
+		FLAG_OF = 0x0800
+	};
+
 	void Dump();
 
 	unsigned short GetDS() const { return regs_[DS]; }
-	bool GetSeg(const string& name, unsigned short& value) const;
-	bool Get(const string& name, unsigned short& value) const;
-	bool Set(const string& name, unsigned short value);
+	unsigned short GetCS() const { return regs_[CS]; }
+	unsigned short GetIP() const { return regs_[IP]; }
+	bool GetSeg(string_view name, unsigned short& value) const;
+	bool Get(string_view name, unsigned short& value) const;
+	bool Set(string_view name, unsigned short value);
+
+	unsigned short Get(int index) const { return static_cast<unsigned short>(regs_[index]); }
+	void Set(int index, unsigned short value) { regs_[index] = value; }
+
+	// Byte registers by instruction encoding: AL, CL, DL, BL, AH, CH, DH, BH.
+	unsigned char GetByte(unsigned n) const
+	{
+		return static_cast<unsigned char>(n & 4 ? regs_[AX + (n & 3)] >> 8 : regs_[AX + (n & 3)]);
+	}
+	void SetByte(unsigned n, unsigned char value)
+	{
+		unsigned& word = regs_[AX + (n & 3)];
+		word = n & 4 ? (word & 0x00FF) | (value << 8) : (word & 0xFF00) | value;
+	}
+
+	// Register names resolve, case-insensitively and without allocating, to
+	// a word register index or to BYTE_REG plus a byte register encoding.
+	enum { BYTE_REG = 0x10, NO_REG = -1 };
+	static int Find(const char* name, size_t size);
+	static int Find(string_view name) { return Find(name.data(), name.size()); }
+	static const char* Name(int reg);
+	static bool IsSegment(int reg) { return reg >= ES && reg <= DS; }
+	static bool IsByte(int reg) { return reg != NO_REG && (reg & BYTE_REG); }
+
+	// Either width, as returned by Find.
+	unsigned short GetAny(int reg) const { return reg & BYTE_REG ? GetByte(reg & 7) : Get(reg); }
+	void SetAny(int reg, unsigned short value);
 private:
 	unsigned regs_[MAX_REG_INDEX] = {
 		0, // FLAGS
-		0, 0, 0, 0, 0xFFFE, 0, 0, 0, // AX, BX, CX, DX, SP, BP, SI, DI
-		0x07BE, 0x07BE, 0x07BE, 0x07BE, 0x0100  // DS, ES, SS, CS, IP
+		0, 0, 0, 0, 0xFFFE, 0, 0, 0, // AX, CX, DX, BX, SP, BP, SI, DI
+		0x07BE, 0x07BE, 0x07BE, 0x07BE, 0x0100  // ES, CS, SS, DS, IP
 	};
 };
 
 class Memory
 {
 public:
+	// Memory is tracked in 256-byte pages for bookkeeping that must not
+	// slow down ordinary accesses.
+	enum {
+		MEMORY_SIZE = 1 << 20,
+		PAGE_SHIFT = 8,
+		PAGE_SIZE = 1 << PAGE_SHIFT,
+		PAGE_COUNT = MEMORY_SIZE >> PAGE_SHIFT,
+
+		// Snapshots share memory in larger pages.
+		IMAGE_PAGE_SHIFT = 12,
+		IMAGE_PAGE_SIZE = 1 << IMAGE_PAGE_SHIFT,
+		IMAGE_PAGE_COUNT = MEMORY_SIZE >> IMAGE_PAGE_SHIFT,
+		PAGES_PER_IMAGE_PAGE = IMAGE_PAGE_SIZE / PAGE_SIZE
+	};
+
+	enum PageAttr : unsigned char {
+		PA_CODE = 0x01,  // decoded instructions of this page are cached
+		PA_FRESH = 0x02, // not touched yet; holds the power-on pattern once read or written
+		PA_SHARED = 0x04, // unchanged since the last Capture or Restore
+		PA_CLEAN = 0x08,  // not written since the last ClearDirty
+		PA_WATCH = 0x10   // stores are checked against the watched ranges
+	};
+
+	// Contents of memory that has never been written.
+	enum class FillMode { PATTERN, ZERO };
+
+	// Copy-on-write picture of memory. Pages are immutable and shared with
+	// other images and with the live memory as long as nobody writes them;
+	// a null page stands for the initial contents.
+	using ImagePage = shared_ptr<const array<unsigned char, IMAGE_PAGE_SIZE>>;
+	struct Image
+	{
+		vector<ImagePage> pages;
+	};
+
+	// Run of differing bytes found by Diff, relative to the start of the
+	// compared ranges.
+	struct DiffRange
+	{
+		unsigned start;
+		unsigned length;
+	};
+
+	// Data watchpoint: stores into [linear, linear + size) are reported to
+	// the watch handler.
+	struct WatchRange
+	{
+		unsigned linear;
+		unsigned size;
+	};
+
+	// Occurrence of one of the patterns given to Search.
+	struct SearchHit
+	{
+		unsigned linear;
+		unsigned pattern;  // index into the pattern list
+	};
+
 	Memory();
+	~Memory();
+	Memory(const Memory&) = delete;
+	Memory& operator=(const Memory&) = delete;
+
+	void SetFillMode(FillMode mode);
+
+	Image Capture();
+	void Restore(const Image& image);
+
+	// Pages written since the last ClearDirty, as ascending linear
+	// (start, length) ranges with adjacent pages merged.
+	vector<pair<unsigned, unsigned>> DirtyRanges() const;
+	bool IsDirty(unsigned linear) const { return !(pageAttr_[(linear & (MEMORY_SIZE - 1)) >> PAGE_SHIFT] & PA_CLEAN); }
+	void ClearDirty();
 
-	void Dump(unsigned short seg, unsigned short start, unsigned short end);
+	void Dump(unsigned short seg, unsigned short start, unsigned long long count) const;
 
+	vector<DiffRange> Diff(unsigned short srcSeg, unsigned short srcStart,
+			unsigned short dstSeg, unsigned short dstStart, unsigned count) const;
 	void Compare(unsigned short srcSeg, unsigned short srcStart, unsigned short srcEnd,
-			unsigned short dstSeg, unsigned short dstStart);
+			unsigned short dstSeg, unsigned short dstStart, bool perByte);
 	void Copy(unsigned short srcSeg, unsigned short srcStart, unsigned short srcEnd,
 			unsigned short dstSeg, unsigned short dstStart);
 	void PutData(unsigned short srcSeg, unsigned short srcStart, vector<unsigned char> data);
 
 	unsigned char GetChar(unsigned short seg, unsigned short offset) const;
+
+	unsigned char ReadByte(unsigned short seg, unsigned short offset) const
+	{
+		return ReadLinear(Linear(seg, offset));
+	}
+	unsigned char ReadLinear(unsigned linear) const
+	{
+		if (pageAttr_[linear >> PAGE_SHIFT] & PA_FRESH) {
+			Materialize(linear >> PAGE_SHIFT);
+		}
+		return data_[linear];
+	}
+	unsigned short ReadWord(unsigned short seg, unsigned short offset) const
+	{
+		return static_cast<unsigned short>(ReadByte(seg, offset) |
+				(ReadByte(seg, static_cast<unsigned short>(offset + 1)) << 8));
+	}
+	void WriteByte(unsigned short seg, unsigned short offset, unsigned char value)
+	{
+		unsigned linear = Linear(seg, offset);
+		BeforeWrite(linear);
+		data_[linear] = value;
+		if (writeLog_) {
+			writeLog_->push_back(linear);
+		}
+	}
+	void WriteWord(unsigned short seg, unsigned short offset, unsigned short value)
+	{
+		WriteByte(seg, offset, static_cast<unsigned char>(value));
+		WriteByte(seg, static_cast<unsigned short>(offset + 1), static_cast<unsigned char>(value >> 8));
+	}
+	const unsigned char* GetCode(unsigned short seg, unsigned short offset, unsigned char* buf) const;
+
+	// Raw access by linear address; the range must lie below 1MB.
+	void CopyOut(unsigned linear, unsigned char* buf, size_t size) const;
+	void CopyIn(unsigned linear, const unsigned char* buf, size_t size);
+	// Adds seg to each word an MZ relocation table (count offset:segment
+	// pairs) points at, relative to the load module of size bytes at linear.
+	void Relocate(unsigned linear, size_t size, const unsigned char* table, unsigned count, unsigned short seg);
+
+	// While set, the linear address of every byte written goes to log.
+	void SetWriteLog(vector<unsigned>* log) { writeLog_ = log; }
+
+	static unsigned Linear(unsigned short seg, unsigned short offset)
+	{
+		return ((seg << 4) + offset) & 0xFFFFF; // 20-bit address bus, wraps at 1MB
+	}
+	vector<SearchHit> Search(unsigned linear, size_t size,
+			const vector<vector<unsigned char>>& patterns) const;
 	void SearchData(unsigned short seg, unsigned short start, unsigned short end,
-			const vector<unsigned char>& data);
+			const vector<vector<unsigned char>>& patterns);
+	void SearchAll(const vector<vector<unsigned char>>& patterns);
 	void FillData(unsigned short seg, unsigned short start, unsigned short end,
 			const vector<unsigned char>& data);
 
 	bool Load(const string& filename, unsigned short seg,
-			unsigned short offset, unsigned short& size);
+			unsigned short offset, unsigned& size);
 	bool Write(const string& filename, unsigned short seg,
-			unsigned short offset, unsigned short size);
-	bool Unassemble(unsigned short seg, unsigned short offset) const;
+			unsigned short offset, unsigned size);
+	bool WriteChanges(const string& filename, unsigned short seg,
+			unsigned short offset, unsigned size, unsigned& written);
+	unsigned short Unassemble(unsigned short seg, unsigned short offset) const;
+	unsigned short UnassembleOne(unsigned short seg, unsigned short offset) const;
+	// Follows code flow from seg:start through count bytes; see Disassembler.
+	void Unassemble(unsigned short seg, unsigned short start, unsigned long long count) const;
+
+	static bool ParseOneInstrument(const unsigned char* p, size_t avail, Instruction& ins);
+
+	void MarkCode(unsigned firstPage, unsigned lastPage);
+	void UnmarkCode(unsigned firstPage, unsigned lastPage);
+	void SetCodeWriteHandler(function<void(unsigned page)> handler) { codeWriteHandler_ = handler; }
+
+	// Only stores to the pages a watch covers leave the fast path.
+	void AddWatch(unsigned linear, unsigned size);
+	bool RemoveWatch(unsigned linear);
+	void ClearWatches();
+	const vector<WatchRange>& GetWatches() const { return watches_; }
+	void SetWatchHandler(function<void(unsigned linear)> handler) { watchHandler_ = handler; }
+private:
+	size_t Fetch(unsigned short seg, unsigned short offset, unsigned char* buf, size_t size) const;
+
+	void BeforeWrite(unsigned linear)
+	{
+		unsigned char attr = pageAttr_[linear >> PAGE_SHIFT];
+		if (attr != 0) {
+			OnPageWrite(linear >> PAGE_SHIFT);
+			if (attr & PA_WATCH) {
+				CheckWatch(linear);
+			}
+		}
+	}
+	void BeforeWrite(unsigned linear, size_t size);
+	void PrepareOverwrite(unsigned linear, size_t size);
+	void OnPageWrite(unsigned page);
+	void MarkDirty(unsigned page);
+	void CheckWatch(unsigned linear);
+	void MarkWatched(const WatchRange& watch, bool on);
+	void Touch(unsigned linear, size_t size) const;
+	static unsigned SpanLength(unsigned short seg, unsigned short offset, unsigned count);
+	void Materialize(unsigned page) const;
+private:
+	unsigned char* data_;  // anonymous mapping, host pages are committed on first use
+	mutable unsigned char pageAttr_[PAGE_COUNT];
+	FillMode fillMode_ = FillMode::PATTERN;
+
+	// Image pages the live memory equals unless listed in changedPages_.
+	vector<ImagePage> basePages_ = vector<ImagePage>(IMAGE_PAGE_COUNT);
+	vector<unsigned> changedPages_;
+	vector<unsigned> dirtyPages_;  // pages whose PA_CLEAN was cleared
+	function<void(unsigned page)> codeWriteHandler_;
+	vector<unsigned>* writeLog_ = nullptr;
+	vector<WatchRange> watches_;
+	function<void(unsigned linear)> watchHandler_;
+};
+
+enum class StopReason {
+	NONE = 0,
+	COUNT,           // requested number of instructions executed
+	BREAKPOINT,
+	HALT,
+	TERMINATED,      // program exited through DOS
+	INTERRUPT,       // interrupt without an emulated service
+	DIVIDE_ERROR,
+	INVALID_OPCODE,
+	USER_BREAK,
+	WATCHPOINT       // a watched range was written
+};
+
+// Code breakpoints, kept as one bit per byte of the 1MB address space so
+// that testing an address is a single load however many are set. The
+// bitmap is allocated with the first breakpoint.
+class Breakpoints
+{
+public:
+	// Register test that must also hold for the breakpoint to stop.
+	struct Condition
+	{
+		enum Op : unsigned char { NONE, EQ, NE, LT, LE, GT, GE };
+
+		int reg = Registers::NO_REG;  // as returned by Registers::Find
+		Op op = NONE;
+		unsigned short value = 0;
+
+		bool Holds(const Registers& registers) const;
+	};
+
+	void Set(unsigned linear);
+	void Set(unsigned linear, const Condition& condition);
+	bool Clear(unsigned linear);
+	void ClearAll();
+
+	bool IsEmpty() const { return conditions_.empty(); }
+	const map<unsigned, Condition>& GetAll() const { return conditions_; }
+
+	// Whether any breakpoint lies in [linear, linear + size); lets a whole
+	// block of code run without per-instruction tests.
+	bool AnyIn(unsigned linear, unsigned size) const;
+	// Only valid while the set is not empty.
+	bool Hit(unsigned linear, const Registers& registers) const
+	{
+		return (bits_[linear >> 6] >> (linear & 63) & 1) && Stops(linear, registers);
+	}
+private:
+	bool Stops(unsigned linear, const Registers& registers) const;
+private:
+	vector<unsigned long long> bits_;
+	map<unsigned, Condition> conditions_;
+};
+
+// Execution trace file. After the header "X86TRACE" and a varint version
+// come the records, each starting with a varint tag:
+//   keyframe  tag 1, varint step, the registers as 14 little-endian words,
+//             varint page count, then per page a varint page number delta
+//             and its 256 bytes
+//   end       tag 3, varint step
+//   step      tag (mask << 2 | writes << 1); per bit of mask a zigzag varint
+//             register delta, and with writes a varint count of zigzag
+//             varint address deltas each followed by the byte written
+// A step record turns the state before one instruction into the state after
+// it. The first keyframe holds all of memory, later ones the pages changed
+// since the keyframe before.
+class TraceRecorder
+{
+public:
+	enum { KEYFRAME_INTERVAL = 0x10000, CHUNK_SIZE = 1 << 20, MAX_QUEUED = 8 };
+
+	TraceRecorder() = default;
+	~TraceRecorder();
+	TraceRecorder(const TraceRecorder&) = delete;
+	TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+	bool Open(const string& filename);
+	bool Close();
+
+	// Writes a keyframe unless registers and memory still equal the state
+	// the log describes; called whenever execution resumes.
+	void Sync(const Registers& registers, unsigned flags, const Memory& memory);
+	// Records one executed instruction. Only the registers in the written
+	// mask can have changed; writes lists the linear addresses it stored to
+	// and is cleared.
+	void Step(const Registers& registers, unsigned written, unsigned flags, const Memory& memory,
+			vector<unsigned>& writes);
+
+	unsigned long long GetSteps() const { return step_; }
+private:
+	void Keyframe(const Registers& registers, unsigned flags, const Memory& memory, bool always);
+	unsigned char* Room(size_t size);
+	void Submit();
+	void WriterLoop();
 private:
-	bool ParseOneInstrument(const unsigned char* p, size_t& count, string& op, string& operands) const;
-	static string Hex(unsigned char x);
+	int fd_ = -1;
+	vector<unsigned char> chunk_;
+	size_t used_ = 0;
+
+	thread writer_;
+	mutex lock_;
+	condition_variable queued_;
+	condition_variable drained_;
+	deque<vector<unsigned char>> queue_;
+	vector<vector<unsigned char>> spare_;
+	bool closing_ = false;
+	bool failed_ = false;
+
+	unsigned short regs_[Registers::MAX_REG_INDEX] = {};  // as of the last record
+	vector<unsigned char> shadow_;  // memory as of the last record
+	bitset<Memory::PAGE_COUNT> touched_;  // written by steps since the last keyframe
+	unsigned lastWrite_ = 0;
+	unsigned long long step_ = 0;
+	unsigned sinceKeyframe_ = 0;
+};
+
+// Rebuilds the machine state at any step of a trace file, starting from the
+// nearest keyframe before it.
+class TraceReader
+{
+public:
+	bool Open(const string& filename);
+
+	unsigned long long GetSteps() const { return steps_; }
+	size_t GetKeyframeCount() const { return keyframes_.size(); }
+
+	bool Seek(unsigned long long step, Registers& registers, Memory& memory) const;
 private:
+	struct Keyframe
+	{
+		unsigned long long step;
+		size_t offset;  // of the record
+	};
+
 	vector<unsigned char> data_;
+	vector<Keyframe> keyframes_;
+	unsigned long long steps_ = 0;
 };
 
 class Processor
 {
 public:
+	// Complete machine state. Memory pages are shared copy-on-write, so a
+	// snapshot costs only the pages written since the previous one.
+	struct State
+	{
+		Registers registers;
+		Memory::Image memory;
+		bitset<256> hooked;
+		unsigned char exitCode;
+	};
+
+	Processor();
+	Processor(const Processor&) = delete;
+	Processor& operator=(const Processor&) = delete;
+
+	State Snapshot();
+	void Restore(const State& state);
+
 	void SetProcessorType(ProcessorType type);
 	void SetCoProcessorType(CoProcessorType type);
 	void ShowProcessorType();
@@ -89,49 +550,289 @@ public:
 
 	const Registers& GetRegisters() const { return registers_; }
 	const Memory& GetMemory() const { return memory_; }
+
+	StopReason Run(unsigned long long count, const Breakpoints& breakpoints);
+	void RequestBreak() { breakRequested_ = 1; }
+
+	unsigned char GetExitCode() const { return exitCode_; }
+	unsigned long long GetExecuted() const { return executed_; }  // by the last Run
+	unsigned char GetLastVector() const { return lastVector_; }
+	unsigned GetWatchAddress() const { return watchAddress_; }  // of the last WATCHPOINT stop
+
+	// Records every instruction executed by Run until StopTrace.
+	bool StartTrace(const string& filename);
+	bool StopTrace();
+	bool IsTracing() const { return trace_ != nullptr; }
+
+	// Execution counts per linear address, collected by Run while profiling
+	// is on. The counters are allocated when profiling is first enabled.
+	void SetProfiling(bool on);
+	bool IsProfiling() const { return profile_ != nullptr; }
+	void ClearProfile();
+	const vector<unsigned long long>& GetProfile() const { return profileCounts_; }
+
+	// Guest console I/O, standard input and output unless handlers are set.
+	// Input returns EOF once exhausted; output receives the DOS handle (1 for
+	// standard output, 2 for standard error) the byte was written to.
+	void SetInputHandler(function<int()> handler) { inputHandler_ = handler; }
+	void SetOutputHandler(function<void(unsigned char c, unsigned handle)> handler) { outputHandler_ = handler; }
+private:
+	// Operand resolved to a register or a segment:offset pair.
+	struct Location
+	{
+		OperandType type;
+		unsigned char reg;
+		unsigned short seg;
+		unsigned short offset;
+	};
+
+	// Arithmetic flags are evaluated lazily from the last ALU operation.
+	enum FlagOp : unsigned char { FO_NONE = 0, FO_ADD, FO_SUB, FO_LOGIC, FO_INC, FO_DEC };
+
+	// Execution handler family of an instruction, resolved once at translation.
+	enum HandlerKind : unsigned char {
+		HK_ALU, HK_MULDIV, HK_SHIFT, HK_DECIMAL, HK_STACK, HK_MOVE,
+		HK_JCC, HK_BRANCH, HK_STRING, HK_SYSTEM,
+		HK_COUNT
+	};
+
+	// Straight-line run of pre-decoded instructions starting at a linear address.
+	struct CachedOp
+	{
+		Instruction ins;
+		HandlerKind handler;
+	};
+	struct Block
+	{
+		unsigned linear;
+		unsigned bytes;
+		vector<CachedOp> ops;
+	};
+	enum { MAX_BLOCK_OPS = 64, MAX_BLOCKS = 0x10000, BLOCK_LOOKUP_SIZE = 0x1000 };
+
+	Block* FindBlock(unsigned short cs, unsigned short ip);
+	Block* Translate(unsigned short cs, unsigned short ip, unsigned linear);
+	StopReason RunBlock(const Block& block, unsigned short ip, unsigned long long& executed,
+			unsigned long long count, const Breakpoints& breakpoints);
+	StopReason RunBlockInstrumented(const Block& block, unsigned short ip, unsigned long long& executed,
+			unsigned long long count, const Breakpoints& breakpoints);
+	void InvalidateCodePage(unsigned page);
+	void FlushBlocks();
+	static bool EndsBlock(const Instruction& ins);
+	static bool IsFault(StopReason reason);
+
+	StopReason Step();
+	StopReason Execute(const Instruction& ins, unsigned short ip);
+	StopReason Dispatch(HandlerKind kind, const Instruction& ins, unsigned short ip);
+	static HandlerKind HandlerFor(Mnemonic m);
+	StopReason ExecAlu(const Instruction& ins, unsigned short ip);
+	StopReason ExecMulDiv(const Instruction& ins, unsigned short ip);
+	StopReason ExecShift(const Instruction& ins, unsigned short ip);
+	StopReason ExecDecimal(const Instruction& ins, unsigned short ip);
+	StopReason ExecStack(const Instruction& ins, unsigned short ip);
+	StopReason ExecMove(const Instruction& ins, unsigned short ip);
+	StopReason ExecJcc(const Instruction& ins, unsigned short ip);
+	StopReason ExecBranch(const Instruction& ins, unsigned short ip);
+	StopReason ExecString(const Instruction& ins, unsigned short ip);
+	StopReason ExecSystem(const Instruction& ins, unsigned short ip);
+	StopReason Interrupt(unsigned char vector);
+	StopReason DosService();
+	int GuestInput() { return inputHandler_ ? inputHandler_() : getchar(); }
+	void GuestOutput(unsigned char c, unsigned handle = 1);
+
+	Location Locate(const Instruction& ins, const Operand& o) const;
+	unsigned Load(const Location& loc, unsigned width) const;
+	void Store(const Location& loc, unsigned width, unsigned value);
+	unsigned char GetReg8(unsigned n) const;
+	void SetReg8(unsigned n, unsigned char value);
+	unsigned short Reg(int index) const { return registers_.Get(index); }
+	void SetReg(int index, unsigned value)
+	{
+		registers_.Set(index, static_cast<unsigned short>(value));
+		writtenRegs_ |= 1u << index;
+	}
+	void Push(unsigned short value);
+	unsigned short Pop();
+	void FarJump(unsigned short seg, unsigned short offset);
+
+	unsigned Alu(Mnemonic m, unsigned width, unsigned a, unsigned b);
+	unsigned Shift(Mnemonic m, unsigned width, unsigned value, unsigned count);
+	bool MulDiv(Mnemonic m, unsigned width, unsigned value);
+	bool Condition(Mnemonic m) const;
+
+	bool CF() const;
+	bool PF() const;
+	bool AF() const;
+	bool ZF() const;
+	bool SF() const;
+	bool OF() const;
+	unsigned GetFlags() const;
+	void SetFlags(unsigned flags) { flags_ = flags; lazyOp_ = FO_NONE; }
+	void SetFlag(unsigned flag, bool on);
+	void SetResultFlags(unsigned value, unsigned width);
+	void SetLazy(FlagOp op, unsigned width, unsigned dst, unsigned src, unsigned result);
 private:
 	ProcessorType processor{ProcessorType::PT_686};
 	CoProcessorType coprocessor{CoProcessorType::CPT_387};
 private:
 	Registers registers_;
 	Memory memory_;
+
+	unsigned flags_ = 0;
+	FlagOp lazyOp_ = FO_NONE;
+	unsigned char lazyWidth_ = 1;
+	unsigned lazyDst_ = 0;
+	unsigned lazySrc_ = 0;
+	unsigned lazyResult_ = 0;
+
+	unordered_map<unsigned, unique_ptr<Block>> blocks_;
+	vector<vector<unsigned>> pageBlocks_;  // per page: start addresses of blocks covering it
+	vector<unique_ptr<Block>> retired_;    // invalidated while possibly executing
+	Block* blockLookup_[BLOCK_LOOKUP_SIZE] = {};
+	bool leaveBlock_ = false;  // the running block must be left: its code changed or a watchpoint fired
+
+	bitset<256> hooked_;  // vectors installed by the guest through INT 21h/25h
+	unsigned char exitCode_ = 0;
+	unsigned char lastVector_ = 0;
+	bool watchHit_ = false;
+	unsigned watchAddress_ = 0;
+	unsigned long long executed_ = 0;
+	volatile sig_atomic_t breakRequested_ = 0;
+
+	unique_ptr<TraceRecorder> trace_;
+	vector<unsigned long long> profileCounts_;
+	unsigned long long* profile_ = nullptr;  // profileCounts_ while profiling
+	vector<unsigned> traceWrites_;
+	unsigned writtenRegs_ = 0;  // registers assigned since the last traced step
+
+	function<int()> inputHandler_;
+	function<void(unsigned char c, unsigned handle)> outputHandler_;
+};
+
+// Runs guest programs headless, each on a private machine, across a pool
+// of threads. Every worker owns a deque of job indexes: it takes jobs from
+// the front of its own and, once that is empty, steals from the back of the
+// others', so a few long-running guests do not leave the other threads idle.
+class RunPool
+{
+public:
+	struct Job
+	{
+		string image;  // COM or MZ executable
+		string input;  // file fed to the guest's standard input, if not empty
+	};
+	struct Result
+	{
+		string error;  // why the job could not be started
+		StopReason reason = StopReason::NONE;
+		unsigned char exitCode = 0;
+		unsigned long long executed = 0;
+		Registers registers;
+		string output;  // everything the guest wrote to handles 1 and 2
+	};
+
+	RunPool(unsigned threads, unsigned long long limit, Memory::FillMode fillMode);
+	vector<Result> Run(const vector<Job>& jobs);
+private:
+	struct Queue
+	{
+		mutex lock;
+		deque<size_t> jobs;
+	};
+
+	bool Take(unsigned worker, size_t& job);
+	void Work(unsigned worker, const vector<Job>& jobs, vector<Result>& results);
+	void RunJob(Processor& processor, const Job& job, Result& result);
+private:
+	unsigned threads_;
+	unsigned long long limit_;  // instructions per job
+	Memory::FillMode fillMode_;
+	vector<unique_ptr<Queue>> queues_;
 };
 
 class Command
 {
 public:
+	// Word of a command line: its column and its text. The text views the
+	// line kept by the Command, or the unescaped copy of a word written with
+	// backslash escapes, and stays valid until the next Parse.
+	struct Word
+	{
+		size_t first;
+		string_view second;
+	};
+
+	// Words of a line, held inline unless the line is unusually long.
+	class Words
+	{
+	public:
+		size_t size() const { return size_; }
+		bool empty() const { return size_ == 0; }
+		const Word& operator[](size_t i) const { return data()[i]; }
+		const Word& back() const { return data()[size_ - 1]; }
+		const Word* begin() const { return data(); }
+		const Word* end() const { return data() + size_; }
+
+		void clear() { size_ = 0; heap_.clear(); }
+		void push_back(const Word& word);
+	private:
+		enum { INLINE_WORDS = 8 };
+		const Word* data() const { return size_ <= INLINE_WORDS ? inline_ : heap_.data(); }
+
+		Word inline_[INLINE_WORDS];
+		vector<Word> heap_;  // all words once there are more than INLINE_WORDS
+		size_t size_ = 0;
+	};
+
+	Command() = default;
+	Command(const Command&) = delete;  // the words view into this object
+	Command& operator=(const Command&) = delete;
+
 	void Parse(const string& cmd);
 	void Dump() const;
 
 	bool IsEmpty() const { return words_.empty(); }
 
-	const vector<pair<size_t, string>> GetWords() const { return words_; }
+	const Words& GetWords() const { return words_; }
 	size_t GetCmdSize() const { return cmd_.size(); }
+private:
+	void AddWord(size_t pos, string_view text);
+	string_view Unescape(string_view text);
 private:
 	string cmd_;
-	vector<pair<size_t, string>> words_;
+	string unescaped_;  // reserved to the line length, so never reallocated while parsing
+	Words words_;
 };
 
 class Console
 {
 public:
+	~Console();
+
+	void SetRaw(bool on);
 	int GetInputChar();
+	bool TakePending(string& line);
 private:
-	enum NonBlock { NB_ENABLE, NB_DISABLE };
-	void SetNonBlock(NonBlock state);
-	int KeyboardHit();
+	bool raw_ = false;
+	struct termios saved_;
+	unsigned char buffer_[4096];
+	size_t pos_ = 0;
+	size_t size_ = 0;
 };
 
 class ConsoleUI
 {
 public:
 	bool Init(Registers& registers, Memory& memory, const vector<string>& args);
+	bool SetBatchInput(const string& filename);
 
-	Command GetCommand();
+	bool GetCommand(Command& cmd);
 
 	void Process(const Command& cmd, Processor& processor);
+	bool Failed() const { return failed_; }
 private:
 	void ShowError(size_t space, const char* fmt, ...);
+	void Flush() const;
 	bool EnsureArgumentCount(const Command& cmd, size_t min, size_t max);
 
 	void CompareMemory(const Command& cmd, Registers& registers, Memory& memory);
@@ -141,18 +842,34 @@ private:
 	void FillData(const Command& cmd, Registers& registers, Memory& memory);
 
 	void SetFilename(const string& f);
+	static void SetFileSize(Registers& registers, unsigned size);
+	void RememberSync(Memory& memory, unsigned short seg, unsigned short offset, unsigned size);
+	bool InSync(unsigned short seg, unsigned short offset, unsigned size) const;
 	void LoadData(const Command& cmd, Registers& registers, Memory& memory);
 	void WriteData(const Command& cmd, Registers& registers, Memory& memory);
+	bool ParseRange(const Command& cmd, Registers& registers,
+			unsigned short& seg, unsigned short& start, unsigned long long& count);
 	void DumpMemory(const Command& cmd, Registers& registers, Memory& memory);
 	void SwitchProcessorType(const Command& cmd, Processor& processor);
 	void HexCalc(const Command& cmd);
 	void ChangeRegisters(const Command& cmd, Registers& registers);
 	void Unassemble(const Command& cmd, Registers& registers, Memory& memory);
+	void Go(const Command& cmd, Processor& processor);
+	void Trace(const Command& cmd, Processor& processor, bool proceed);
+	void Snapshots(const Command& cmd, Processor& processor);
+	void Recording(const Command& cmd, Processor& processor);
+	void Profile(const Command& cmd, Processor& processor);
+	void SetBreakpoints(const Command& cmd, Registers& registers, Memory& memory);
+
+	bool ParseStartAddress(const Command& cmd, size_t& index, Registers& registers);
+	StopReason Execute(Processor& processor, unsigned long long count, const Breakpoints& breakpoints);
+	void ShowState(Processor& processor);
+	void ReportStop(StopReason reason, Processor& processor);
 
 	static void PrintUsage();
 private:
 	void ShowPrompt() const;
-	string ReadLine();
+	bool ReadLine(string& line);
 
 	string prompt_ = "-";
 	unsigned short curSeg_;
@@ -160,196 +877,551 @@ private:
 
 	string filename_ = "";
 	vector<string> args_;
+	bool executable_ = false;  // filename_ was loaded as an MZ executable
+	Console console_;
+	map<unsigned, Processor::State> snapshots_;
+	Breakpoints breakpoints_;  // set with BP; G and P stop at them
+
+	// File last loaded or written, which equals memory at linear..linear+size
+	// except for the pages dirtied since.
+	struct SyncedFile
+	{
+		string name;
+		unsigned linear;
+		unsigned size;
+		struct stat st;
+	};
+	SyncedFile synced_ = {};
+
+	// Batch mode: the whole command stream is read up front, prompts are
+	// suppressed, and the first error ends the session.
+	bool batch_ = false;
+	string batchName_;
+	string input_;
+	size_t inputPos_ = 0;
+	unsigned lineNumber_ = 0;
+	bool failed_ = false;
 };
 
+void Command::Words::push_back(const Word& word)
+{
+	if (size_ < INLINE_WORDS) {
+		inline_[size_++] = word;
+		return;
+	}
+	if (size_ == INLINE_WORDS) {
+		heap_.assign(inline_, inline_ + INLINE_WORDS);
+	}
+	heap_.push_back(word);
+	++size_;
+}
+
+// Words are separated by blanks outside of quotes. Quotes stay part of the
+// word; a backslash escapes the next character, and only words containing
+// one are copied to be unescaped.
 void Command::Parse(const string& cmd)
 {
+	cmd_ = cmd;
+	unescaped_.clear();
+	unescaped_.reserve(cmd_.size());
 	words_.clear();
 
-	size_t pos = 0;
-	string word = "";
-	char quote = '\0';
-	for (size_t i = 0; i < cmd.size(); ++i) {
-		char c = cmd[i];
-		if (quote == '\0' && (c == ' ' || c == '\t' || c == '\r' || c == '\n')) {
-			if (!word.empty()) {
-				if (words_.empty() && word.size() > 1) {
-					words_.push_back(make_pair(pos, word.substr(0, 1)));
-					words_.push_back(make_pair(pos + 1, word.substr(1)));
-				} else {
-					words_.push_back(make_pair(pos, word));
-				}
-			}
-			word = "";
-		} else {
-			if (word.empty()) {
-				pos = i;
+	auto isBlank = [](char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; };
+	size_t size = cmd_.size();
+	size_t i = 0;
+	while (i < size) {
+		if (isBlank(cmd_[i])) {
+			++i;
+			continue;
+		}
+		size_t start = i;
+		char quote = '\0';
+		bool escaped = false;
+		for (; i < size; ++i) {
+			char c = cmd_[i];
+			if (quote == '\0' && isBlank(c)) {
+				break;
 			}
 			if (c == '\'' || c == '\"') {
-				word += c;
-				if (quote == '\0') {
-					quote = c;
-				} else {
-					quote = '\0';
-				}
+				quote = quote == '\0' ? c : '\0';
 			} else if (c == '\\') {
-				if (i + 1 >= cmd.size()) {
-					break;
-				}
-				switch (cmd[++i]) {
-				case 'r': word += '\r'; break;
-				case 'n': word += '\n'; break;
-				case '\\': word += '\\'; break;
-				case '\'': word += '\''; break;
-				case '\"': word += '\"'; break;
-				default: word += cmd[i + 1]; break;
-				}
-			} else {
-				word += c;
+				escaped = true;
+				++i;
 			}
 		}
+		i = min(i, size);
+		string_view text(cmd_.data() + start, i - start);
+		AddWord(start, escaped ? Unescape(text) : text);
 	}
-	if (!word.empty()) {
-		if (words_.empty() && word.size() > 1) {
-			words_.push_back(make_pair(pos, word.substr(0, 1)));
-			words_.push_back(make_pair(pos + 1, word.substr(1)));
-		} else {
-			words_.push_back(make_pair(pos, word));
-		}
+}
+
+// The command letter may be written together with its first argument.
+void Command::AddWord(size_t pos, string_view text)
+{
+	if (text.empty()) {
+		return;
 	}
-	cmd_ = cmd;
+	if (words_.empty() && text.size() > 1) {
+		words_.push_back(Word{pos, text.substr(0, 1)});
+		words_.push_back(Word{pos + 1, text.substr(1)});
+	} else {
+		words_.push_back(Word{pos, text});
+	}
+}
 
-	//Dump();
+string_view Command::Unescape(string_view text)
+{
+	size_t start = unescaped_.size();
+	for (size_t i = 0; i < text.size(); ++i) {
+		if (text[i] != '\\') {
+			unescaped_ += text[i];
+			continue;
+		}
+		if (++i == text.size()) {
+			break;
+		}
+		switch (text[i]) {
+		case 'r': unescaped_ += '\r'; break;
+		case 'n': unescaped_ += '\n'; break;
+		default: unescaped_ += text[i]; break;
+		}
+	}
+	return string_view(unescaped_).substr(start);
 }
 
 void Command::Dump() const
 {
 	cerr << "[DEBUG] Split: '" << cmd_ << "' =>\n";
-	for (auto x : words_) {
+	for (const Word& x : words_) {
 		cerr << "[DEBUG]    (pos = " << x.first << "): '" << x.second << "'\n";
 	}
 	cerr << flush;
 }
 
-int Console::KeyboardHit()
+Console::~Console()
 {
-	struct timeval tv;
-	fd_set fds;
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
-	FD_ZERO(&fds);
-	FD_SET(STDIN_FILENO, &fds);
-	select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv);
-	return FD_ISSET(STDIN_FILENO, &fds);
+	SetRaw(false);
 }
 
-void Console::SetNonBlock(Console::NonBlock state)
+// Raw mode delivers keys without line editing or echo. The terminal stays
+// in raw mode until SetRaw(false), so a whole E session costs two tcsetattr
+// calls rather than two per key.
+void Console::SetRaw(bool on)
 {
-	struct termios ttystate;
-	tcgetattr(STDIN_FILENO, &ttystate);
-	if (state == NB_ENABLE) {
-		ttystate.c_lflag &= ~(ICANON | ECHO); // turn off 'canonical' and 'echo' mode
-		ttystate.c_cc[VMIN] = 1; // minimum of number input read.
-	} else if (state == NB_DISABLE) {
-		ttystate.c_lflag |= ICANON | ECHO; // turn on 'canonical' and 'echo' mode
+	if (on && !raw_) {
+		if (tcgetattr(STDIN_FILENO, &saved_) != 0) {
+			return; // not a terminal; input is read as is
+		}
+		struct termios raw = saved_;
+		raw.c_lflag &= ~(ICANON | ECHO);
+		raw.c_cc[VMIN] = 1;  // block until at least one byte arrives
+		raw.c_cc[VTIME] = 0;
+		tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+		raw_ = true;
+	} else if (!on && raw_) {
+		tcsetattr(STDIN_FILENO, TCSANOW, &saved_);
+		raw_ = false;
 	}
-	tcsetattr(STDIN_FILENO, TCSANOW, &ttystate);
 }
 
+// Blocks until a key is available. A read returns everything that has
+// arrived, so pasted text is taken in one call and handed out per byte.
 int Console::GetInputChar()
 {
-	SetNonBlock(NB_ENABLE);
-	for (;;) {
-		if (KeyboardHit()) {
-			int c = fgetc(stdin);
-			SetNonBlock(NB_DISABLE);
-			return c;
+	while (pos_ == size_) {
+		ssize_t n = read(STDIN_FILENO, buffer_, sizeof(buffer_));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return EOF;
 		}
-		usleep(0);
+		pos_ = 0;
+		size_ = n;
 	}
+	return buffer_[pos_++];
 }
 
-bool ConsoleUI::Init(Registers& registers, Memory& memory, const vector<string>& args)
+// Moves input that was read ahead in raw mode, up to and including the
+// first newline, into line. Returns true if a newline was found.
+bool Console::TakePending(string& line)
 {
-	curSeg_ = registers.GetDS();
-	if (!args.empty()) {
-		filename_ = args[0];
-		unsigned short size;
-		if (!memory.Load(filename_, curSeg_, cursor_, size)) {
-			return false;
-		}
-		registers.Set("cx", size);
-		if (args.size() > 1) {
-			args_ = vector<string>(args.begin() + 1, args.end());
+	while (pos_ < size_) {
+		char c = static_cast<char>(buffer_[pos_++]);
+		if (c == '\n') {
+			return true;
 		}
+		line += c;
 	}
-	return true;
+	return false;
 }
 
-Command ConsoleUI::GetCommand()
+// Appends the whole of a file to contents; "-" is standard input.
+bool ReadWholeFile(const string& filename, string& contents)
 {
-	ShowPrompt();
-	string line = ReadLine();
-	Command cmd;
-	cmd.Parse(line);
-	return cmd;
+	int fd = filename == "-" ? STDIN_FILENO : open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	static const size_t CHUNK_SIZE = 1 << 20;
+	size_t chunk = CHUNK_SIZE;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		contents.reserve(contents.size() + st.st_size);
+		chunk = min(chunk, static_cast<size_t>(st.st_size) + 1);
+	}
+	vector<char> buf(chunk);
+	ssize_t n;
+	while ((n = read(fd, buf.data(), buf.size())) != 0) {
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			break;  // EISDIR and the like: not a readable file
+		}
+		contents.append(buf.data(), n);
+	}
+	if (fd != STDIN_FILENO) {
+		close(fd);
+	}
+	return n == 0;
 }
 
-void ConsoleUI::ShowPrompt() const
+namespace {
+
+// A file mapped read-only into memory.
+class MappedFile
 {
-	cout << prompt_ << flush;
-}
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile()
+	{
+		if (data_) {
+			munmap(data_, size_);
+		}
+	}
+
+	bool Open(const string& filename);
+	const unsigned char* GetData() const { return static_cast<const unsigned char*>(data_); }
+	size_t GetSize() const { return size_; }
+private:
+	void* data_ = nullptr;
+	size_t size_ = 0;
+};
 
-string ConsoleUI::ReadLine()
+bool MappedFile::Open(const string& filename)
 {
-	static const size_t BUFFER_SIZE = 4096;
-	char buffer[BUFFER_SIZE];
-	fgets(buffer, sizeof(buffer), stdin);
-	size_t size = strlen(buffer);
-	if (size > 0 && buffer[size - 1] == '\n') {
-		buffer[size - 1] = '\0';
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return false;
+	}
+	void* data = st.st_size > 0 ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+	close(fd);
+	if (data == MAP_FAILED) {
+		return false;
 	}
-	return buffer;
+	data_ = data;
+	size_ = st.st_size;
+	return true;
 }
 
-void ConsoleUI::PrintUsage()
+// Fixed part of the 28-byte MZ header, in little-endian words.
+enum MzField {
+	MZ_SIGNATURE, MZ_LAST_PAGE_BYTES, MZ_PAGES, MZ_RELOCATIONS, MZ_HEADER_PARAGRAPHS,
+	MZ_MIN_ALLOC, MZ_MAX_ALLOC, MZ_SS, MZ_SP, MZ_CHECKSUM, MZ_IP, MZ_CS, MZ_RELOCATION_TABLE,
+	MZ_FIELD_COUNT
+};
+
+unsigned short LoadWord(const unsigned char* p)
 {
-	printf("Classical Debug (v0.01)\n");
-	printf("Altering memory:\n");
-	printf("compare      C range address            hex add/sub  H value1 value2\n");
-	printf("dump         D [range]                  move         M range address\n");
-	printf("enter        E address [list]           search       S range list\n");
-	printf("fill         F range list               expanded mem XA/XD/XM/XS (X? for help)\n");
-	printf("\n");
-	printf("Assemble/Disassemble:\n");
-	printf("assemble     A [address]                unassemble   U [range]\n");
-	printf("80x86 mode   M x (0..6, ? for query)    set FPU mode MC 387, MNC none, MC2 287\n");
-	printf("\n");
-	printf("Program execution:\n");
-	printf("go           G [=address] [breakpts]    quit         Q\n");
-	printf("proceed      P [=address] [count]       trace        T [=address] [count]\n");
-	printf("register     R register [value]         all regs     R\n");
-	printf("input        I port                     output       O port type\n");
-	printf("\n");
-	printf("Disk access:\n");
-	printf("set name     N [[drive:][path]progname [arglist]]\n");
-	printf("load program L [address]\n");
-	printf("load         L address drive sector number\n");
-	printf("write prog.  W [address]\n");
-	printf("write        W address drive sector number\n");
+	return static_cast<unsigned short>(p[0] | (p[1] << 8));
 }
 
-void ConsoleUI::ShowError(size_t space, const char* fmt, ...)
+// Parses a file name argument into an unopened FCB, as EXEC does for the
+// first two arguments: drive (1 = A:), name and extension blank padded,
+// '*' expanded to '?'.
+void FillFcb(unsigned char* fcb, const string& arg)
 {
-	va_list vl;
-	va_start(vl, fmt);
-	for (size_t i = 0; i < prompt_.size() + space; ++i) {
-		fprintf(stdout, " ");
+	memset(fcb, ' ', 12);
+	fcb[0] = 0;
+	size_t i = 0;
+	if (arg.size() >= 2 && arg[1] == ':' && isalpha(static_cast<unsigned char>(arg[0]))) {
+		fcb[0] = static_cast<unsigned char>(toupper(arg[0]) - 'A' + 1);
+		i = 2;
 	}
-	fprintf(stdout, "^ Error: ");
-	vfprintf(stdout, fmt, vl);
+	for (size_t field = 1, length = 8; field <= 9; field += 8, length = 3) {
+		for (size_t n = 0; i < arg.size() && arg[i] != '.'; ++i) {
+			if (arg[i] == '*') {
+				memset(fcb + field + n, '?', length - n);
+				n = length;
+			} else if (n < length) {
+				fcb[field + n++] = static_cast<unsigned char>(toupper(arg[i]));
+			}
+		}
+		if (i < arg.size()) {
+			++i;  // the dot
+		}
+	}
+}
+
+// Program Segment Prefix with the command tail built from args.
+void BuildPsp(unsigned char* psp, const vector<string>& args)
+{
+	static const unsigned short MEMORY_TOP = 0xA000;
+	static const size_t MAX_TAIL = 126;
+
+	memset(psp, 0, 0x100);
+	psp[0x00] = 0xCD;  // INT 20h
+	psp[0x01] = 0x20;
+	psp[0x02] = static_cast<unsigned char>(MEMORY_TOP);
+	psp[0x03] = static_cast<unsigned char>(MEMORY_TOP >> 8);
+	psp[0x50] = 0xCD;  // INT 21h / RETF
+	psp[0x51] = 0x21;
+	psp[0x52] = 0xCB;
+	FillFcb(psp + 0x5C, args.size() > 0 ? args[0] : string());
+	FillFcb(psp + 0x6C, args.size() > 1 ? args[1] : string());
+
+	string tail;
+	for (const string& arg : args) {
+		tail += ' ' + arg;
+	}
+	tail.resize(min(tail.size(), MAX_TAIL));
+	psp[0x80] = static_cast<unsigned char>(tail.size());
+	memcpy(psp + 0x81, tail.data(), tail.size());
+	psp[0x81 + tail.size()] = 0x0D;
+}
+
+} // namespace
+
+// Loads a program as DOS EXEC does, with its PSP at the current DS. A COM
+// image goes to PSP:0100 with all segments at the PSP; an MZ executable's
+// load module goes right above the PSP, is relocated, and starts at the
+// CS:IP and SS:SP of its header. BX:CX receives the size loaded.
+bool LoadProgram(const string& filename, const vector<string>& args, Registers& registers,
+		Memory& memory, unsigned& size, bool& executable)
+{
+	MappedFile file;
+	if (!file.Open(filename)) {
+		return false;
+	}
+	const unsigned char* data = file.GetData();
+	unsigned short psp = registers.GetDS();
+	unsigned char prefix[0x100];
+	BuildPsp(prefix, args);
+
+	unsigned short header[MZ_FIELD_COUNT];
+	executable = file.GetSize() >= sizeof(header) &&
+			((data[0] == 'M' && data[1] == 'Z') || (data[0] == 'Z' && data[1] == 'M'));
+	if (!executable) {
+		unsigned linear = Memory::Linear(psp, 0x100);
+		size = static_cast<unsigned>(min<size_t>(file.GetSize(), Memory::MEMORY_SIZE - linear));
+		memory.CopyIn(Memory::Linear(psp, 0), prefix, sizeof(prefix));
+		memory.CopyIn(linear, data, size);
+		for (int seg : { Registers::ES, Registers::CS, Registers::SS, Registers::DS }) {
+			registers.Set(seg, psp);
+		}
+		registers.Set(Registers::IP, 0x100);
+		registers.Set(Registers::SP, 0xFFFE);
+		// A final RET reaches INT 20h at PSP:0000, unless the image itself
+		// covers PSP:FFFE; a large BIN image or dump is left as loaded.
+		if (size <= 0xFF00 - 2) {
+			memory.WriteWord(psp, 0xFFFE, 0);
+		}
+	} else {
+		for (unsigned i = 0; i < MZ_FIELD_COUNT; ++i) {
+			header[i] = LoadWord(data + 2 * i);
+		}
+		size_t imageEnd = header[MZ_PAGES] * 512ULL;
+		if (header[MZ_LAST_PAGE_BYTES] != 0 && imageEnd >= 512) {
+			imageEnd -= 512 - header[MZ_LAST_PAGE_BYTES];
+		}
+		imageEnd = min(imageEnd, file.GetSize());
+		size_t headerSize = header[MZ_HEADER_PARAGRAPHS] * 16ULL;
+		size_t relocationEnd = header[MZ_RELOCATION_TABLE] + header[MZ_RELOCATIONS] * 4ULL;
+		unsigned short loadSeg = static_cast<unsigned short>(psp + 0x10);
+		unsigned base = Memory::Linear(loadSeg, 0);
+		if (headerSize > imageEnd || relocationEnd > file.GetSize() ||
+				base < Memory::Linear(psp, 0) || imageEnd - headerSize > Memory::MEMORY_SIZE - base) {
+			return false;
+		}
+		size = static_cast<unsigned>(imageEnd - headerSize);
+
+		// The load module goes straight from the mapping to memory; the
+		// fix-ups are then applied to that one copy.
+		memory.CopyIn(Memory::Linear(psp, 0), prefix, sizeof(prefix));
+		memory.CopyIn(base, data + headerSize, size);
+		memory.Relocate(base, size, data + header[MZ_RELOCATION_TABLE], header[MZ_RELOCATIONS], loadSeg);
+		registers.Set(Registers::ES, psp);
+		registers.Set(Registers::DS, psp);
+		registers.Set(Registers::CS, static_cast<unsigned short>(loadSeg + header[MZ_CS]));
+		registers.Set(Registers::IP, header[MZ_IP]);
+		registers.Set(Registers::SS, static_cast<unsigned short>(loadSeg + header[MZ_SS]));
+		registers.Set(Registers::SP, header[MZ_SP]);
+	}
+	registers.Set(Registers::AX, 0);
+	registers.Set(Registers::BX, static_cast<unsigned short>(size >> 16));
+	registers.Set(Registers::CX, static_cast<unsigned short>(size));
+	return true;
+}
+
+bool ConsoleUI::Init(Registers& registers, Memory& memory, const vector<string>& args)
+{
+	curSeg_ = registers.GetDS();
+	if (!args.empty()) {
+		filename_ = args[0];
+		args_ = vector<string>(args.begin() + 1, args.end());
+		unsigned size;
+		if (!LoadProgram(filename_, args_, registers, memory, size, executable_)) {
+			return false;
+		}
+		if (!executable_) {
+			RememberSync(memory, curSeg_, cursor_, size);
+		}
+	}
+	return true;
+}
+
+// Reads the command stream of a batch session; "-" is standard input.
+bool ConsoleUI::SetBatchInput(const string& filename)
+{
+	if (!ReadWholeFile(filename, input_)) {
+		return false;
+	}
+
+	batch_ = true;
+	batchName_ = filename == "-" ? "<stdin>" : filename;
+	static char outBuffer[1 << 16];
+	setvbuf(stdout, outBuffer, _IOFBF, sizeof(outBuffer));
+	return true;
+}
+
+bool ConsoleUI::GetCommand(Command& cmd)
+{
+	ShowPrompt();
+	string line;
+	if (!ReadLine(line)) {
+		return false;
+	}
+	cmd.Parse(line);
+	return true;
+}
+
+void ConsoleUI::ShowPrompt() const
+{
+	if (!batch_) {
+		cout << prompt_ << flush;
+	}
+}
+
+// Output is coalesced in batch mode and only flushed when the stream ends.
+void ConsoleUI::Flush() const
+{
+	if (!batch_) {
+		fflush(stdout);
+	}
+}
+
+bool ConsoleUI::ReadLine(string& line)
+{
+	if (batch_) {
+		if (inputPos_ >= input_.size()) {
+			return false;
+		}
+		size_t end = input_.find('\n', inputPos_);
+		if (end == string::npos) {
+			end = input_.size();
+		}
+		line.assign(input_, inputPos_, end - inputPos_);
+		inputPos_ = end + 1;
+		++lineNumber_;
+		return true;
+	}
+
+	// Text pasted during an E session may already hold the next command.
+	line.clear();
+	if (console_.TakePending(line)) {
+		printf("%s\n", line.c_str());
+		return true;
+	}
+	if (!line.empty()) {
+		printf("%s", line.c_str());
+		fflush(stdout);
+	}
+
+	static const size_t BUFFER_SIZE = 4096;
+	char buffer[BUFFER_SIZE];
+	if (!fgets(buffer, sizeof(buffer), stdin)) {
+		return !line.empty();
+	}
+	size_t size = strlen(buffer);
+	if (size > 0 && buffer[size - 1] == '\n') {
+		buffer[size - 1] = '\0';
+	}
+	line += buffer;
+	return true;
+}
+
+void ConsoleUI::PrintUsage()
+{
+	printf("Classical Debug (v0.01)\n");
+	printf("Altering memory:\n");
+	printf("compare      C range address [/B]       hex add/sub  H value1 value2\n");
+	printf("dump         D [range | addr L len]     move         M range address\n");
+	printf("enter        E address [list]           search       S range|* list[|list]\n");
+	printf("fill         F range list               expanded mem XA/XD/XM/XS (X? for help)\n");
+	printf("\n");
+	printf("Assemble/Disassemble:\n");
+	printf("assemble     A [address]                unassemble   U [range]\n");
+	printf("80x86 mode   M x (0..6, ? for query)    set FPU mode MC 387, MNC none, MC2 287\n");
+	printf("\n");
+	printf("Program execution:\n");
+	printf("go           G [=address] [breakpts]    quit         Q\n");
+	printf("proceed      P [=address] [count]       trace        T [=address] [count]\n");
+	printf("register     R register [value]         all regs     R\n");
+	printf("breakpoint   BP address [reg op value]  clear/list   BC address|*, BL\n");
+	printf("watchpoint   BW address [end]\n");
+	printf("snapshot     ZS/ZR/ZD [n]               list snaps   ZL\n");
+	printf("record trace YR file                    stop record  YS\n");
+	printf("replay trace YP file step               trace info   YI file\n");
+	printf("profile      KS start, KE end           hot spots    KP [count]\n");
+	printf("input        I port                     output       O port type\n");
+	printf("\n");
+	printf("Disk access:\n");
+	printf("set name     N [[drive:][path]progname [arglist]]\n");
+	printf("load program L [address]\n");
+	printf("load         L address drive sector number\n");
+	printf("write prog.  W [address]\n");
+	printf("write        W address drive sector number\n");
+}
+
+void ConsoleUI::ShowError(size_t space, const char* fmt, ...)
+{
+	va_list vl;
+	va_start(vl, fmt);
+	if (batch_) {
+		fflush(stdout);
+		fprintf(stderr, "%s:%u:%zu: Error: ", batchName_.c_str(), lineNumber_, space + 1);
+		vfprintf(stderr, fmt, vl);
+		fprintf(stderr, "\n");
+		failed_ = true;
+		va_end(vl);
+		return;
+	}
+	for (size_t i = 0; i < prompt_.size() + space; ++i) {
+		fprintf(stdout, " ");
+	}
+	fprintf(stdout, "^ Error: ");
+	vfprintf(stdout, fmt, vl);
 	fprintf(stdout, "\n");
 	fflush(stdout);
+	va_end(vl);
 }
 
 bool ParseHex(char c, unsigned char& value)
@@ -367,7 +1439,7 @@ bool ParseHex(char c, unsigned char& value)
 }
 
 template <class T>
-bool ParseHex(const string& s, T& value)
+bool ParseHex(string_view s, T& value)
 {
 	value = 0;
 	for (size_t i = 0; i < s.size(); ++i) {
@@ -380,30 +1452,30 @@ bool ParseHex(const string& s, T& value)
 	return true;
 }
 
-bool ParseOffset(const string& s, unsigned short& offset, size_t& errPos, string& errInfo)
+bool ParseOffset(string_view s, unsigned short& offset, size_t& errPos, string& errInfo)
 {
 	if (!ParseHex(s, offset)) {
 		errPos = 0;
-		errInfo = "Invalid offset value '" + s + "'";
+		errInfo = "Invalid offset value '" + string(s) + "'";
 		return false;
 	}
 	return true;
 }
 
-bool ParseAddress(const string& s, unsigned short& seg, unsigned short& offset, size_t& errPos, string& errInfo, Registers& registers)
+bool ParseAddress(string_view s, unsigned short defaultSeg, unsigned short& seg, unsigned short& offset, size_t& errPos, string& errInfo, Registers& registers)
 {
 	auto text = s;
 	size_t skip = 0;
 	auto pos = text.find_first_of(':');
 	if (pos == string::npos) {
-		seg = registers.GetDS();
+		seg = defaultSeg;
 	} else {
 		skip = pos + 1;
 		auto segReg = text.substr(0, pos);
 		text = text.substr(pos + 1);
 		if (!registers.GetSeg(segReg, seg) && !ParseHex(segReg, seg)) {
 			errPos = 0;
-			errInfo = "Invalid segment register/value '" + segReg + "'";
+			errInfo = "Invalid segment register/value '" + string(segReg) + "'";
 			return false;
 		}
 	}
@@ -414,6 +1486,11 @@ bool ParseAddress(const string& s, unsigned short& seg, unsigned short& offset,
 	return true;
 }
 
+bool ParseAddress(string_view s, unsigned short& seg, unsigned short& offset, size_t& errPos, string& errInfo, Registers& registers)
+{
+	return ParseAddress(s, registers.GetDS(), seg, offset, errPos, errInfo, registers);
+}
+
 bool ConsoleUI::EnsureArgumentCount(const Command& cmd, size_t min, size_t max)
 {
 	if (cmd.GetWords().size() < min) {
@@ -427,11 +1504,22 @@ bool ConsoleUI::EnsureArgumentCount(const Command& cmd, size_t min, size_t max)
 	}
 }
 
+// C range address [/B]
+// Differences are listed as ranges; /B lists every differing byte like DEBUG.
 void ConsoleUI::CompareMemory(const Command& cmd, Registers& registers, Memory& memory)
 {
-	if (!EnsureArgumentCount(cmd, 4, 4)) {
+	if (!EnsureArgumentCount(cmd, 4, 5)) {
 		return;
 	}
+	bool perByte = false;
+	if (cmd.GetWords().size() == 5) {
+		const auto& option = cmd.GetWords()[4];
+		if (option.second != "/B" && option.second != "/b") {
+			ShowError(option.first, "Unknown option '%s'", string(option.second).c_str());
+			return;
+		}
+		perByte = true;
+	}
 
 	unsigned short srcSeg, srcStart, srcEnd;
 	unsigned short dstSeg, dstStart;
@@ -449,7 +1537,7 @@ void ConsoleUI::CompareMemory(const Command& cmd, Registers& registers, Memory&
 		ShowError(cmd.GetWords()[3].first + errPos, errInfo.c_str());
 		return;
 	}
-	memory.Compare(srcSeg, srcStart, srcEnd, dstSeg, dstStart);
+	memory.Compare(srcSeg, srcStart, srcEnd, dstSeg, dstStart, perByte);
 }
 
 void ConsoleUI::CopyMemory(const Command& cmd, Registers& registers, Memory& memory)
@@ -457,7 +1545,7 @@ void ConsoleUI::CopyMemory(const Command& cmd, Registers& registers, Memory& mem
 	unsigned short seg, start, end, dstSeg, dstStart;
 	size_t errPos;
 	string errInfo;
-	auto words = cmd.GetWords();
+	const auto& words = cmd.GetWords();
 	if (!ParseAddress(words[1].second, seg, start, errPos, errInfo, registers)) {
 		ShowError(words[1].first + errPos, errInfo.c_str());
 		return;
@@ -482,7 +1570,7 @@ void ConsoleUI::EnterData(const Command& cmd, Registers& registers, Memory& memo
 	unsigned short seg, start;
 	size_t errPos;
 	string errInfo;
-	auto words = cmd.GetWords();
+	const auto& words = cmd.GetWords();
 	if (!ParseAddress(words[1].second, seg, start, errPos, errInfo, registers)) {
 		ShowError(words[1].first + errPos, errInfo.c_str());
 		return;
@@ -499,13 +1587,37 @@ void ConsoleUI::EnterData(const Command& cmd, Registers& registers, Memory& memo
 			} else {
 				unsigned char value;
 				if (!ParseHex(words[i].second, value)) {
-					ShowError(words[i].first, "Invalid hex value '%s'", words[i].second.c_str());
+					ShowError(words[i].first, "Invalid hex value '%s'", string(words[i].second).c_str());
 					return;
 				}
 				data.push_back(value);
 			}
 		}
+	} else if (batch_) {
+		// Without a terminal the values come from the next line of the stream;
+		// "." or an empty field keeps the current byte.
+		string line;
+		if (!ReadLine(line)) {
+			ShowError(cmd.GetCmdSize(), "Missing argument");
+			return;
+		}
+		size_t pos = 0;
+		for (unsigned short offset = start; pos < line.size(); ++offset) {
+			size_t end = line.find_first_of(" \t\r", pos);
+			if (end == string::npos) {
+				end = line.size();
+			}
+			string word = line.substr(pos, end - pos);
+			pos = end + 1;
+			unsigned char value = memory.GetChar(seg, offset);
+			if (!word.empty() && word != "." && (word.size() > 2 || !ParseHex(word, value))) {
+				ShowError(end - word.size(), "Invalid hex value '%s'", word.c_str());
+				return;
+			}
+			data.push_back(value);
+		}
 	} else {
+		console_.SetRaw(true);
 		string word = "";
 		bool exitFlag = false;
 		for (unsigned short offset = start; !exitFlag; ++offset) {
@@ -519,8 +1631,10 @@ void ConsoleUI::EnterData(const Command& cmd, Registers& registers, Memory& memo
 			printf("%02X.", oriValue);
 			fflush(stdout);
 			for (;;) {
-				Console console;
-				int c = console.GetInputChar();
+				int c = console_.GetInputChar();
+				if (c == EOF) {
+					c = '\n';
+				}
 				if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f')) {
 					if (word.size() < 2) {
 						printf("%c", c);
@@ -557,47 +1671,69 @@ void ConsoleUI::EnterData(const Command& cmd, Registers& registers, Memory& memo
 			fflush(stdout);
 			word = "";
 		}
+		console_.SetRaw(false);
 		printf("\n");
 	}
 	memory.PutData(seg, start, data);
 }
 
+// S range list [| list ...]
+// The range is "address offset", or "*" for all of memory. Several patterns
+// separated by "|" are searched for in one pass.
 void ConsoleUI::SearchData(const Command& cmd, Registers& registers, Memory& memory)
 {
-	if (cmd.GetWords().size() < 4) {
+	const auto& words = cmd.GetWords();
+	bool allMemory = words.size() > 1 && words[1].second == "*";
+	size_t first = allMemory ? 2 : 3;
+	if (words.size() <= first) {
 		ShowError(cmd.GetCmdSize(), "Missing argument");
 		return;
 	}
-	unsigned short seg, start, end;
+	unsigned short seg = 0, start = 0, end = 0;
 	size_t errPos;
 	string errInfo;
-	auto words = cmd.GetWords();
-	if (!ParseAddress(words[1].second, seg, start, errPos, errInfo, registers)) {
-		ShowError(words[1].first + errPos, errInfo.c_str());
-		return;
-	}
-	if (!ParseOffset(words[2].second, end, errPos, errInfo)) {
-		ShowError(words[2].first + errPos, errInfo.c_str());
-		return;
+	if (!allMemory) {
+		if (!ParseAddress(words[1].second, seg, start, errPos, errInfo, registers)) {
+			ShowError(words[1].first + errPos, errInfo.c_str());
+			return;
+		}
+		if (!ParseOffset(words[2].second, end, errPos, errInfo)) {
+			ShowError(words[2].first + errPos, errInfo.c_str());
+			return;
+		}
 	}
-	vector<unsigned char> data;
-	for (size_t i = 3; i < cmd.GetWords().size(); ++i) {
-		if (words[i].second[0] == '\'' || words[i].second[0] == '\"') {
+	vector<vector<unsigned char>> patterns(1);
+	for (size_t i = first; i < words.size(); ++i) {
+		if (words[i].second == "|") {
+			if (patterns.back().empty()) {
+				ShowError(words[i].first, "Empty pattern");
+				return;
+			}
+			patterns.emplace_back();
+		} else if (words[i].second[0] == '\'' || words[i].second[0] == '\"') {
 			for (size_t j = 0; j < words[i].second.size(); ++j) {
 				if (words[i].second[j] != words[i].second[0]) {
-					data.push_back(words[i].second[j]);
+					patterns.back().push_back(words[i].second[j]);
 				}
 			}
 		} else {
 			unsigned char x;
 			if (!ParseHex(words[i].second, x)) {
-				ShowError(words[i].first + errPos, errInfo.c_str());
+				ShowError(words[i].first, "Invalid hex value '%s'", string(words[i].second).c_str());
 				return;
 			}
-			data.push_back(x);
+			patterns.back().push_back(x);
 		}
 	}
-	memory.SearchData(seg, start, end, data);
+	if (patterns.back().empty()) {
+		ShowError(cmd.GetCmdSize(), "Missing argument");
+		return;
+	}
+	if (allMemory) {
+		memory.SearchAll(patterns);
+	} else {
+		memory.SearchData(seg, start, end, patterns);
+	}
 }
 
 void ConsoleUI::FillData(const Command& cmd, Registers& registers, Memory& memory)
@@ -609,7 +1745,7 @@ void ConsoleUI::FillData(const Command& cmd, Registers& registers, Memory& memor
 	unsigned short seg, start, end;
 	size_t errPos;
 	string errInfo;
-	auto words = cmd.GetWords();
+	const auto& words = cmd.GetWords();
 	if (!ParseAddress(words[1].second, seg, start, errPos, errInfo, registers)) {
 		ShowError(words[1].first + errPos, errInfo.c_str());
 		return;
@@ -622,7 +1758,7 @@ void ConsoleUI::FillData(const Command& cmd, Registers& registers, Memory& memor
 	for (size_t i = 3; i < cmd.GetWords().size(); ++i) {
 		unsigned char x;
 		if (!ParseHex(words[i].second, x)) {
-			ShowError(words[i].first + errPos, errInfo.c_str());
+			ShowError(words[i].first, "Invalid hex value '%s'", string(words[i].second).c_str());
 			return;
 		}
 		data.push_back(x);
@@ -633,6 +1769,14 @@ void ConsoleUI::FillData(const Command& cmd, Registers& registers, Memory& memor
 void ConsoleUI::SetFilename(const string& f)
 {
 	filename_ = f;
+	executable_ = false;
+}
+
+// File sizes are reported in BX:CX, as DEBUG does.
+void ConsoleUI::SetFileSize(Registers& registers, unsigned size)
+{
+	registers.Set(Registers::BX, static_cast<unsigned short>(size >> 16));
+	registers.Set(Registers::CX, static_cast<unsigned short>(size));
 }
 
 void ConsoleUI::LoadData(const Command& cmd, Registers& registers, Memory& memory)
@@ -647,15 +1791,20 @@ void ConsoleUI::LoadData(const Command& cmd, Registers& registers, Memory& memor
 	} else {
 		size_t errPos;
 		string errInfo;
-		auto words = cmd.GetWords();
+		const auto& words = cmd.GetWords();
 		if (!ParseAddress(words[1].second, seg, offset, errPos, errInfo, registers)) {
 			ShowError(words[1].first + errPos, errInfo.c_str());
 			return;
 		}
 	}
-	unsigned short size;
-	memory.Load(filename_, seg, offset, size);
-	registers.Set("cx", size);
+	unsigned size;
+	if (!memory.Load(filename_, seg, offset, size)) {
+		printf("File not found\n");
+		failed_ = batch_;
+		return;
+	}
+	SetFileSize(registers, size);
+	RememberSync(memory, seg, offset, size);
 }
 
 void ConsoleUI::WriteData(const Command& cmd, Registers& registers, Memory& memory)
@@ -670,631 +1819,5363 @@ void ConsoleUI::WriteData(const Command& cmd, Registers& registers, Memory& memo
 	} else {
 		size_t errPos;
 		string errInfo;
-		auto words = cmd.GetWords();
+		const auto& words = cmd.GetWords();
 		if (!ParseAddress(words[1].second, seg, offset, errPos, errInfo, registers)) {
 			ShowError(words[1].first + errPos, errInfo.c_str());
 			return;
 		}
 	}
-	unsigned short size;
-	registers.Get("cx", size);
-	memory.Write(filename_, seg, offset, size);
+	if (executable_) {
+		printf("EXE and HEX files cannot be written\n");
+		failed_ = batch_;
+		return;
+	}
+	unsigned size = (registers.Get(Registers::BX) << 16) | registers.Get(Registers::CX);
+	printf("Writing %05X bytes\n", size);
+	bool ok;
+	if (InSync(seg, offset, size)) {
+		unsigned written;
+		ok = memory.WriteChanges(filename_, seg, offset, size, written);
+	} else {
+		ok = memory.Write(filename_, seg, offset, size);
+	}
+	if (!ok) {
+		printf("Write error\n");
+		failed_ = batch_;
+		synced_.name.clear();
+		return;
+	}
+	RememberSync(memory, seg, offset, size);
+}
+
+// Starts dirty tracking afresh for a file that now matches memory.
+void ConsoleUI::RememberSync(Memory& memory, unsigned short seg, unsigned short offset, unsigned size)
+{
+	memory.ClearDirty();
+	synced_.name.clear();
+	size = min(size, static_cast<unsigned>(Memory::MEMORY_SIZE - Memory::Linear(seg, offset)));
+	if (stat(filename_.c_str(), &synced_.st) == 0 &&
+			static_cast<unsigned long long>(synced_.st.st_size) == size) {
+		synced_.name = filename_;
+		synced_.linear = Memory::Linear(seg, offset);
+		synced_.size = size;
+	}
+}
+
+// True if W of this range may write just the dirty pages: the file is the
+// one remembered and nobody has touched it since.
+bool ConsoleUI::InSync(unsigned short seg, unsigned short offset, unsigned size) const
+{
+	struct stat st;
+	size = min(size, static_cast<unsigned>(Memory::MEMORY_SIZE - Memory::Linear(seg, offset)));
+	return !synced_.name.empty() && synced_.name == filename_ &&
+			synced_.linear == Memory::Linear(seg, offset) && synced_.size == size &&
+			stat(filename_.c_str(), &st) == 0 &&
+			st.st_dev == synced_.st.st_dev && st.st_ino == synced_.st.st_ino &&
+			st.st_size == synced_.st.st_size &&
+			st.st_mtim.tv_sec == synced_.st.st_mtim.tv_sec &&
+			st.st_mtim.tv_nsec == synced_.st.st_mtim.tv_nsec;
 }
 
+// U [address [end | L length]]
+// Without an end or length, 32 bytes are decoded linearly as DEBUG does.
 void ConsoleUI::Unassemble(const Command& cmd, Registers& registers, Memory& memory)
 {
-	if (!EnsureArgumentCount(cmd, 1, 2)) {
+	unsigned short seg = curSeg_, offset = cursor_;
+	unsigned long long count = 0;
+	if (!ParseRange(cmd, registers, seg, offset, count)) {
 		return;
 	}
-	unsigned short seg, offset;
-	if (cmd.GetWords().size() == 1) {
-		seg = curSeg_;
-		offset = cursor_;
-	} else {
-		size_t errPos;
-		string errInfo;
-		auto words = cmd.GetWords();
-		if (!ParseAddress(words[1].second, seg, offset, errPos, errInfo, registers)) {
-			ShowError(words[1].first + errPos, errInfo.c_str());
-			return;
-		}
+	curSeg_ = seg;
+	if (count == 0) {
+		cursor_ = memory.Unassemble(seg, offset);
+		return;
 	}
-	memory.Unassemble(seg, offset);
+	memory.Unassemble(seg, offset, count);
+	unsigned long long next = offset + count;
+	curSeg_ = static_cast<unsigned short>(seg + (next >> 16) * 0x1000);
+	cursor_ = static_cast<unsigned short>(next);
 }
 
-void ConsoleUI::DumpMemory(const Command& cmd, Registers& registers, Memory& memory)
+Processor* g_runningProcessor = nullptr;
+
+void OnInterruptSignal(int)
 {
-	if (cmd.GetWords().size() > 3) {
-		auto words = cmd.GetWords();
-		ShowError(words[3].first, "Unexpected argument");
-		return;
+	if (g_runningProcessor) {
+		g_runningProcessor->RequestBreak();
 	}
+}
 
-	unsigned short seg, start, end;
-	if (cmd.GetWords().size() == 1) {
-		seg = curSeg_;
-		start = cursor_;
-		end = start + 0x80 - 1;
-	} else {
+bool ConsoleUI::ParseStartAddress(const Command& cmd, size_t& index, Registers& registers)
+{
+	const auto& words = cmd.GetWords();
+	if (index < words.size() && words[index].second[0] == '=') {
+		unsigned short seg, offset;
 		size_t errPos;
 		string errInfo;
-		auto words = cmd.GetWords();
-		if (!ParseAddress(words[1].second, seg, start, errPos, errInfo, registers)) {
-			ShowError(words[1].first + errPos, errInfo.c_str());
-			return;
-		}
-		if (cmd.GetWords().size() > 2) {
-			if (!ParseOffset(words[2].second, end, errPos, errInfo)) {
-				ShowError(words[2].first + errPos, errInfo.c_str());
-				return;
-			}
-		} else {
-			end = start + 0x80 - 1;
+		if (!ParseAddress(words[index].second.substr(1), registers.GetCS(), seg, offset, errPos, errInfo, registers)) {
+			ShowError(words[index].first + 1 + errPos, errInfo.c_str());
+			return false;
 		}
+		registers.Set(Registers::CS, seg);
+		registers.Set(Registers::IP, offset);
+		++index;
 	}
-	memory.Dump(seg, start, end);
-	curSeg_ = seg;
-	cursor_ = end + 1;
+	return true;
 }
 
-void ConsoleUI::SwitchProcessorType(const Command& cmd, Processor& processor)
+StopReason ConsoleUI::Execute(Processor& processor, unsigned long long count, const Breakpoints& breakpoints)
 {
-	auto words = cmd.GetWords();
-	if (cmd.GetWords().size() == 1 || words[1].second == "?") {
-		processor.ShowProcessorType();
-	} else if (cmd.GetWords().size() > 2) {
-		ShowError(words[2].first, "Unexpected argument");
-	} else if (words[1].second == "0") {
-		processor.SetProcessorType(ProcessorType::PT_8086);
-	} else if (words[1].second == "1") {
-		processor.SetProcessorType(ProcessorType::PT_186);
-	} else if (words[1].second == "2") {
-		processor.SetProcessorType(ProcessorType::PT_286);
-	} else if (words[1].second == "3") {
-		processor.SetProcessorType(ProcessorType::PT_386);
-	} else if (words[1].second == "4") {
-		processor.SetProcessorType(ProcessorType::PT_486);
-	} else if (words[1].second == "5") {
-		processor.SetProcessorType(ProcessorType::PT_586);
-	} else if (words[1].second == "6") {
-		processor.SetProcessorType(ProcessorType::PT_686);
-	} else if (words[1].second == "nc") {
-		processor.SetCoProcessorType(CoProcessorType::CPT_NONE);
-	} else if (words[1].second == "c2") {
-		processor.SetCoProcessorType(CoProcessorType::CPT_287);
-	} else if (words[1].second == "c") {
-		processor.SetCoProcessorType(CoProcessorType::CPT_387);
-	} else {
-		ShowError(words[1].first, "Unexpected command '%s'", words[1].second.c_str());
-	}
+	struct sigaction action, saved;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = OnInterruptSignal;
+	sigemptyset(&action.sa_mask);
+	g_runningProcessor = &processor;
+	sigaction(SIGINT, &action, &saved);
+	StopReason reason = processor.Run(count, breakpoints);
+	sigaction(SIGINT, &saved, nullptr);
+	g_runningProcessor = nullptr;
+	return reason;
 }
 
-void ConsoleUI::HexCalc(const Command& cmd)
+// ZS [n]  save the machine state in slot n (default 0)
+// ZR [n]  restore slot n
+// ZD [n]  delete slot n
+// ZL      list slots
+void ConsoleUI::Snapshots(const Command& cmd, Processor& processor)
 {
-	if (!EnsureArgumentCount(cmd, 3, 3)) {
+	const auto& words = cmd.GetWords();
+	if (words.size() < 2) {
+		ShowError(cmd.GetCmdSize(), "Missing argument");
 		return;
 	}
-	unsigned short a, b;
-	auto words = cmd.GetWords();
-	if (!ParseHex(words[1].second, a)) {
-		ShowError(words[1].first, "Unexpected hex value '%s'", words[1].second.c_str());
+	char action = static_cast<char>(tolower(words[1].second[0]));
+	if (words[1].second.size() != 1 || strchr("srdl", action) == nullptr) {
+		ShowError(words[1].first, "Unsupported snapshot command '%s'", string(words[1].second).c_str());
 		return;
 	}
-	if (!ParseHex(words[2].second, b)) {
-		ShowError(words[2].first, "Unexpected hex value '%s'", words[2].second.c_str());
+	if (action == 'l') {
+		if (!EnsureArgumentCount(cmd, 2, 2)) {
+			return;
+		}
+		for (const auto& slot : snapshots_) {
+			const Registers& regs = slot.second.registers;
+			size_t pages = count_if(slot.second.memory.pages.begin(), slot.second.memory.pages.end(),
+					[](const Memory::ImagePage& page) { return page != nullptr; });
+			printf("%X  %04X:%04X  %zu pages\n", slot.first, regs.GetCS(), regs.GetIP(), pages);
+		}
 		return;
 	}
-	printf("%04X  %04X\n",
-			static_cast<unsigned short>(a + b),
-			static_cast<unsigned short>(a - b));
-}
 
-string Trim(const string& text)
-{
-	auto s = text;
-	auto start = s.find_first_not_of(" \t\r\n");
-	if (start == string::npos) {
-		s = "";
+	if (!EnsureArgumentCount(cmd, 2, 3)) {
+		return;
+	}
+	unsigned slot = 0;
+	if (words.size() == 3 && (words[2].second.size() > 8 || !ParseHex(words[2].second, slot))) {
+		ShowError(words[2].first, "Invalid snapshot number '%s'", string(words[2].second).c_str());
+		return;
+	}
+	if (action == 's') {
+		snapshots_[slot] = processor.Snapshot();
+		return;
+	}
+	auto it = snapshots_.find(slot);
+	if (it == snapshots_.end()) {
+		ShowError(words.size() == 3 ? words[2].first : cmd.GetCmdSize(), "No snapshot %X", slot);
+		return;
+	}
+	if (action == 'r') {
+		processor.Restore(it->second);
 	} else {
-		s = s.substr(start);
+		snapshots_.erase(it);
 	}
-	auto end = s.find_last_not_of(" \t\r\n");
-	if (end == string::npos) {
-		s = "";
+}
+
+namespace {
+
+const char* const kConditionOps[] = { "", "=", "!=", "<", "<=", ">", ">=" };
+
+} // namespace
+
+// BP address [reg op value]  set a breakpoint, stopping only while the
+//                            register test holds if one is given (CX=0)
+// BW address [end]           stop after any store into the range
+// BC address                 clear the breakpoint or watchpoints there;
+//                            BC * clears all
+// BL                         list breakpoints and watchpoints
+void ConsoleUI::SetBreakpoints(const Command& cmd, Registers& registers, Memory& memory)
+{
+	const auto& words = cmd.GetWords();
+	if (words.size() < 2) {
+		ShowError(cmd.GetCmdSize(), "Missing argument");
+		return;
+	}
+	char action = static_cast<char>(tolower(words[1].second[0]));
+	if (words[1].second.size() != 1 || strchr("pwcl", action) == nullptr) {
+		ShowError(words[1].first, "Unsupported breakpoint command '%s'", string(words[1].second).c_str());
+		return;
+	}
+	if (action == 'l') {
+		if (!EnsureArgumentCount(cmd, 2, 2)) {
+			return;
+		}
+		for (const auto& bp : breakpoints_.GetAll()) {
+			const Breakpoints::Condition& condition = bp.second;
+			if (condition.op == Breakpoints::Condition::NONE) {
+				printf("%05X\n", bp.first);
+			} else {
+				printf(Registers::IsByte(condition.reg) ? "%05X  %s%s%02X\n" : "%05X  %s%s%04X\n",
+						bp.first, Registers::Name(condition.reg), kConditionOps[condition.op], condition.value);
+			}
+		}
+		for (const Memory::WatchRange& watch : memory.GetWatches()) {
+			printf("%05X-%05X  write\n", watch.linear,
+					(watch.linear + watch.size - 1) & (Memory::MEMORY_SIZE - 1));
+		}
+		return;
+	}
+	if (action == 'c') {
+		if (!EnsureArgumentCount(cmd, 3, 3)) {
+			return;
+		}
+		if (words[2].second == "*") {
+			breakpoints_.ClearAll();
+			memory.ClearWatches();
+			return;
+		}
+	} else if (words.size() < 3) {
+		ShowError(cmd.GetCmdSize(), "Missing address");
+		return;
+	}
+
+	unsigned short seg, offset;
+	size_t errPos;
+	string errInfo;
+	if (!ParseAddress(words[2].second, registers.GetCS(), seg, offset, errPos, errInfo, registers)) {
+		ShowError(words[2].first + errPos, errInfo.c_str());
+		return;
+	}
+	unsigned linear = Memory::Linear(seg, offset);
+	if (action == 'c') {
+		bool cleared = breakpoints_.Clear(linear);
+		if (memory.RemoveWatch(linear)) {
+			cleared = true;
+		}
+		if (!cleared) {
+			ShowError(words[2].first, "No breakpoint at %05X", linear);
+		}
+		return;
+	}
+	if (action == 'w') {
+		if (!EnsureArgumentCount(cmd, 3, 4)) {
+			return;
+		}
+		unsigned short end = offset;
+		if (words.size() == 4 && (!ParseOffset(words[3].second, end, errPos, errInfo) || end < offset)) {
+			ShowError(words[3].first, "Invalid range end '%s'", string(words[3].second).c_str());
+			return;
+		}
+		memory.AddWatch(linear, end - offset + 1);
+		return;
+	}
+
+	// The condition may be written with or without spaces: CX=0, CX = 0.
+	Breakpoints::Condition condition;
+	if (words.size() > 3) {
+		string text;
+		for (size_t i = 3; i < words.size(); ++i) {
+			text += words[i].second;
+		}
+		size_t pos = text.find_first_of("=!<>");
+		if (pos == string::npos) {
+			ShowError(words[3].first, "Missing operator in condition '%s'", text.c_str());
+			return;
+		}
+		size_t end = text.find_first_not_of("=!<>", pos);
+		condition.reg = Registers::Find(text.data(), min(pos, text.size()));
+		if (condition.reg == Registers::NO_REG) {
+			ShowError(words[3].first, "Invalid register in condition '%s'", text.c_str());
+			return;
+		}
+		string op = text.substr(pos, end - pos);
+		for (unsigned i = Breakpoints::Condition::EQ; i <= Breakpoints::Condition::GE; ++i) {
+			if (op == kConditionOps[i] || (op == "==" && i == Breakpoints::Condition::EQ)) {
+				condition.op = static_cast<Breakpoints::Condition::Op>(i);
+			}
+		}
+		string value = end == string::npos ? "" : text.substr(end);
+		if (condition.op == Breakpoints::Condition::NONE) {
+			ShowError(words[3].first, "Invalid operator '%s'", op.c_str());
+			return;
+		}
+		size_t digits = Registers::IsByte(condition.reg) ? 2 : 4;
+		if (value.empty() || value.size() > digits || !ParseHex(value, condition.value)) {
+			ShowError(words[3].first, "Invalid value '%s'", value.c_str());
+			return;
+		}
+	}
+	breakpoints_.Set(linear, condition);
+}
+
+// YR file       record every executed instruction to file
+// YS            stop recording
+// YI file       show the length of a recorded trace
+// YP file step  restore the machine state after step instructions of a trace
+void ConsoleUI::Recording(const Command& cmd, Processor& processor)
+{
+	const auto& words = cmd.GetWords();
+	if (words.size() < 2) {
+		ShowError(cmd.GetCmdSize(), "Missing argument");
+		return;
+	}
+	char action = static_cast<char>(tolower(words[1].second[0]));
+	if (words[1].second.size() != 1 || strchr("rsip", action) == nullptr) {
+		ShowError(words[1].first, "Unsupported trace command '%s'", string(words[1].second).c_str());
+		return;
+	}
+	if (action == 's') {
+		if (!EnsureArgumentCount(cmd, 2, 2)) {
+			return;
+		}
+		if (!processor.IsTracing()) {
+			ShowError(words[1].first, "Not recording");
+		} else if (!processor.StopTrace()) {
+			ShowError(cmd.GetCmdSize(), "Write error");
+		}
+		return;
+	}
+	if (action == 'r') {
+		if (!EnsureArgumentCount(cmd, 3, 3)) {
+			return;
+		}
+		if (!processor.StartTrace(string(words[2].second))) {
+			ShowError(words[2].first, "Cannot create '%s'", string(words[2].second).c_str());
+		}
+		return;
+	}
+
+	if (!EnsureArgumentCount(cmd, action == 'i' ? 3 : 4, action == 'i' ? 3 : 4)) {
+		return;
+	}
+	TraceReader reader;
+	if (!reader.Open(string(words[2].second))) {
+		ShowError(words[2].first, "Invalid trace file '%s'", string(words[2].second).c_str());
+		return;
+	}
+	if (action == 'i') {
+		printf("%llX steps, %zu keyframes\n", reader.GetSteps(), reader.GetKeyframeCount());
+		return;
+	}
+	unsigned long long step = 0;
+	if (words[3].second.size() > 16 || !ParseHex(words[3].second, step)) {
+		ShowError(words[3].first, "Invalid step '%s'", string(words[3].second).c_str());
+		return;
+	}
+	if (!reader.Seek(step, processor.GetRegisters(), processor.GetMemory())) {
+		ShowError(words[3].first, "Trace has %llX steps", reader.GetSteps());
+	}
+}
+
+namespace {
+
+// Rough 8086 clock count of one execution: the datasheet time of the
+// instruction form plus the effective address calculation for a memory
+// operand. Jumps and loops count as taken, string instructions as one
+// iteration.
+unsigned EstimateCycles(const Instruction& ins)
+{
+	const Operand* mem = nullptr;
+	bool imm = false;
+	for (const Operand& o : ins.operands) {
+		if (o.type == OT_MEM) {
+			mem = &o;
+		} else if (o.type == OT_IMM) {
+			imm = true;
+		}
+	}
+	unsigned ea = 0;
+	if (mem) {
+		if (mem->reg == Operand::MEM_DIRECT) {
+			ea = 6;
+		} else if (mem->reg < 4) {
+			ea = mem->size ? 11 : 7;  // base + index [+ disp]
+		} else {
+			ea = mem->size ? 9 : 5;   // base or index [+ disp]
+		}
+		if (ins.segment != Instruction::NO_SEGMENT) {
+			ea += 2;
+		}
+	}
+	bool toMem = ins.operands[0].type == OT_MEM;
+	bool word = ins.width == 2;
+
+	switch (ins.mnemonic) {
+	case Mnemonic::ADD: case Mnemonic::OR: case Mnemonic::ADC: case Mnemonic::SBB:
+	case Mnemonic::AND: case Mnemonic::SUB: case Mnemonic::XOR:
+		return !mem ? (imm ? 4 : 3) : (toMem ? (imm ? 17 : 16) : 9) + ea;
+	case Mnemonic::CMP:
+		return !mem ? (imm ? 4 : 3) : (imm ? 10 : 9) + ea;
+	case Mnemonic::TEST:
+		return !mem ? (imm ? 5 : 3) : (imm ? 11 : 9) + ea;
+	case Mnemonic::MOV:
+		return !mem ? (imm ? 4 : 2) : (toMem ? (imm ? 10 : 9) : 8) + ea;
+	case Mnemonic::INC: case Mnemonic::DEC:
+		return mem ? 15 + ea : (word ? 2 : 3);
+	case Mnemonic::NOT: case Mnemonic::NEG:
+		return mem ? 16 + ea : 3;
+	case Mnemonic::MUL: return (word ? 124 : 70) + (mem ? 6 + ea : 0);
+	case Mnemonic::IMUL: return (word ? 134 : 90) + (mem ? 6 + ea : 0);
+	case Mnemonic::DIV: return (word ? 150 : 85) + (mem ? 6 + ea : 0);
+	case Mnemonic::IDIV: return (word ? 171 : 107) + (mem ? 6 + ea : 0);
+	case Mnemonic::ROL: case Mnemonic::ROR: case Mnemonic::RCL: case Mnemonic::RCR:
+	case Mnemonic::SHL: case Mnemonic::SHR: case Mnemonic::SAR:
+		if (ins.operands[1].type == OT_REG8) {
+			return (mem ? 20 + ea : 8) + 4;  // by CL, one bit
+		}
+		return mem ? 15 + ea : 2;
+	case Mnemonic::PUSH:
+		return mem ? 16 + ea : (ins.operands[0].type == OT_SREG ? 10 : 11);
+	case Mnemonic::POP: return mem ? 17 + ea : 8;
+	case Mnemonic::PUSHF: return 10;
+	case Mnemonic::POPF: return 8;
+	case Mnemonic::PUSHA: return 36;
+	case Mnemonic::POPA: return 51;
+	case Mnemonic::XCHG: return mem ? 17 + ea : 4;
+	case Mnemonic::LEA: return 2 + ea;
+	case Mnemonic::LES: case Mnemonic::LDS: return 16 + ea;
+	case Mnemonic::CWD: return 5;
+	case Mnemonic::LAHF: case Mnemonic::SAHF: case Mnemonic::DAA: case Mnemonic::DAS: return 4;
+	case Mnemonic::AAA: case Mnemonic::AAS: return 8;
+	case Mnemonic::AAM: return 83;
+	case Mnemonic::AAD: return 60;
+	case Mnemonic::NOP: case Mnemonic::WAIT: return 3;
+	case Mnemonic::XLAT: return 11;
+	case Mnemonic::JO: case Mnemonic::JNO: case Mnemonic::JB: case Mnemonic::JNB:
+	case Mnemonic::JZ: case Mnemonic::JNZ: case Mnemonic::JBE: case Mnemonic::JA:
+	case Mnemonic::JS: case Mnemonic::JNS: case Mnemonic::JPE: case Mnemonic::JPO:
+	case Mnemonic::JL: case Mnemonic::JGE: case Mnemonic::JLE: case Mnemonic::JG:
+		return 16;
+	case Mnemonic::LOOP: return 17;
+	case Mnemonic::LOOPZ: case Mnemonic::JCXZ: return 18;
+	case Mnemonic::LOOPNZ: return 19;
+	case Mnemonic::JMP: return mem ? 18 + ea : (ins.operands[0].type == OT_REG16 ? 11 : 15);
+	case Mnemonic::JMPF: return mem ? 24 + ea : 15;
+	case Mnemonic::CALL: return mem ? 21 + ea : (ins.operands[0].type == OT_REG16 ? 16 : 19);
+	case Mnemonic::CALLF: return mem ? 37 + ea : 28;
+	case Mnemonic::RET: return imm ? 12 : 8;
+	case Mnemonic::RETF: return imm ? 17 : 18;
+	case Mnemonic::INT: return 51;
+	case Mnemonic::INTO: return 53;
+	case Mnemonic::IRET: return 24;
+	case Mnemonic::ENTER: return 15;
+	case Mnemonic::LEAVE: return 8;
+	case Mnemonic::BOUND: return 33;
+	case Mnemonic::IN: case Mnemonic::OUT: return 10;
+	case Mnemonic::MOVSB: case Mnemonic::MOVSW: return 18 + (ins.repeat ? 9 : 0);
+	case Mnemonic::CMPSB: case Mnemonic::CMPSW: return 22 + (ins.repeat ? 9 : 0);
+	case Mnemonic::SCASB: case Mnemonic::SCASW: return 15 + (ins.repeat ? 9 : 0);
+	case Mnemonic::LODSB: case Mnemonic::LODSW: return 12 + (ins.repeat ? 9 : 0);
+	case Mnemonic::STOSB: case Mnemonic::STOSW: return 11 + (ins.repeat ? 9 : 0);
+	case Mnemonic::INSB: case Mnemonic::INSW:
+	case Mnemonic::OUTSB: case Mnemonic::OUTSW: return 14 + (ins.repeat ? 9 : 0);
+	default:
+		return mem ? 2 + ea : 2;  // CBW, flag operations, HLT, ESC
+	}
+}
+
+} // namespace
+
+// KS  clear the counters and start profiling
+// KE  stop profiling
+// KP [count]  list the instructions with the most estimated cycles
+void ConsoleUI::Profile(const Command& cmd, Processor& processor)
+{
+	const auto& words = cmd.GetWords();
+	if (words.size() < 2) {
+		ShowError(cmd.GetCmdSize(), "Missing argument");
+		return;
+	}
+	char action = static_cast<char>(tolower(words[1].second[0]));
+	if (words[1].second.size() != 1 || strchr("sep", action) == nullptr) {
+		ShowError(words[1].first, "Unsupported profile command '%s'", string(words[1].second).c_str());
+		return;
+	}
+	if (!EnsureArgumentCount(cmd, 2, action == 'p' ? 3 : 2)) {
+		return;
+	}
+	if (action == 's') {
+		processor.ClearProfile();
+		processor.SetProfiling(true);
+		return;
+	}
+	if (action == 'e') {
+		if (!processor.IsProfiling()) {
+			ShowError(words[1].first, "Not profiling");
+		}
+		processor.SetProfiling(false);
+		return;
+	}
+
+	unsigned short top = 0x10;
+	if (words.size() == 3 && (!ParseHex(words[2].second, top) || top == 0)) {
+		ShowError(words[2].first, "Invalid count '%s'", string(words[2].second).c_str());
+		return;
+	}
+	const vector<unsigned long long>& counts = processor.GetProfile();
+	const Memory& memory = processor.GetMemory();
+	unsigned cs = processor.GetRegisters().GetCS();
+	struct HotSpot
+	{
+		unsigned linear;
+		unsigned short seg;
+		unsigned short offset;
+		unsigned long long count;
+		unsigned long long cycles;
+	};
+	vector<HotSpot> spots;
+	unsigned long long totalCount = 0;
+	unsigned long long totalCycles = 0;
+	for (unsigned linear = 0; linear < counts.size(); ++linear) {
+		if (counts[linear] == 0) {
+			continue;
+		}
+		// Shown relative to CS where it reaches, otherwise normalized.
+		unsigned short seg = static_cast<unsigned short>(linear >> 4);
+		unsigned short offset = linear & 0xF;
+		if (linear >= (cs << 4) && linear - (cs << 4) <= 0xFFFF) {
+			seg = static_cast<unsigned short>(cs);
+			offset = static_cast<unsigned short>(linear - (cs << 4));
+		}
+		unsigned char buf[16];
+		Instruction ins;
+		Memory::ParseOneInstrument(memory.GetCode(seg, offset, buf), sizeof(buf), ins);
+		unsigned long long cycles = counts[linear] * EstimateCycles(ins);
+		spots.push_back(HotSpot{linear, seg, offset, counts[linear], cycles});
+		totalCount += counts[linear];
+		totalCycles += cycles;
+	}
+	if (spots.empty()) {
+		printf("No instructions profiled\n");
+		return;
+	}
+
+	size_t shown = min<size_t>(top, spots.size());
+	partial_sort(spots.begin(), spots.begin() + shown, spots.end(),
+			[](const HotSpot& a, const HotSpot& b) {
+				if (a.cycles != b.cycles) {
+					return a.cycles > b.cycles;
+				}
+				return a.count != b.count ? a.count > b.count : a.linear < b.linear;
+			});
+	printf("%llX instructions, ~%llX cycles\n", totalCount, totalCycles);
+	printf("   count      cycles      %%  instruction\n");
+	for (size_t i = 0; i < shown; ++i) {
+		const HotSpot& spot = spots[i];
+		printf("%8llX %11llX %5.1f%%  ", spot.count, spot.cycles,
+				totalCycles ? 100.0 * spot.cycles / totalCycles : 0.0);
+		memory.UnassembleOne(spot.seg, spot.offset);
+	}
+}
+
+void ConsoleUI::ShowState(Processor& processor)
+{
+	auto& registers = processor.GetRegisters();
+	registers.Dump();
+	processor.GetMemory().UnassembleOne(registers.GetCS(), registers.GetIP());
+}
+
+void ConsoleUI::ReportStop(StopReason reason, Processor& processor)
+{
+	Flush();
+	switch (reason) {
+	case StopReason::TERMINATED:
+		printf("\nProgram terminated normally (%04X)\n", processor.GetExitCode());
+		return;
+	case StopReason::DIVIDE_ERROR:
+		printf("Divide overflow\n");
+		break;
+	case StopReason::INVALID_OPCODE:
+		printf("Invalid opcode\n");
+		break;
+	case StopReason::INTERRUPT:
+		printf("Unsupported interrupt %02Xh (AH=%02X)\n", processor.GetLastVector(),
+				processor.GetRegisters().Get(Registers::AX) >> 8);
+		break;
+	case StopReason::USER_BREAK:
+		printf("^C\n");
+		break;
+	case StopReason::WATCHPOINT:
+		printf("Watchpoint: write to %05X\n", processor.GetWatchAddress());
+		break;
+	default:
+		break;
+	}
+	ShowState(processor);
+}
+
+void ConsoleUI::Go(const Command& cmd, Processor& processor)
+{
+	auto& registers = processor.GetRegisters();
+	size_t index = 1;
+	if (!ParseStartAddress(cmd, index, registers)) {
+		return;
+	}
+	const auto& words = cmd.GetWords();
+	if (index == words.size()) {
+		ReportStop(Execute(processor, ~0ULL, breakpoints_), processor);
+		return;
+	}
+	Breakpoints breakpoints = breakpoints_;
+	for (; index < words.size(); ++index) {
+		unsigned short seg, offset;
+		size_t errPos;
+		string errInfo;
+		if (!ParseAddress(words[index].second, registers.GetCS(), seg, offset, errPos, errInfo, registers)) {
+			ShowError(words[index].first + errPos, errInfo.c_str());
+			return;
+		}
+		breakpoints.Set(Memory::Linear(seg, offset));
+	}
+	ReportStop(Execute(processor, ~0ULL, breakpoints), processor);
+}
+
+void ConsoleUI::Trace(const Command& cmd, Processor& processor, bool proceed)
+{
+	auto& registers = processor.GetRegisters();
+	auto& memory = processor.GetMemory();
+	size_t index = 1;
+	if (!ParseStartAddress(cmd, index, registers)) {
+		return;
+	}
+	const auto& words = cmd.GetWords();
+	if (index + 1 < words.size()) {
+		ShowError(words[index + 1].first, "Unexpected argument");
+		return;
+	}
+	unsigned short count = 1;
+	if (index < words.size() && (!ParseHex(words[index].second, count) || count == 0)) {
+		ShowError(words[index].first, "Invalid count '%s'", string(words[index].second).c_str());
+		return;
+	}
+	for (unsigned short i = 0; i < count; ++i) {
+		StopReason reason;
+		unsigned short cs = registers.GetCS();
+		unsigned short ip = registers.GetIP();
+		unsigned char buf[16];
+		Instruction ins;
+		Memory::ParseOneInstrument(memory.GetCode(cs, ip, buf), sizeof(buf), ins);
+		bool over = proceed && (ins.repeat != Instruction::REP_NONE ||
+				ins.mnemonic == Mnemonic::CALL || ins.mnemonic == Mnemonic::CALLF ||
+				ins.mnemonic == Mnemonic::INT || ins.mnemonic == Mnemonic::LOOP ||
+				ins.mnemonic == Mnemonic::LOOPZ || ins.mnemonic == Mnemonic::LOOPNZ);
+		if (over) {
+			Breakpoints next = breakpoints_;
+			next.Set(Memory::Linear(cs, static_cast<unsigned short>(ip + ins.length)));
+			reason = Execute(processor, ~0ULL, next);
+		} else {
+			reason = Execute(processor, 1, {});
+		}
+		if (reason != StopReason::COUNT && reason != StopReason::BREAKPOINT) {
+			ReportStop(reason, processor);
+			return;
+		}
+		ShowState(processor);
+	}
+}
+
+// Parses the optional "address [end | L length]" after the command letter.
+// count is left at 0 when no end or length is given.
+bool ConsoleUI::ParseRange(const Command& cmd, Registers& registers,
+		unsigned short& seg, unsigned short& start, unsigned long long& count)
+{
+	const auto& words = cmd.GetWords();
+	size_t errPos;
+	string errInfo;
+	if (words.size() > 1) {
+		if (!ParseAddress(words[1].second, seg, start, errPos, errInfo, registers)) {
+			ShowError(words[1].first + errPos, errInfo.c_str());
+			return false;
+		}
+	}
+	if (words.size() > 2 && (words[2].second[0] == 'L' || words[2].second[0] == 'l')) {
+		size_t index = 2;
+		string_view text = words[2].second.substr(1);
+		if (text.empty() && words.size() > 3) {
+			text = words[++index].second;
+		}
+		unsigned length;
+		if (text.empty() || text.size() > 8 || !ParseHex(text, length) || length == 0) {
+			ShowError(words[index].first, "Invalid length '%s'", string(text).c_str());
+			return false;
+		}
+		if (words.size() > index + 1) {
+			ShowError(words[index + 1].first, "Unexpected argument");
+			return false;
+		}
+		count = length;
+	} else if (words.size() > 2) {
+		if (words.size() > 3) {
+			ShowError(words[3].first, "Unexpected argument");
+			return false;
+		}
+		unsigned short end;
+		if (!ParseOffset(words[2].second, end, errPos, errInfo)) {
+			ShowError(words[2].first + errPos, errInfo.c_str());
+			return false;
+		}
+		count = end >= start ? end - start + 1 : 1;
+	}
+	return true;
+}
+
+// D [address [end | L length]]
+// With L the length may exceed a segment; the dump continues into the
+// following segments.
+void ConsoleUI::DumpMemory(const Command& cmd, Registers& registers, Memory& memory)
+{
+	unsigned short seg = curSeg_, start = cursor_;
+	unsigned long long count = 0;
+	if (!ParseRange(cmd, registers, seg, start, count)) {
+		return;
+	}
+	if (count == 0) {
+		count = min(0x80, 0x10000 - start);
+	}
+	memory.Dump(seg, start, count);
+	unsigned long long next = start + count;
+	curSeg_ = static_cast<unsigned short>(seg + (next >> 16) * 0x1000);
+	cursor_ = static_cast<unsigned short>(next);
+}
+
+void ConsoleUI::SwitchProcessorType(const Command& cmd, Processor& processor)
+{
+	const auto& words = cmd.GetWords();
+	if (cmd.GetWords().size() == 1 || words[1].second == "?") {
+		processor.ShowProcessorType();
+	} else if (cmd.GetWords().size() > 2) {
+		ShowError(words[2].first, "Unexpected argument");
+	} else if (words[1].second == "0") {
+		processor.SetProcessorType(ProcessorType::PT_8086);
+	} else if (words[1].second == "1") {
+		processor.SetProcessorType(ProcessorType::PT_186);
+	} else if (words[1].second == "2") {
+		processor.SetProcessorType(ProcessorType::PT_286);
+	} else if (words[1].second == "3") {
+		processor.SetProcessorType(ProcessorType::PT_386);
+	} else if (words[1].second == "4") {
+		processor.SetProcessorType(ProcessorType::PT_486);
+	} else if (words[1].second == "5") {
+		processor.SetProcessorType(ProcessorType::PT_586);
+	} else if (words[1].second == "6") {
+		processor.SetProcessorType(ProcessorType::PT_686);
+	} else if (words[1].second == "nc") {
+		processor.SetCoProcessorType(CoProcessorType::CPT_NONE);
+	} else if (words[1].second == "c2") {
+		processor.SetCoProcessorType(CoProcessorType::CPT_287);
+	} else if (words[1].second == "c") {
+		processor.SetCoProcessorType(CoProcessorType::CPT_387);
 	} else {
-		s = s.substr(0, end + 1);
+		ShowError(words[1].first, "Unexpected command '%s'", string(words[1].second).c_str());
+	}
+}
+
+void ConsoleUI::HexCalc(const Command& cmd)
+{
+	if (!EnsureArgumentCount(cmd, 3, 3)) {
+		return;
+	}
+	unsigned short a, b;
+	const auto& words = cmd.GetWords();
+	if (!ParseHex(words[1].second, a)) {
+		ShowError(words[1].first, "Unexpected hex value '%s'", string(words[1].second).c_str());
+		return;
+	}
+	if (!ParseHex(words[2].second, b)) {
+		ShowError(words[2].first, "Unexpected hex value '%s'", string(words[2].second).c_str());
+		return;
+	}
+	printf("%04X  %04X\n",
+			static_cast<unsigned short>(a + b),
+			static_cast<unsigned short>(a - b));
+}
+
+string Trim(const string& text)
+{
+	auto s = text;
+	auto start = s.find_first_not_of(" \t\r\n");
+	if (start == string::npos) {
+		s = "";
+	} else {
+		s = s.substr(start);
+	}
+	auto end = s.find_last_not_of(" \t\r\n");
+	if (end == string::npos) {
+		s = "";
+	} else {
+		s = s.substr(0, end + 1);
+	}
+	return s;
+}
+
+void ConsoleUI::ChangeRegisters(const Command& cmd, Registers& registers)
+{
+	const auto& words = cmd.GetWords();
+	if (cmd.GetWords().size() > 3) {
+		ShowError(words[3].first, "Unexpected argument");
+		return;
+	}
+	int reg = Registers::Find(words[1].second);
+	if (reg == Registers::NO_REG) {
+		ShowError(words[1].first, "Invalid register name '%s'", string(words[1].second).c_str());
+		return;
+	}
+	unsigned short value = registers.GetAny(reg);
+	unsigned short limit = Registers::IsByte(reg) ? 0xFF : 0xFFFF;
+	if (cmd.GetWords().size() == 2) {
+		printf(Registers::IsByte(reg) ? "%s %02X  :" : "%s %04X  :", Registers::Name(reg), value);
+		Flush();
+		// The new value is the next line of the command stream, as in DEBUG
+		// scripts; an empty line keeps the current value.
+		string line;
+		bool read = ReadLine(line);
+		if (batch_) {
+			printf("\n");
+		}
+		if (!read) {
+			return;
+		}
+		string s = Trim(line);
+		if (s.empty()) {
+			return;
+		}
+		size_t column = batch_ ? line.find_first_not_of(" \t\r") : 10;
+		if (!ParseHex(s, value) || value > limit) {
+			ShowError(column, "Invalid hex value '%s'", s.c_str());
+			return;
+		}
+	} else {
+		if (!ParseHex(words[2].second, value) || value > limit) {
+			ShowError(words[2].first, "Invalid hex value '%s'", string(words[2].second).c_str());
+			return;
+		}
+	}
+	registers.SetAny(reg, value);
+}
+
+void ConsoleUI::Process(const Command& cmd, Processor& processor)
+{
+	if (cmd.IsEmpty()) {
+		return;
+	}
+	const auto& words = cmd.GetWords();
+
+	switch (tolower(words[0].second[0])) {
+	case 'q':
+		processor.StopTrace();
+		exit(0);
+	case '?':
+		PrintUsage();
+		break;
+	case 'c':
+		CompareMemory(cmd, processor.GetRegisters(), processor.GetMemory());
+		break;
+	case 'd':
+		DumpMemory(cmd, processor.GetRegisters(), processor.GetMemory());
+		break;
+	case 'r':
+		if (cmd.GetWords().size() == 1) {
+			ShowState(processor);
+		} else {
+			ChangeRegisters(cmd, processor.GetRegisters());
+		}
+		break;
+	case 'm':
+		if (cmd.GetWords().size() == 4) {
+			CopyMemory(cmd, processor.GetRegisters(), processor.GetMemory());
+		} else {
+			SwitchProcessorType(cmd, processor);
+		}
+		break;
+	case 'h':
+		HexCalc(cmd);
+		break;
+	case 'e':
+		EnterData(cmd, processor.GetRegisters(), processor.GetMemory());
+		break;
+	case 's':
+		SearchData(cmd, processor.GetRegisters(), processor.GetMemory());
+		break;
+	case 'f':
+		FillData(cmd, processor.GetRegisters(), processor.GetMemory());
+		break;
+	case 'n':
+		if (!EnsureArgumentCount(cmd, 2, 2)) {
+			return;
+		}
+		SetFilename(string(words[1].second));
+		break;
+	case 'l':
+		LoadData(cmd, processor.GetRegisters(), processor.GetMemory());
+		break;
+	case 'w':
+		WriteData(cmd, processor.GetRegisters(), processor.GetMemory());
+		break;
+	case 'u':
+		Unassemble(cmd, processor.GetRegisters(), processor.GetMemory());
+		break;
+	case 'g':
+		Go(cmd, processor);
+		break;
+	case 't':
+		Trace(cmd, processor, false);
+		break;
+	case 'p':
+		Trace(cmd, processor, true);
+		break;
+	case 'z':
+		Snapshots(cmd, processor);
+		break;
+	case 'y':
+		Recording(cmd, processor);
+		break;
+	case 'k':
+		Profile(cmd, processor);
+		break;
+	case 'b':
+		SetBreakpoints(cmd, processor.GetRegisters(), processor.GetMemory());
+		break;
+	default:
+		ShowError(words[0].first, "Unsupported command '%c'", words[0].second[0]);
+	}
+}
+
+Memory::Memory()
+{
+	// 1MB memory for 'real mode'. Nothing is filled up front: every page starts
+	// fresh and gets its pattern when first touched.
+	void* p = mmap(nullptr, MEMORY_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	data_ = static_cast<unsigned char*>(p);
+	memset(pageAttr_, PA_FRESH | PA_SHARED | PA_CLEAN, sizeof(pageAttr_));
+}
+
+Memory::~Memory()
+{
+	munmap(data_, MEMORY_SIZE);
+}
+
+void Memory::SetFillMode(FillMode mode)
+{
+	fillMode_ = mode;
+	if (mode == FillMode::ZERO) {
+		for (unsigned page = 0; page < PAGE_COUNT; ++page) {
+			pageAttr_[page] &= ~PA_FRESH;  // untouched pages of the mapping read as zero
+		}
+	}
+}
+
+// Fills a fresh page with pseudo-random bytes that mimic uninitialized RAM.
+// The generator is seeded from the page number, so contents do not depend on
+// the order in which pages are touched. Four independent xorshift64 lanes
+// keep the loop free of serial dependencies so it vectorizes.
+void Memory::Materialize(unsigned page) const
+{
+	static const unsigned LANES = 4;
+	unsigned long long state[LANES];
+	for (unsigned i = 0; i < LANES; ++i) {
+		state[i] = (page * LANES + i + 1) * 0x9E3779B97F4A7C15ULL;
+	}
+	unsigned char* out = data_ + page * PAGE_SIZE;
+	for (unsigned n = 0; n < PAGE_SIZE; n += LANES * sizeof(state[0])) {
+		for (unsigned i = 0; i < LANES; ++i) {
+			state[i] ^= state[i] << 13;
+			state[i] ^= state[i] >> 7;
+			state[i] ^= state[i] << 17;
+		}
+		memcpy(out + n, state, sizeof(state));
+	}
+	pageAttr_[page] &= ~PA_FRESH;
+}
+
+void Memory::Touch(unsigned linear, size_t size) const
+{
+	if (size == 0) {
+		return;
+	}
+	unsigned firstPage = linear >> PAGE_SHIFT;
+	unsigned lastPage = static_cast<unsigned>((linear + size - 1) >> PAGE_SHIFT);
+	for (unsigned page = firstPage; page <= lastPage; ++page) {
+		if (pageAttr_[page % PAGE_COUNT] & PA_FRESH) {
+			Materialize(page % PAGE_COUNT);
+		}
+	}
+}
+
+namespace {
+
+struct DumpTables
+{
+	char hex[256][2];
+	char text[256];
+
+	constexpr DumpTables() : hex(), text()
+	{
+		const char digits[] = "0123456789ABCDEF";
+		for (unsigned i = 0; i < 256; ++i) {
+			hex[i][0] = digits[i >> 4];
+			hex[i][1] = digits[i & 0xF];
+			text[i] = (i >= 0x20 && i < 0x7F) ? static_cast<char>(i) : '.';
+		}
+	}
+};
+
+constexpr DumpTables kDump;
+
+inline char* PutHex16(char* out, unsigned short value)
+{
+	memcpy(out, kDump.hex[value >> 8], 2);
+	memcpy(out + 2, kDump.hex[value & 0xFF], 2);
+	return out + 4;
+}
+
+// Formats one dump line for seg:cursor. Only bytes first..last of the line
+// are shown; the other columns are left blank.
+char* FormatDumpLine(char* out, unsigned short seg, unsigned short cursor,
+		const unsigned char* bytes, unsigned first, unsigned last)
+{
+	out = PutHex16(out, seg);
+	*out++ = ':';
+	out = PutHex16(out, cursor);
+	*out++ = ' ';
+	if (first == 0 && last == 15) {
+		for (unsigned j = 0; j < 16; ++j) {
+			out[0] = (j == 8 ? '-' : ' ');
+			memcpy(out + 1, kDump.hex[bytes[j]], 2);
+			out += 3;
+		}
+		memcpy(out, "   ", 3);
+		out += 3;
+		for (unsigned j = 0; j < 16; ++j) {
+			out[j] = kDump.text[bytes[j]];
+		}
+		out += 16;
+	} else {
+		for (unsigned j = 0; j < 16; ++j) {
+			out[0] = (j == 8 ? '-' : ' ');
+			if (j < first || j > last) {
+				out[1] = out[2] = ' ';
+			} else {
+				memcpy(out + 1, kDump.hex[bytes[j]], 2);
+			}
+			out += 3;
+		}
+		memcpy(out, "   ", 3);
+		out += 3;
+		for (unsigned j = 0; j < 16; ++j) {
+			*out++ = (j < first || j > last) ? ' ' : kDump.text[bytes[j]];
+		}
+	}
+	*out++ = '\n';
+	return out;
+}
+
+// Writes all of buf to stdout, after anything still buffered by stdio.
+void WriteOut(const char* buf, size_t size)
+{
+	fflush(stdout);
+	while (size > 0) {
+		ssize_t n = write(STDOUT_FILENO, buf, size);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		buf += n;
+		size -= n;
+	}
+}
+
+} // namespace
+
+// Dumps count bytes from seg:start. Lines that run past offset FFFF continue
+// in the next 64KB segment, so any amount of memory can be streamed.
+void Memory::Dump(unsigned short seg, unsigned short start, unsigned long long count) const
+{
+	static const size_t LINE_SIZE = 80;
+	static const size_t BUFFER_SIZE = 1024 * LINE_SIZE;
+
+	vector<char> buf(BUFFER_SIZE);
+	char* out = buf.data();
+	unsigned short cursor = start & 0xFFF0;
+	unsigned first = start & 0xF;
+	while (count > 0) {
+		unsigned last = static_cast<unsigned>(min<unsigned long long>(15, first + count - 1));
+		unsigned linear = Linear(seg, cursor);
+		unsigned char wrapped[16];
+		const unsigned char* bytes = data_ + linear;
+		Touch(linear, 16);
+		if (linear + 16 > MEMORY_SIZE) {
+			for (unsigned j = 0; j < 16; ++j) {
+				wrapped[j] = data_[(linear + j) & (MEMORY_SIZE - 1)];
+			}
+			bytes = wrapped;
+		}
+		out = FormatDumpLine(out, seg, cursor, bytes, first, last);
+		if (out + LINE_SIZE > buf.data() + buf.size()) {
+			WriteOut(buf.data(), out - buf.data());
+			out = buf.data();
+		}
+
+		count -= last - first + 1;
+		first = 0;
+		cursor += 16;
+		if (cursor == 0) {
+			seg += 0x1000;
+		}
+	}
+	// The tail of a dump goes through stdio so that short dumps coalesce
+	// with the rest of the output.
+	fwrite(buf.data(), 1, out - buf.data(), stdout);
+}
+
+namespace {
+
+// Index of the first position in [i, n) where a and b are equal (same == true)
+// or differ (same == false); n if there is none.
+size_t FindRunEnd(const unsigned char* a, const unsigned char* b, size_t i, size_t n, bool same)
+{
+#ifdef __SSE2__
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+		__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+		if (!same) {
+			mask ^= 0xFFFF;
+		}
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+	for (; i < n; ++i) {
+		if ((a[i] == b[i]) == same) {
+			break;
+		}
+	}
+	return i;
+}
+
+} // namespace
+
+// Compares count bytes at srcSeg:srcStart and dstSeg:dstStart, offsets
+// wrapping within their segments, and returns the runs of differing bytes.
+// Equal stretches are skipped 16 bytes at a time.
+vector<Memory::DiffRange> Memory::Diff(unsigned short srcSeg, unsigned short srcStart,
+		unsigned short dstSeg, unsigned short dstStart, unsigned count) const
+{
+	vector<DiffRange> ranges;
+	for (unsigned pos = 0; pos < count; ) {
+		unsigned short srcOffset = static_cast<unsigned short>(srcStart + pos);
+		unsigned short dstOffset = static_cast<unsigned short>(dstStart + pos);
+		unsigned src = Linear(srcSeg, srcOffset);
+		unsigned dst = Linear(dstSeg, dstOffset);
+		unsigned span = min(SpanLength(srcSeg, srcOffset, count - pos), SpanLength(dstSeg, dstOffset, count - pos));
+		Touch(src, span);
+		Touch(dst, span);
+
+		const unsigned char* a = data_ + src;
+		const unsigned char* b = data_ + dst;
+		for (size_t i = FindRunEnd(a, b, 0, span, false); i < span; ) {
+			size_t j = FindRunEnd(a, b, i, span, true);
+			if (!ranges.empty() && ranges.back().start + ranges.back().length == pos + i) {
+				ranges.back().length += static_cast<unsigned>(j - i);  // continues across spans
+			} else {
+				ranges.push_back({pos + static_cast<unsigned>(i), static_cast<unsigned>(j - i)});
+			}
+			i = FindRunEnd(a, b, j, span, false);
+		}
+		pos += span;
+	}
+	return ranges;
+}
+
+void Memory::Compare(unsigned short srcSeg, unsigned short srcStart, unsigned short srcEnd,
+		unsigned short dstSeg, unsigned short dstStart, bool perByte)
+{
+	unsigned count = static_cast<unsigned short>(srcEnd - srcStart) + 1;
+	string out;
+	char line[64];
+	for (const DiffRange& range : Diff(srcSeg, srcStart, dstSeg, dstStart, count)) {
+		unsigned short srcOffset = static_cast<unsigned short>(srcStart + range.start);
+		unsigned short dstOffset = static_cast<unsigned short>(dstStart + range.start);
+		if (!perByte) {
+			int n = snprintf(line, sizeof(line), "%04X:%04X-%04X  %04X:%04X  %04X bytes\n",
+					srcSeg, srcOffset, static_cast<unsigned short>(srcOffset + range.length - 1),
+					dstSeg, dstOffset, range.length);
+			out.append(line, n);
+			continue;
+		}
+		for (unsigned i = 0; i < range.length; ++i) {
+			unsigned short s = static_cast<unsigned short>(srcOffset + i);
+			unsigned short d = static_cast<unsigned short>(dstOffset + i);
+			int n = snprintf(line, sizeof(line), "%04X:%04X  %02X %02X  %04X:%04X\n",
+					srcSeg, s, data_[Linear(srcSeg, s)], data_[Linear(dstSeg, d)], dstSeg, d);
+			out.append(line, n);
+		}
+	}
+	fwrite(out.data(), 1, out.size(), stdout);
+}
+
+// Number of the count bytes at seg:offset that are contiguous in linear
+// memory, i.e. before the offset wraps at 64KB or the address wraps at 1MB.
+unsigned Memory::SpanLength(unsigned short seg, unsigned short offset, unsigned count)
+{
+	return min({count, 0x10000u - offset, MEMORY_SIZE - Linear(seg, offset)});
+}
+
+// Moves the bytes of srcSeg:srcStart..srcEnd to dstSeg:dstStart. Like DEBUG,
+// the result is as if the source were read completely before writing, so
+// overlapping ranges are safe.
+void Memory::Copy(unsigned short srcSeg, unsigned short srcStart, unsigned short srcEnd,
+		unsigned short dstSeg, unsigned short dstStart)
+{
+	unsigned count = static_cast<unsigned short>(srcEnd - srcStart) + 1;
+	unsigned src = Linear(srcSeg, srcStart);
+	unsigned dst = Linear(dstSeg, dstStart);
+	Touch(src, count);
+	if (SpanLength(srcSeg, srcStart, count) == count && SpanLength(dstSeg, dstStart, count) == count) {
+		PrepareOverwrite(dst, count);
+		memmove(data_ + dst, data_ + src, count);
+		return;
+	}
+
+	// A side wraps, so the ranges may alias in ways memmove cannot order;
+	// stage the source instead.
+	vector<unsigned char> staged(count);
+	for (unsigned pos = 0; pos < count; ) {
+		unsigned short offset = static_cast<unsigned short>(srcStart + pos);
+		unsigned span = SpanLength(srcSeg, offset, count - pos);
+		memcpy(staged.data() + pos, data_ + Linear(srcSeg, offset), span);
+		pos += span;
+	}
+	for (unsigned pos = 0; pos < count; ) {
+		unsigned short offset = static_cast<unsigned short>(dstStart + pos);
+		unsigned span = SpanLength(dstSeg, offset, count - pos);
+		unsigned linear = Linear(dstSeg, offset);
+		PrepareOverwrite(linear, span);
+		memcpy(data_ + linear, staged.data() + pos, span);
+		pos += span;
+	}
+}
+
+void Memory::PutData(unsigned short seg, unsigned short start, vector<unsigned char> data)
+{
+	for (size_t i = 0; i < data.size(); ++i) {
+		WriteByte(seg, static_cast<unsigned short>(start + i), data[i]);
+	}
+}
+
+unsigned char Memory::GetChar(unsigned short seg, unsigned short offset) const
+{
+	return ReadByte(seg, offset);
+}
+
+namespace {
+
+// Single pattern: compare the first and the last pattern byte against 16
+// candidate positions at once, and verify only where both match.
+void FindPattern(const unsigned char* p, size_t n, const vector<unsigned char>& pattern,
+		unsigned index, unsigned base, vector<Memory::SearchHit>& hits)
+{
+	size_t m = pattern.size();
+	if (m == 0 || m > n) {
+		return;
+	}
+	size_t count = n - m + 1;  // candidate start positions
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i first = _mm_set1_epi8(static_cast<char>(pattern[0]));
+	const __m128i last = _mm_set1_epi8(static_cast<char>(pattern[m - 1]));
+	for (; i + 16 <= count; i += 16) {
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + m - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		while (mask != 0) {
+			unsigned bit = __builtin_ctz(mask);
+			if (m <= 2 || memcmp(p + i + bit + 1, pattern.data() + 1, m - 2) == 0) {
+				hits.push_back({base + static_cast<unsigned>(i + bit), index});
+			}
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for (; i < count; ++i) {
+		if (p[i] == pattern[0] && memcmp(p + i, pattern.data(), m) == 0) {
+			hits.push_back({base + static_cast<unsigned>(i), index});
+		}
+	}
+}
+
+// Several patterns in one pass: patterns are bucketed by a prefix of the
+// shortest pattern's length (one or two bytes), and a bitmap of used
+// prefixes rejects most positions with a single lookup.
+void FindPatterns(const unsigned char* p, size_t n, const vector<vector<unsigned char>>& patterns,
+		unsigned base, vector<Memory::SearchHit>& hits)
+{
+	size_t minLength = patterns[0].size();
+	for (const auto& pattern : patterns) {
+		minLength = min(minLength, pattern.size());
+	}
+	if (minLength == 0) {
+		return;
+	}
+	unsigned prefixBytes = minLength >= 2 ? 2 : 1;
+	auto prefix = [prefixBytes](const unsigned char* q) {
+		return prefixBytes == 2 ? q[0] | (q[1] << 8) : q[0];
+	};
+
+	vector<unsigned> bucketStart((1 << (8 * prefixBytes)) + 1, 0);
+	for (const auto& pattern : patterns) {
+		++bucketStart[prefix(pattern.data()) + 1];
+	}
+	for (size_t k = 1; k < bucketStart.size(); ++k) {
+		bucketStart[k] += bucketStart[k - 1];
+	}
+	vector<unsigned> bucket(patterns.size());
+	vector<unsigned> fill(bucketStart.begin(), bucketStart.end() - 1);
+	vector<bool> used(bucketStart.size() - 1, false);
+	for (unsigned k = 0; k < patterns.size(); ++k) {
+		unsigned key = prefix(patterns[k].data());
+		bucket[fill[key]++] = k;
+		used[key] = true;
+	}
+
+	for (size_t i = 0; i + minLength <= n; ++i) {
+		unsigned key = prefix(p + i);
+		if (!used[key]) {
+			continue;
+		}
+		for (unsigned j = bucketStart[key]; j < bucketStart[key + 1]; ++j) {
+			const auto& pattern = patterns[bucket[j]];
+			if (i + pattern.size() <= n && memcmp(p + i, pattern.data(), pattern.size()) == 0) {
+				hits.push_back({base + static_cast<unsigned>(i), bucket[j]});
+			}
+		}
+	}
+}
+
+// Hits are shown relative to seg:baseOffset, or split into a 64KB-aligned
+// segment and an offset when the search covered all memory.
+void PrintHits(const vector<Memory::SearchHit>& hits, size_t patternCount, bool allMemory,
+		unsigned short seg, unsigned baseLinear, unsigned short baseOffset)
+{
+	string out;
+	char line[32];
+	for (const auto& hit : hits) {
+		unsigned short s = seg;
+		unsigned short offset = static_cast<unsigned short>(baseOffset + (hit.linear - baseLinear));
+		if (allMemory) {
+			s = static_cast<unsigned short>((hit.linear >> 4) & 0xF000);
+			offset = static_cast<unsigned short>(hit.linear);
+		}
+		int n = patternCount > 1
+				? snprintf(line, sizeof(line), "%04X:%04X  %u\n", s, offset, hit.pattern + 1)
+				: snprintf(line, sizeof(line), "%04X:%04X\n", s, offset);
+		out.append(line, n);
+	}
+	fwrite(out.data(), 1, out.size(), stdout);
+}
+
+} // namespace
+
+// Finds every occurrence of the patterns lying entirely within the linear
+// range, ordered by address. The range may wrap around the top of memory.
+vector<Memory::SearchHit> Memory::Search(unsigned linear, size_t size,
+		const vector<vector<unsigned char>>& patterns) const
+{
+	vector<SearchHit> hits;
+	if (patterns.empty() || size == 0) {
+		return hits;
+	}
+	size = min(size, static_cast<size_t>(MEMORY_SIZE));
+	Touch(linear, size);
+
+	const unsigned char* p = data_ + linear;
+	vector<unsigned char> wrapped;
+	if (linear + size > MEMORY_SIZE) {
+		wrapped.assign(data_ + linear, data_ + MEMORY_SIZE);
+		wrapped.insert(wrapped.end(), data_, data_ + (linear + size - MEMORY_SIZE));
+		p = wrapped.data();
+	}
+	if (patterns.size() == 1) {
+		FindPattern(p, size, patterns[0], 0, linear, hits);
+	} else {
+		FindPatterns(p, size, patterns, linear, hits);
+	}
+	for (auto& hit : hits) {
+		hit.linear &= MEMORY_SIZE - 1;
+	}
+	return hits;
+}
+
+void Memory::SearchData(unsigned short seg, unsigned short start, unsigned short end,
+		const vector<vector<unsigned char>>& patterns)
+{
+	if (end < start) {
+		return;
+	}
+	unsigned linear = Linear(seg, start);
+	PrintHits(Search(linear, end - start + 1, patterns), patterns.size(), false, seg, linear, start);
+}
+
+void Memory::SearchAll(const vector<vector<unsigned char>>& patterns)
+{
+	PrintHits(Search(0, MEMORY_SIZE, patterns), patterns.size(), true, 0, 0, 0);
+}
+
+namespace {
+
+// Fills n bytes with the pattern, starting at its phase-th byte. The first
+// period is written directly and then doubled with memcpy, so the cost is
+// a few bulk copies regardless of the pattern length.
+void FillPattern(unsigned char* p, size_t n, const vector<unsigned char>& pattern, size_t phase)
+{
+	size_t m = pattern.size();
+	if (m == 1) {
+		memset(p, pattern[0], n);
+		return;
+	}
+	size_t filled = min(n, m);
+	for (size_t i = 0; i < filled; ++i) {
+		p[i] = pattern[(phase + i) % m];
+	}
+	while (filled < n) {
+		size_t chunk = min(filled, n - filled);
+		memcpy(p + filled, p, chunk);
+		filled += chunk;
+	}
+}
+
+} // namespace
+
+void Memory::FillData(unsigned short seg, unsigned short start, unsigned short end,
+		const vector<unsigned char>& data)
+{
+	unsigned count = static_cast<unsigned short>(end - start) + 1;
+	for (unsigned pos = 0; pos < count; ) {
+		unsigned short offset = static_cast<unsigned short>(start + pos);
+		unsigned span = SpanLength(seg, offset, count - pos);
+		unsigned linear = Linear(seg, offset);
+		PrepareOverwrite(linear, span);
+		FillPattern(data_ + linear, span, data, pos % data.size());
+		pos += span;
+	}
+}
+
+// Places the file at the 20-bit linear address seg:offset. Whatever does not
+// fit below 1MB is not loaded; size returns the number of bytes placed.
+bool Memory::Load(const string& filename, unsigned short seg,
+		unsigned short offset, unsigned& size)
+{
+	unsigned linear = Linear(seg, offset);
+	size = 0;
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return false;
+	}
+
+	size_t room = MEMORY_SIZE - linear;
+	if (S_ISREG(st.st_mode)) {
+		size_t n = min(static_cast<size_t>(st.st_size), room);
+		if (n == 0) {
+			close(fd);
+			return true;
+		}
+		void* p = mmap(nullptr, n, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			PrepareOverwrite(linear, n);
+			memcpy(data_ + linear, p, n);
+			munmap(p, n);
+			close(fd);
+			size = static_cast<unsigned>(n);
+			return true;
+		}
+	}
+
+	// Pipes, devices, or files that cannot be mapped are streamed instead.
+	for (;;) {
+		char buf[0x10000];
+		ssize_t n = read(fd, buf, min(sizeof(buf), room - size));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			close(fd);
+			return false;
+		}
+		if (n == 0) {
+			break;
+		}
+		PrepareOverwrite(linear + size, n);
+		memcpy(data_ + linear + size, buf, n);
+		size += n;
+	}
+	close(fd);
+	return true;
+}
+
+// Writes size bytes starting at the 20-bit linear address seg:offset,
+// stopping at the top of memory.
+bool Memory::Write(const string& filename, unsigned short seg,
+		unsigned short offset, unsigned size)
+{
+	unsigned linear = Linear(seg, offset);
+	size = min(size, static_cast<unsigned>(MEMORY_SIZE - linear));
+	int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return false;
+	}
+	Touch(linear, size);
+	for (unsigned done = 0; done < size; ) {
+		ssize_t n = write(fd, data_ + linear + done, size - done);
+		if (n < 0) {
+			close(fd);
+			return false;
+		}
+		done += n;
+	}
+	return close(fd) == 0;
+}
+
+// Updates a file that already holds the size bytes at seg:offset as of the
+// last ClearDirty: only the dirty parts of the range are written back.
+bool Memory::WriteChanges(const string& filename, unsigned short seg,
+		unsigned short offset, unsigned size, unsigned& written)
+{
+	unsigned linear = Linear(seg, offset);
+	size = min(size, static_cast<unsigned>(MEMORY_SIZE - linear));
+	written = 0;
+	int fd = open(filename.c_str(), O_WRONLY);
+	if (fd < 0) {
+		return false;
+	}
+	for (const auto& range : DirtyRanges()) {
+		unsigned start = max(range.first, linear);
+		unsigned end = min(range.first + range.second, linear + size);
+		if (start >= end) {
+			continue;
+		}
+		Touch(start, end - start);
+		for (unsigned done = start; done < end; ) {
+			ssize_t n = pwrite(fd, data_ + done, end - done, done - linear);
+			if (n < 0) {
+				close(fd);
+				return false;
+			}
+			done += n;
+		}
+		written += end - start;
+	}
+	return close(fd) == 0;
+}
+
+void Memory::CopyOut(unsigned linear, unsigned char* buf, size_t size) const
+{
+	Touch(linear, size);
+	memcpy(buf, data_ + linear, size);
+}
+
+void Memory::CopyIn(unsigned linear, const unsigned char* buf, size_t size)
+{
+	PrepareOverwrite(linear, size);
+	memcpy(data_ + linear, buf, size);
+}
+
+// Fix-ups inside the module are patched in place, after one preparation of
+// its pages; the few that point past it take the checked path.
+void Memory::Relocate(unsigned linear, size_t size, const unsigned char* table, unsigned count,
+		unsigned short seg)
+{
+	PrepareOverwrite(linear, size);
+	unsigned char* module = data_ + linear;
+	for (unsigned i = 0; i < count; ++i, table += 4) {
+		unsigned target = (table[2] | (table[3] << 8)) * 16 + (table[0] | (table[1] << 8));
+		if (target + 2 <= size) {
+			unsigned short word = static_cast<unsigned short>((module[target] | (module[target + 1] << 8)) + seg);
+			module[target] = static_cast<unsigned char>(word);
+			module[target + 1] = static_cast<unsigned char>(word >> 8);
+		} else {
+			unsigned address = (linear + target) & (MEMORY_SIZE - 1);
+			unsigned short outSeg = static_cast<unsigned short>(address >> 4);
+			unsigned short offset = address & 0xF;
+			WriteWord(outSeg, offset, static_cast<unsigned short>(ReadWord(outSeg, offset) + seg));
+		}
+	}
+}
+
+namespace {
+
+const char* const kMnemonicNames[] = {
+#define X(name, text) text,
+	MNEMONIC_LIST(X)
+#undef X
+};
+
+const char* const kReg8Names[] = { "AL", "CL", "DL", "BL", "AH", "CH", "DH", "BH" };
+const char* const kReg16Names[] = { "AX", "CX", "DX", "BX", "SP", "BP", "SI", "DI" };
+const char* const kSegNames[] = { "ES", "CS", "SS", "DS" };
+const char* const kMemBaseNames[] = { "BX+SI", "BX+DI", "BP+SI", "BP+DI", "SI", "DI", "BP", "BX" };
+
+// Operand encodings as written in the Intel opcode map.
+enum OperandSpec : unsigned char {
+	S_NONE = 0,
+	S_Eb, S_Ew, S_Gb, S_Gw, S_Sw, S_M,   // taken from the ModR/M byte
+	S_Ib, S_Iw, S_sIb, S_Jb, S_Jw, S_Ap, S_Ob, S_Ow,
+	S_1, S_3, S_ESC,
+	S_R8,                 // + register number (AL, CL, ... BH)
+	S_R16 = S_R8 + 8,     // + register number (AX, CX, ... DI)
+	S_SEG = S_R16 + 8,    // + segment register number (ES, CS, SS, DS)
+
+	S_AL = S_R8, S_CL = S_R8 + 1,
+	S_AX = S_R16, S_DX = S_R16 + 2
+};
+
+enum OpcodeFlags : unsigned char {
+	OF_MODRM  = 0x01,
+	OF_BYTE   = 0x02,
+	OF_GROUP  = 0x04,  // mnemonic selected by ModR/M 'reg' field through kOpcodeGroups
+	OF_PREFIX = 0x08   // 'group' holds the PrefixKind
+};
+
+enum PrefixKind : unsigned char { PK_ES = 0, PK_CS, PK_SS, PK_DS, PK_LOCK, PK_REPNZ, PK_REPZ };
+
+enum OpcodeGroup : unsigned char { G_1 = 0, G_2, G_3B, G_3W, G_4, G_5, G_POP, G_MOV, G_COUNT };
+
+struct OpcodeEntry
+{
+	Mnemonic mnemonic;
+	unsigned char flags;
+	unsigned char group;
+	OperandSpec operands[3];
+};
+
+#define M(x) Mnemonic::x
+#define PFX(kind) { M(DB), OF_PREFIX, kind, {} }
+#define BAD { M(DB), 0, 0, {} }
+
+constexpr OpcodeEntry kOpcodeTable[256] = {
+	/* 00 */ { M(ADD), OF_MODRM | OF_BYTE, 0, { S_Eb, S_Gb } },
+	/* 01 */ { M(ADD), OF_MODRM, 0, { S_Ew, S_Gw } },
+	/* 02 */ { M(ADD), OF_MODRM | OF_BYTE, 0, { S_Gb, S_Eb } },
+	/* 03 */ { M(ADD), OF_MODRM, 0, { S_Gw, S_Ew } },
+	/* 04 */ { M(ADD), OF_BYTE, 0, { S_AL, S_Ib } },
+	/* 05 */ { M(ADD), 0, 0, { S_AX, S_Iw } },
+	/* 06 */ { M(PUSH), 0, 0, { OperandSpec(S_SEG + 0) } },
+	/* 07 */ { M(POP), 0, 0, { OperandSpec(S_SEG + 0) } },
+	/* 08 */ { M(OR), OF_MODRM | OF_BYTE, 0, { S_Eb, S_Gb } },
+	/* 09 */ { M(OR), OF_MODRM, 0, { S_Ew, S_Gw } },
+	/* 0A */ { M(OR), OF_MODRM | OF_BYTE, 0, { S_Gb, S_Eb } },
+	/* 0B */ { M(OR), OF_MODRM, 0, { S_Gw, S_Ew } },
+	/* 0C */ { M(OR), OF_BYTE, 0, { S_AL, S_Ib } },
+	/* 0D */ { M(OR), 0, 0, { S_AX, S_Iw } },
+	/* 0E */ { M(PUSH), 0, 0, { OperandSpec(S_SEG + 1) } },
+	/* 0F */ { M(POP), 0, 0, { OperandSpec(S_SEG + 1) } },
+	/* 10 */ { M(ADC), OF_MODRM | OF_BYTE, 0, { S_Eb, S_Gb } },
+	/* 11 */ { M(ADC), OF_MODRM, 0, { S_Ew, S_Gw } },
+	/* 12 */ { M(ADC), OF_MODRM | OF_BYTE, 0, { S_Gb, S_Eb } },
+	/* 13 */ { M(ADC), OF_MODRM, 0, { S_Gw, S_Ew } },
+	/* 14 */ { M(ADC), OF_BYTE, 0, { S_AL, S_Ib } },
+	/* 15 */ { M(ADC), 0, 0, { S_AX, S_Iw } },
+	/* 16 */ { M(PUSH), 0, 0, { OperandSpec(S_SEG + 2) } },
+	/* 17 */ { M(POP), 0, 0, { OperandSpec(S_SEG + 2) } },
+	/* 18 */ { M(SBB), OF_MODRM | OF_BYTE, 0, { S_Eb, S_Gb } },
+	/* 19 */ { M(SBB), OF_MODRM, 0, { S_Ew, S_Gw } },
+	/* 1A */ { M(SBB), OF_MODRM | OF_BYTE, 0, { S_Gb, S_Eb } },
+	/* 1B */ { M(SBB), OF_MODRM, 0, { S_Gw, S_Ew } },
+	/* 1C */ { M(SBB), OF_BYTE, 0, { S_AL, S_Ib } },
+	/* 1D */ { M(SBB), 0, 0, { S_AX, S_Iw } },
+	/* 1E */ { M(PUSH), 0, 0, { OperandSpec(S_SEG + 3) } },
+	/* 1F */ { M(POP), 0, 0, { OperandSpec(S_SEG + 3) } },
+	/* 20 */ { M(AND), OF_MODRM | OF_BYTE, 0, { S_Eb, S_Gb } },
+	/* 21 */ { M(AND), OF_MODRM, 0, { S_Ew, S_Gw } },
+	/* 22 */ { M(AND), OF_MODRM | OF_BYTE, 0, { S_Gb, S_Eb } },
+	/* 23 */ { M(AND), OF_MODRM, 0, { S_Gw, S_Ew } },
+	/* 24 */ { M(AND), OF_BYTE, 0, { S_AL, S_Ib } },
+	/* 25 */ { M(AND), 0, 0, { S_AX, S_Iw } },
+	/* 26 */ PFX(PK_ES),
+	/* 27 */ { M(DAA), OF_BYTE, 0, {} },
+	/* 28 */ { M(SUB), OF_MODRM | OF_BYTE, 0, { S_Eb, S_Gb } },
+	/* 29 */ { M(SUB), OF_MODRM, 0, { S_Ew, S_Gw } },
+	/* 2A */ { M(SUB), OF_MODRM | OF_BYTE, 0, { S_Gb, S_Eb } },
+	/* 2B */ { M(SUB), OF_MODRM, 0, { S_Gw, S_Ew } },
+	/* 2C */ { M(SUB), OF_BYTE, 0, { S_AL, S_Ib } },
+	/* 2D */ { M(SUB), 0, 0, { S_AX, S_Iw } },
+	/* 2E */ PFX(PK_CS),
+	/* 2F */ { M(DAS), OF_BYTE, 0, {} },
+	/* 30 */ { M(XOR), OF_MODRM | OF_BYTE, 0, { S_Eb, S_Gb } },
+	/* 31 */ { M(XOR), OF_MODRM, 0, { S_Ew, S_Gw } },
+	/* 32 */ { M(XOR), OF_MODRM | OF_BYTE, 0, { S_Gb, S_Eb } },
+	/* 33 */ { M(XOR), OF_MODRM, 0, { S_Gw, S_Ew } },
+	/* 34 */ { M(XOR), OF_BYTE, 0, { S_AL, S_Ib } },
+	/* 35 */ { M(XOR), 0, 0, { S_AX, S_Iw } },
+	/* 36 */ PFX(PK_SS),
+	/* 37 */ { M(AAA), OF_BYTE, 0, {} },
+	/* 38 */ { M(CMP), OF_MODRM | OF_BYTE, 0, { S_Eb, S_Gb } },
+	/* 39 */ { M(CMP), OF_MODRM, 0, { S_Ew, S_Gw } },
+	/* 3A */ { M(CMP), OF_MODRM | OF_BYTE, 0, { S_Gb, S_Eb } },
+	/* 3B */ { M(CMP), OF_MODRM, 0, { S_Gw, S_Ew } },
+	/* 3C */ { M(CMP), OF_BYTE, 0, { S_AL, S_Ib } },
+	/* 3D */ { M(CMP), 0, 0, { S_AX, S_Iw } },
+	/* 3E */ PFX(PK_DS),
+	/* 3F */ { M(AAS), OF_BYTE, 0, {} },
+	/* 40 */ { M(INC), 0, 0, { OperandSpec(S_R16 + 0) } },
+	/* 41 */ { M(INC), 0, 0, { OperandSpec(S_R16 + 1) } },
+	/* 42 */ { M(INC), 0, 0, { OperandSpec(S_R16 + 2) } },
+	/* 43 */ { M(INC), 0, 0, { OperandSpec(S_R16 + 3) } },
+	/* 44 */ { M(INC), 0, 0, { OperandSpec(S_R16 + 4) } },
+	/* 45 */ { M(INC), 0, 0, { OperandSpec(S_R16 + 5) } },
+	/* 46 */ { M(INC), 0, 0, { OperandSpec(S_R16 + 6) } },
+	/* 47 */ { M(INC), 0, 0, { OperandSpec(S_R16 + 7) } },
+	/* 48 */ { M(DEC), 0, 0, { OperandSpec(S_R16 + 0) } },
+	/* 49 */ { M(DEC), 0, 0, { OperandSpec(S_R16 + 1) } },
+	/* 4A */ { M(DEC), 0, 0, { OperandSpec(S_R16 + 2) } },
+	/* 4B */ { M(DEC), 0, 0, { OperandSpec(S_R16 + 3) } },
+	/* 4C */ { M(DEC), 0, 0, { OperandSpec(S_R16 + 4) } },
+	/* 4D */ { M(DEC), 0, 0, { OperandSpec(S_R16 + 5) } },
+	/* 4E */ { M(DEC), 0, 0, { OperandSpec(S_R16 + 6) } },
+	/* 4F */ { M(DEC), 0, 0, { OperandSpec(S_R16 + 7) } },
+	/* 50 */ { M(PUSH), 0, 0, { OperandSpec(S_R16 + 0) } },
+	/* 51 */ { M(PUSH), 0, 0, { OperandSpec(S_R16 + 1) } },
+	/* 52 */ { M(PUSH), 0, 0, { OperandSpec(S_R16 + 2) } },
+	/* 53 */ { M(PUSH), 0, 0, { OperandSpec(S_R16 + 3) } },
+	/* 54 */ { M(PUSH), 0, 0, { OperandSpec(S_R16 + 4) } },
+	/* 55 */ { M(PUSH), 0, 0, { OperandSpec(S_R16 + 5) } },
+	/* 56 */ { M(PUSH), 0, 0, { OperandSpec(S_R16 + 6) } },
+	/* 57 */ { M(PUSH), 0, 0, { OperandSpec(S_R16 + 7) } },
+	/* 58 */ { M(POP), 0, 0, { OperandSpec(S_R16 + 0) } },
+	/* 59 */ { M(POP), 0, 0, { OperandSpec(S_R16 + 1) } },
+	/* 5A */ { M(POP), 0, 0, { OperandSpec(S_R16 + 2) } },
+	/* 5B */ { M(POP), 0, 0, { OperandSpec(S_R16 + 3) } },
+	/* 5C */ { M(POP), 0, 0, { OperandSpec(S_R16 + 4) } },
+	/* 5D */ { M(POP), 0, 0, { OperandSpec(S_R16 + 5) } },
+	/* 5E */ { M(POP), 0, 0, { OperandSpec(S_R16 + 6) } },
+	/* 5F */ { M(POP), 0, 0, { OperandSpec(S_R16 + 7) } },
+	/* 60 */ { M(PUSHA), 0, 0, {} },
+	/* 61 */ { M(POPA), 0, 0, {} },
+	/* 62 */ { M(BOUND), OF_MODRM, 0, { S_Gw, S_M } },
+	/* 63 */ BAD,
+	/* 64 */ BAD,
+	/* 65 */ BAD,
+	/* 66 */ BAD,
+	/* 67 */ BAD,
+	/* 68 */ { M(PUSH), 0, 0, { S_Iw } },
+	/* 69 */ { M(IMUL), OF_MODRM, 0, { S_Gw, S_Ew, S_Iw } },
+	/* 6A */ { M(PUSH), 0, 0, { S_sIb } },
+	/* 6B */ { M(IMUL), OF_MODRM, 0, { S_Gw, S_Ew, S_sIb } },
+	/* 6C */ { M(INSB), OF_BYTE, 0, {} },
+	/* 6D */ { M(INSW), 0, 0, {} },
+	/* 6E */ { M(OUTSB), OF_BYTE, 0, {} },
+	/* 6F */ { M(OUTSW), 0, 0, {} },
+	/* 70 */ { M(JO), 0, 0, { S_Jb } },
+	/* 71 */ { M(JNO), 0, 0, { S_Jb } },
+	/* 72 */ { M(JB), 0, 0, { S_Jb } },
+	/* 73 */ { M(JNB), 0, 0, { S_Jb } },
+	/* 74 */ { M(JZ), 0, 0, { S_Jb } },
+	/* 75 */ { M(JNZ), 0, 0, { S_Jb } },
+	/* 76 */ { M(JBE), 0, 0, { S_Jb } },
+	/* 77 */ { M(JA), 0, 0, { S_Jb } },
+	/* 78 */ { M(JS), 0, 0, { S_Jb } },
+	/* 79 */ { M(JNS), 0, 0, { S_Jb } },
+	/* 7A */ { M(JPE), 0, 0, { S_Jb } },
+	/* 7B */ { M(JPO), 0, 0, { S_Jb } },
+	/* 7C */ { M(JL), 0, 0, { S_Jb } },
+	/* 7D */ { M(JGE), 0, 0, { S_Jb } },
+	/* 7E */ { M(JLE), 0, 0, { S_Jb } },
+	/* 7F */ { M(JG), 0, 0, { S_Jb } },
+	/* 80 */ { M(DB), OF_MODRM | OF_BYTE | OF_GROUP, G_1, { S_Eb, S_Ib } },
+	/* 81 */ { M(DB), OF_MODRM | OF_GROUP, G_1, { S_Ew, S_Iw } },
+	/* 82 */ { M(DB), OF_MODRM | OF_BYTE | OF_GROUP, G_1, { S_Eb, S_Ib } },
+	/* 83 */ { M(DB), OF_MODRM | OF_GROUP, G_1, { S_Ew, S_sIb } },
+	/* 84 */ { M(TEST), OF_MODRM | OF_BYTE, 0, { S_Eb, S_Gb } },
+	/* 85 */ { M(TEST), OF_MODRM, 0, { S_Ew, S_Gw } },
+	/* 86 */ { M(XCHG), OF_MODRM | OF_BYTE, 0, { S_Eb, S_Gb } },
+	/* 87 */ { M(XCHG), OF_MODRM, 0, { S_Ew, S_Gw } },
+	/* 88 */ { M(MOV), OF_MODRM | OF_BYTE, 0, { S_Eb, S_Gb } },
+	/* 89 */ { M(MOV), OF_MODRM, 0, { S_Ew, S_Gw } },
+	/* 8A */ { M(MOV), OF_MODRM | OF_BYTE, 0, { S_Gb, S_Eb } },
+	/* 8B */ { M(MOV), OF_MODRM, 0, { S_Gw, S_Ew } },
+	/* 8C */ { M(MOV), OF_MODRM, 0, { S_Ew, S_Sw } },
+	/* 8D */ { M(LEA), OF_MODRM, 0, { S_Gw, S_M } },
+	/* 8E */ { M(MOV), OF_MODRM, 0, { S_Sw, S_Ew } },
+	/* 8F */ { M(DB), OF_MODRM | OF_GROUP, G_POP, { S_Ew } },
+	/* 90 */ { M(NOP), 0, 0, {} },
+	/* 91 */ { M(XCHG), 0, 0, { S_AX, OperandSpec(S_R16 + 1) } },
+	/* 92 */ { M(XCHG), 0, 0, { S_AX, OperandSpec(S_R16 + 2) } },
+	/* 93 */ { M(XCHG), 0, 0, { S_AX, OperandSpec(S_R16 + 3) } },
+	/* 94 */ { M(XCHG), 0, 0, { S_AX, OperandSpec(S_R16 + 4) } },
+	/* 95 */ { M(XCHG), 0, 0, { S_AX, OperandSpec(S_R16 + 5) } },
+	/* 96 */ { M(XCHG), 0, 0, { S_AX, OperandSpec(S_R16 + 6) } },
+	/* 97 */ { M(XCHG), 0, 0, { S_AX, OperandSpec(S_R16 + 7) } },
+	/* 98 */ { M(CBW), 0, 0, {} },
+	/* 99 */ { M(CWD), 0, 0, {} },
+	/* 9A */ { M(CALLF), 0, 0, { S_Ap } },
+	/* 9B */ { M(WAIT), 0, 0, {} },
+	/* 9C */ { M(PUSHF), 0, 0, {} },
+	/* 9D */ { M(POPF), 0, 0, {} },
+	/* 9E */ { M(SAHF), 0, 0, {} },
+	/* 9F */ { M(LAHF), 0, 0, {} },
+	/* A0 */ { M(MOV), OF_BYTE, 0, { S_AL, S_Ob } },
+	/* A1 */ { M(MOV), 0, 0, { S_AX, S_Ow } },
+	/* A2 */ { M(MOV), OF_BYTE, 0, { S_Ob, S_AL } },
+	/* A3 */ { M(MOV), 0, 0, { S_Ow, S_AX } },
+	/* A4 */ { M(MOVSB), OF_BYTE, 0, {} },
+	/* A5 */ { M(MOVSW), 0, 0, {} },
+	/* A6 */ { M(CMPSB), OF_BYTE, 0, {} },
+	/* A7 */ { M(CMPSW), 0, 0, {} },
+	/* A8 */ { M(TEST), OF_BYTE, 0, { S_AL, S_Ib } },
+	/* A9 */ { M(TEST), 0, 0, { S_AX, S_Iw } },
+	/* AA */ { M(STOSB), OF_BYTE, 0, {} },
+	/* AB */ { M(STOSW), 0, 0, {} },
+	/* AC */ { M(LODSB), OF_BYTE, 0, {} },
+	/* AD */ { M(LODSW), 0, 0, {} },
+	/* AE */ { M(SCASB), OF_BYTE, 0, {} },
+	/* AF */ { M(SCASW), 0, 0, {} },
+	/* B0 */ { M(MOV), OF_BYTE, 0, { OperandSpec(S_R8 + 0), S_Ib } },
+	/* B1 */ { M(MOV), OF_BYTE, 0, { OperandSpec(S_R8 + 1), S_Ib } },
+	/* B2 */ { M(MOV), OF_BYTE, 0, { OperandSpec(S_R8 + 2), S_Ib } },
+	/* B3 */ { M(MOV), OF_BYTE, 0, { OperandSpec(S_R8 + 3), S_Ib } },
+	/* B4 */ { M(MOV), OF_BYTE, 0, { OperandSpec(S_R8 + 4), S_Ib } },
+	/* B5 */ { M(MOV), OF_BYTE, 0, { OperandSpec(S_R8 + 5), S_Ib } },
+	/* B6 */ { M(MOV), OF_BYTE, 0, { OperandSpec(S_R8 + 6), S_Ib } },
+	/* B7 */ { M(MOV), OF_BYTE, 0, { OperandSpec(S_R8 + 7), S_Ib } },
+	/* B8 */ { M(MOV), 0, 0, { OperandSpec(S_R16 + 0), S_Iw } },
+	/* B9 */ { M(MOV), 0, 0, { OperandSpec(S_R16 + 1), S_Iw } },
+	/* BA */ { M(MOV), 0, 0, { OperandSpec(S_R16 + 2), S_Iw } },
+	/* BB */ { M(MOV), 0, 0, { OperandSpec(S_R16 + 3), S_Iw } },
+	/* BC */ { M(MOV), 0, 0, { OperandSpec(S_R16 + 4), S_Iw } },
+	/* BD */ { M(MOV), 0, 0, { OperandSpec(S_R16 + 5), S_Iw } },
+	/* BE */ { M(MOV), 0, 0, { OperandSpec(S_R16 + 6), S_Iw } },
+	/* BF */ { M(MOV), 0, 0, { OperandSpec(S_R16 + 7), S_Iw } },
+	/* C0 */ { M(DB), OF_MODRM | OF_BYTE | OF_GROUP, G_2, { S_Eb, S_Ib } },
+	/* C1 */ { M(DB), OF_MODRM | OF_GROUP, G_2, { S_Ew, S_Ib } },
+	/* C2 */ { M(RET), 0, 0, { S_Iw } },
+	/* C3 */ { M(RET), 0, 0, {} },
+	/* C4 */ { M(LES), OF_MODRM, 0, { S_Gw, S_M } },
+	/* C5 */ { M(LDS), OF_MODRM, 0, { S_Gw, S_M } },
+	/* C6 */ { M(DB), OF_MODRM | OF_BYTE | OF_GROUP, G_MOV, { S_Eb, S_Ib } },
+	/* C7 */ { M(DB), OF_MODRM | OF_GROUP, G_MOV, { S_Ew, S_Iw } },
+	/* C8 */ { M(ENTER), 0, 0, { S_Iw, S_Ib } },
+	/* C9 */ { M(LEAVE), 0, 0, {} },
+	/* CA */ { M(RETF), 0, 0, { S_Iw } },
+	/* CB */ { M(RETF), 0, 0, {} },
+	/* CC */ { M(INT), 0, 0, { S_3 } },
+	/* CD */ { M(INT), 0, 0, { S_Ib } },
+	/* CE */ { M(INTO), 0, 0, {} },
+	/* CF */ { M(IRET), 0, 0, {} },
+	/* D0 */ { M(DB), OF_MODRM | OF_BYTE | OF_GROUP, G_2, { S_Eb, S_1 } },
+	/* D1 */ { M(DB), OF_MODRM | OF_GROUP, G_2, { S_Ew, S_1 } },
+	/* D2 */ { M(DB), OF_MODRM | OF_BYTE | OF_GROUP, G_2, { S_Eb, S_CL } },
+	/* D3 */ { M(DB), OF_MODRM | OF_GROUP, G_2, { S_Ew, S_CL } },
+	/* D4 */ { M(AAM), OF_BYTE, 0, { S_Ib } },
+	/* D5 */ { M(AAD), OF_BYTE, 0, { S_Ib } },
+	/* D6 */ BAD,
+	/* D7 */ { M(XLAT), OF_BYTE, 0, {} },
+	/* D8 */ { M(ESC), OF_MODRM, 0, { S_ESC, S_Ew } },
+	/* D9 */ { M(ESC), OF_MODRM, 0, { S_ESC, S_Ew } },
+	/* DA */ { M(ESC), OF_MODRM, 0, { S_ESC, S_Ew } },
+	/* DB */ { M(ESC), OF_MODRM, 0, { S_ESC, S_Ew } },
+	/* DC */ { M(ESC), OF_MODRM, 0, { S_ESC, S_Ew } },
+	/* DD */ { M(ESC), OF_MODRM, 0, { S_ESC, S_Ew } },
+	/* DE */ { M(ESC), OF_MODRM, 0, { S_ESC, S_Ew } },
+	/* DF */ { M(ESC), OF_MODRM, 0, { S_ESC, S_Ew } },
+	/* E0 */ { M(LOOPNZ), 0, 0, { S_Jb } },
+	/* E1 */ { M(LOOPZ), 0, 0, { S_Jb } },
+	/* E2 */ { M(LOOP), 0, 0, { S_Jb } },
+	/* E3 */ { M(JCXZ), 0, 0, { S_Jb } },
+	/* E4 */ { M(IN), OF_BYTE, 0, { S_AL, S_Ib } },
+	/* E5 */ { M(IN), 0, 0, { S_AX, S_Ib } },
+	/* E6 */ { M(OUT), OF_BYTE, 0, { S_Ib, S_AL } },
+	/* E7 */ { M(OUT), 0, 0, { S_Ib, S_AX } },
+	/* E8 */ { M(CALL), 0, 0, { S_Jw } },
+	/* E9 */ { M(JMP), 0, 0, { S_Jw } },
+	/* EA */ { M(JMPF), 0, 0, { S_Ap } },
+	/* EB */ { M(JMP), 0, 0, { S_Jb } },
+	/* EC */ { M(IN), OF_BYTE, 0, { S_AL, S_DX } },
+	/* ED */ { M(IN), 0, 0, { S_AX, S_DX } },
+	/* EE */ { M(OUT), OF_BYTE, 0, { S_DX, S_AL } },
+	/* EF */ { M(OUT), 0, 0, { S_DX, S_AX } },
+	/* F0 */ PFX(PK_LOCK),
+	/* F1 */ BAD,
+	/* F2 */ PFX(PK_REPNZ),
+	/* F3 */ PFX(PK_REPZ),
+	/* F4 */ { M(HLT), 0, 0, {} },
+	/* F5 */ { M(CMC), 0, 0, {} },
+	/* F6 */ { M(DB), OF_MODRM | OF_BYTE | OF_GROUP, G_3B, { S_Eb } },
+	/* F7 */ { M(DB), OF_MODRM | OF_GROUP, G_3W, { S_Ew } },
+	/* F8 */ { M(CLC), 0, 0, {} },
+	/* F9 */ { M(STC), 0, 0, {} },
+	/* FA */ { M(CLI), 0, 0, {} },
+	/* FB */ { M(STI), 0, 0, {} },
+	/* FC */ { M(CLD), 0, 0, {} },
+	/* FD */ { M(STD), 0, 0, {} },
+	/* FE */ { M(DB), OF_MODRM | OF_BYTE | OF_GROUP, G_4, { S_Eb } },
+	/* FF */ { M(DB), OF_MODRM | OF_GROUP, G_5, { S_Ew } },
+};
+
+// Group members inherit the operands of the main opcode unless they list their own.
+constexpr OpcodeEntry kOpcodeGroups[G_COUNT][8] = {
+	/* G_1 */ {
+		{ M(ADD), 0, 0, {} }, { M(OR), 0, 0, {} }, { M(ADC), 0, 0, {} }, { M(SBB), 0, 0, {} },
+		{ M(AND), 0, 0, {} }, { M(SUB), 0, 0, {} }, { M(XOR), 0, 0, {} }, { M(CMP), 0, 0, {} },
+	},
+	/* G_2 */ {
+		{ M(ROL), 0, 0, {} }, { M(ROR), 0, 0, {} }, { M(RCL), 0, 0, {} }, { M(RCR), 0, 0, {} },
+		{ M(SHL), 0, 0, {} }, { M(SHR), 0, 0, {} }, { M(SHL), 0, 0, {} }, { M(SAR), 0, 0, {} },
+	},
+	/* G_3B */ {
+		{ M(TEST), 0, 0, { S_Eb, S_Ib } }, { M(TEST), 0, 0, { S_Eb, S_Ib } },
+		{ M(NOT), 0, 0, {} }, { M(NEG), 0, 0, {} },
+		{ M(MUL), 0, 0, {} }, { M(IMUL), 0, 0, {} }, { M(DIV), 0, 0, {} }, { M(IDIV), 0, 0, {} },
+	},
+	/* G_3W */ {
+		{ M(TEST), 0, 0, { S_Ew, S_Iw } }, { M(TEST), 0, 0, { S_Ew, S_Iw } },
+		{ M(NOT), 0, 0, {} }, { M(NEG), 0, 0, {} },
+		{ M(MUL), 0, 0, {} }, { M(IMUL), 0, 0, {} }, { M(DIV), 0, 0, {} }, { M(IDIV), 0, 0, {} },
+	},
+	/* G_4 */ {
+		{ M(INC), 0, 0, {} }, { M(DEC), 0, 0, {} }, BAD, BAD, BAD, BAD, BAD, BAD,
+	},
+	/* G_5 */ {
+		{ M(INC), 0, 0, {} }, { M(DEC), 0, 0, {} },
+		{ M(CALL), 0, 0, {} }, { M(CALLF), 0, 0, { S_M } },
+		{ M(JMP), 0, 0, {} }, { M(JMPF), 0, 0, { S_M } },
+		{ M(PUSH), 0, 0, {} }, BAD,
+	},
+	/* G_POP */ {
+		{ M(POP), 0, 0, {} }, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	},
+	/* G_MOV */ {
+		{ M(MOV), 0, 0, {} }, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+	},
+};
+
+#undef BAD
+#undef PFX
+#undef M
+
+static_assert(sizeof(kOpcodeTable) / sizeof(kOpcodeTable[0]) == 256, "opcode table must cover every byte");
+static_assert(sizeof(kMnemonicNames) / sizeof(kMnemonicNames[0]) == size_t(Mnemonic::COUNT),
+		"mnemonic names out of sync");
+
+bool IsShift(Mnemonic m)
+{
+	return m >= Mnemonic::ROL && m <= Mnemonic::SAR;
+}
+
+char* AppendText(char* out, const char* end, const char* s)
+{
+	while (*s && out < end) {
+		*out++ = *s++;
+	}
+	return out;
+}
+
+char* AppendHex(char* out, const char* end, unsigned value, int digits)
+{
+	static const char kDigits[] = "0123456789ABCDEF";
+	while (digits-- > 0 && out < end) {
+		*out++ = kDigits[(value >> (digits * 4)) & 0xF];
+	}
+	return out;
+}
+
+} // namespace
+
+bool Memory::ParseOneInstrument(const unsigned char* p, size_t avail, Instruction& ins)
+{
+	static const size_t MAX_LENGTH = 15;
+
+	ins = Instruction();
+	ins.length = 1;
+	ins.operands[0].type = OT_IMM;
+	ins.operands[0].size = 1;
+	ins.operands[0].disp = avail > 0 ? p[0] : 0;
+	if (avail == 0) {
+		return false;
+	}
+	if (avail > MAX_LENGTH) {
+		avail = MAX_LENGTH;
+	}
+
+	size_t n = 0;
+	const OpcodeEntry* entry = &kOpcodeTable[p[n]];
+	while (entry->flags & OF_PREFIX) {
+		switch (entry->group) {
+		case PK_LOCK:  ins.lock = true; break;
+		case PK_REPNZ: ins.repeat = Instruction::REP_NZ; break;
+		case PK_REPZ:  ins.repeat = Instruction::REP_Z; break;
+		default:       ins.segment = entry->group; break;
+		}
+		if (++n >= avail) {
+			return false;
+		}
+		entry = &kOpcodeTable[p[n]];
+	}
+	unsigned char opcode = p[n++];
+
+	unsigned char modrm = 0;
+	if (entry->flags & OF_MODRM) {
+		if (n >= avail) {
+			return false;
+		}
+		modrm = p[n++];
+	}
+	const OperandSpec* specs = entry->operands;
+	Mnemonic mnemonic = entry->mnemonic;
+	if (entry->flags & OF_GROUP) {
+		const OpcodeEntry& member = kOpcodeGroups[entry->group][(modrm >> 3) & 7];
+		mnemonic = member.mnemonic;
+		if (member.operands[0] != S_NONE) {
+			specs = member.operands;
+		}
+	}
+	if (mnemonic == Mnemonic::DB) {
+		return true;
+	}
+
+	unsigned mod = modrm >> 6;
+	unsigned reg = (modrm >> 3) & 7;
+	unsigned rm = modrm & 7;
+	Operand mem;
+	if (entry->flags & OF_MODRM) {
+		mem.type = OT_MEM;
+		mem.reg = static_cast<unsigned char>(rm);
+		mem.size = static_cast<unsigned char>(mod == 3 ? 0 : mod);
+		if (mod == 0 && rm == 6) {
+			mem.reg = Operand::MEM_DIRECT;
+			mem.size = 2;
+		}
+		if (n + mem.size > avail) {
+			return false;
+		}
+		if (mem.size == 1) {
+			mem.disp = static_cast<unsigned short>(static_cast<signed char>(p[n]));
+		} else if (mem.size == 2) {
+			mem.disp = static_cast<unsigned short>(p[n] | (p[n + 1] << 8));
+		}
+		n += mem.size;
+	}
+
+	Operand operands[3];
+	for (int i = 0; i < 3 && specs[i] != S_NONE; ++i) {
+		Operand& o = operands[i];
+		size_t need = 0;
+		switch (specs[i]) {
+		case S_Eb: case S_Ew:
+			if (mod == 3) {
+				o.type = (specs[i] == S_Eb ? OT_REG8 : OT_REG16);
+				o.reg = static_cast<unsigned char>(rm);
+			} else {
+				o = mem;
+			}
+			break;
+		case S_M:
+			if (mod == 3) {
+				return true; // register form is undefined; leave it as DB
+			}
+			o = mem;
+			break;
+		case S_Gb: o.type = OT_REG8; o.reg = static_cast<unsigned char>(reg); break;
+		case S_Gw: o.type = OT_REG16; o.reg = static_cast<unsigned char>(reg); break;
+		case S_Sw:
+			if (reg > 3) {
+				return true;
+			}
+			o.type = OT_SREG;
+			o.reg = static_cast<unsigned char>(reg);
+			break;
+		case S_Ib: o.type = OT_IMM; o.size = 1; need = 1; break;
+		case S_sIb: o.type = OT_IMM; o.size = Operand::IMM_SIGNED; need = 1; break;
+		case S_Iw: o.type = OT_IMM; o.size = 2; need = 2; break;
+		case S_Jb: o.type = OT_REL; o.size = 1; need = 1; break;
+		case S_Jw: o.type = OT_REL; o.size = 2; need = 2; break;
+		case S_Ob: case S_Ow:
+			o.type = OT_MEM; o.reg = Operand::MEM_DIRECT; o.size = 2; need = 2; break;
+		case S_Ap: o.type = OT_FAR; need = 4; break;
+		case S_1: o.type = OT_IMM; o.disp = 1; break;
+		case S_3: o.type = OT_IMM; o.disp = 3; break;
+		case S_ESC:
+			o.type = OT_IMM;
+			o.size = 1;
+			o.disp = static_cast<unsigned short>(((opcode & 7) << 3) | reg);
+			break;
+		default:
+			if (specs[i] >= S_SEG) {
+				o.type = OT_SREG;
+				o.reg = static_cast<unsigned char>(specs[i] - S_SEG);
+			} else if (specs[i] >= S_R16) {
+				o.type = OT_REG16;
+				o.reg = static_cast<unsigned char>(specs[i] - S_R16);
+			} else {
+				o.type = OT_REG8;
+				o.reg = static_cast<unsigned char>(specs[i] - S_R8);
+			}
+			break;
+		}
+		if (need > 0) {
+			if (n + need > avail) {
+				return false;
+			}
+			unsigned short value = p[n];
+			if (need == 1) {
+				if (o.type == OT_REL || o.size == Operand::IMM_SIGNED) {
+					value = static_cast<unsigned short>(static_cast<signed char>(p[n]));
+				}
+			} else {
+				value = static_cast<unsigned short>(value | (p[n + 1] << 8));
+			}
+			o.disp = value;
+			if (need == 4) {
+				o.seg = static_cast<unsigned short>(p[n + 2] | (p[n + 3] << 8));
+			}
+			n += need;
+		}
+	}
+
+	ins.mnemonic = mnemonic;
+	ins.length = static_cast<unsigned char>(n);
+	ins.width = (entry->flags & OF_BYTE) ? 1 : 2;
+	for (int i = 0; i < 3; ++i) {
+		ins.operands[i] = operands[i];
+	}
+	return true;
+}
+
+size_t Instruction::Format(unsigned short ip, char* buf, size_t size) const
+{
+	if (size == 0) {
+		return 0;
+	}
+	char* out = buf;
+	const char* end = buf + size - 1;
+
+	if (mnemonic == Mnemonic::DB) {
+		out = AppendText(out, end, "DB      ");
+		out = AppendHex(out, end, operands[0].disp, 2);
+		*out = '\0';
+		return out - buf;
+	}
+
+	if (lock) {
+		out = AppendText(out, end, "LOCK ");
+	}
+	if (repeat != REP_NONE) {
+		bool compares = (mnemonic == Mnemonic::CMPSB || mnemonic == Mnemonic::CMPSW ||
+				mnemonic == Mnemonic::SCASB || mnemonic == Mnemonic::SCASW);
+		if (!compares) {
+			out = AppendText(out, end, "REP ");
+		} else {
+			out = AppendText(out, end, repeat == REP_Z ? "REPZ " : "REPNZ ");
+		}
+	}
+	out = AppendText(out, end, kMnemonicNames[static_cast<size_t>(mnemonic)]);
+	if (operands[0].type == OT_NONE) {
+		*out = '\0';
+		return out - buf;
+	}
+	do {
+		*out++ = ' ';
+	} while (out - buf < 8 && out < end);
+
+	bool sized = false;
+	for (const auto& o : operands) {
+		if (o.type == OT_REG8 || o.type == OT_REG16 || o.type == OT_SREG) {
+			sized = true;
+		}
+	}
+	if (IsShift(mnemonic)) {
+		sized = false;
+	}
+	bool wordOnly = (mnemonic == Mnemonic::PUSH || mnemonic == Mnemonic::POP ||
+			mnemonic == Mnemonic::CALL || mnemonic == Mnemonic::JMP || mnemonic == Mnemonic::ESC);
+
+	for (int i = 0; i < 3 && operands[i].type != OT_NONE; ++i) {
+		const Operand& o = operands[i];
+		if (i > 0) {
+			out = AppendText(out, end, ",");
+		}
+		switch (o.type) {
+		case OT_REG8:  out = AppendText(out, end, kReg8Names[o.reg]); break;
+		case OT_REG16: out = AppendText(out, end, kReg16Names[o.reg]); break;
+		case OT_SREG:  out = AppendText(out, end, kSegNames[o.reg]); break;
+		case OT_MEM:
+			if (mnemonic == Mnemonic::CALLF || mnemonic == Mnemonic::JMPF) {
+				out = AppendText(out, end, "FAR ");
+			} else if (!sized && !wordOnly) {
+				out = AppendText(out, end, width == 1 ? "BYTE PTR " : "WORD PTR ");
+			}
+			if (segment != NO_SEGMENT) {
+				out = AppendText(out, end, kSegNames[segment]);
+				out = AppendText(out, end, ":");
+			}
+			out = AppendText(out, end, "[");
+			if (o.reg == Operand::MEM_DIRECT) {
+				out = AppendHex(out, end, o.disp, 4);
+			} else {
+				out = AppendText(out, end, kMemBaseNames[o.reg]);
+				if (o.size == 1) {
+					signed char d = static_cast<signed char>(o.disp);
+					out = AppendText(out, end, d < 0 ? "-" : "+");
+					out = AppendHex(out, end, d < 0 ? -d : d, 2);
+				} else if (o.size == 2) {
+					out = AppendText(out, end, "+");
+					out = AppendHex(out, end, o.disp, 4);
+				}
+			}
+			out = AppendText(out, end, "]");
+			break;
+		case OT_IMM:
+			if (o.size == 0) {
+				out = AppendHex(out, end, o.disp, 1);
+			} else if (o.size == Operand::IMM_SIGNED) {
+				short d = static_cast<short>(o.disp);
+				out = AppendText(out, end, d < 0 ? "-" : "+");
+				out = AppendHex(out, end, d < 0 ? -d : d, 2);
+			} else {
+				out = AppendHex(out, end, o.disp, o.size * 2);
+			}
+			break;
+		case OT_REL:
+			out = AppendHex(out, end, static_cast<unsigned short>(ip + length + o.disp), 4);
+			break;
+		case OT_FAR:
+			out = AppendHex(out, end, o.seg, 4);
+			out = AppendText(out, end, ":");
+			out = AppendHex(out, end, o.disp, 4);
+			break;
+		default:
+			break;
+		}
+	}
+	*out = '\0';
+	return out - buf;
+}
+
+size_t Memory::Fetch(unsigned short seg, unsigned short offset, unsigned char* buf, size_t size) const
+{
+	for (size_t i = 0; i < size; ++i) {
+		buf[i] = ReadByte(seg, static_cast<unsigned short>(offset + i));
+	}
+	return size;
+}
+
+unsigned short Memory::UnassembleOne(unsigned short seg, unsigned short offset) const
+{
+	unsigned char bytes[16];
+	Instruction ins;
+	ParseOneInstrument(bytes, Fetch(seg, offset, bytes, sizeof(bytes)), ins);
+
+	char hex[2 * sizeof(bytes) + 1];
+	char* h = hex;
+	for (size_t i = 0; i < ins.length; ++i) {
+		h = AppendHex(h, hex + sizeof(hex) - 1, bytes[i], 2);
+	}
+	*h = '\0';
+	char text[64];
+	ins.Format(offset, text, sizeof(text));
+	printf("%04X:%04X %-14s%s\n", seg, offset, hex, text);
+	return static_cast<unsigned short>(offset + ins.length);
+}
+
+unsigned short Memory::Unassemble(unsigned short seg, unsigned short offset) const
+{
+	unsigned short x = offset;
+	while (static_cast<unsigned short>(x - offset) < 32) {
+		x = UnassembleOne(seg, x);
+	}
+	return x;
+}
+
+namespace {
+
+// Listing lines for an image in host memory read "seg:offset bytes text",
+// as U prints them; byte i of an image loaded at seg:offset sits at
+// seg:offset + i, and offsets past FFFF continue in the next 64KB segment.
+// Files too large for the 1MB address space are listed by their linear
+// offset instead, as seg:offset addresses would repeat.
+struct ListingOrigin
+{
+	unsigned short seg;
+	unsigned short offset;
+	bool linear;  // addresses as 8 hex digit offsets into the image
+};
+
+const size_t LISTING_TEXT_SIZE = 64;
+const size_t LISTING_LINE_SIZE = 10 + 2 * 15 + LISTING_TEXT_SIZE;  // address, bytes, text
+
+// Writes the address and the bytes of a line; returns where its text goes.
+char* FormatListingPrefix(char* out, const ListingOrigin& origin,
+		size_t index, const unsigned char* bytes, size_t length)
+{
+	static const size_t HEX_COLUMN = 14;
+
+	size_t address = origin.offset + index;
+	if (origin.linear) {
+		out = PutHex16(out, static_cast<unsigned short>(index >> 16));
+		out = PutHex16(out, static_cast<unsigned short>(index));
+	} else {
+		out = PutHex16(out, static_cast<unsigned short>(origin.seg + (address >> 16) * 0x1000));
+		*out++ = ':';
+		out = PutHex16(out, static_cast<unsigned short>(address));
+	}
+	*out++ = ' ';
+	memset(out, ' ', HEX_COLUMN);
+	for (size_t i = 0; i < length; ++i) {
+		memcpy(out + 2 * i, kDump.hex[bytes[i]], 2);
+	}
+	return out + max(2 * length, HEX_COLUMN);
+}
+
+char* FormatListingLine(char* out, const ListingOrigin& origin,
+		size_t index, const unsigned char* bytes, const Instruction& ins)
+{
+	char* text = FormatListingPrefix(out, origin, index, bytes, ins.length);
+	out = text + ins.Format(static_cast<unsigned short>(origin.offset + index), text, LISTING_TEXT_SIZE);
+	*out++ = '\n';
+	return out;
+}
+
+// Recursive descent disassembly of an image held in host memory. Only bytes
+// that control flow from the entry points reaches are decoded as code; the
+// rest is listed as data. Near branches stay in the 64KB frame they start in.
+class Disassembler
+{
+public:
+	Disassembler(const unsigned char* data, size_t size, const ListingOrigin& origin)
+		: data_(data), size_(size), origin_(origin), state_(size) {}
+
+	void AddEntry(size_t index)
+	{
+		if (index < size_ && state_[index] == UNSEEN) {
+			pending_.push_back(index);
+		}
+	}
+	void Trace();
+	void Write() const;
+private:
+	// Per byte: UNSEEN, BODY, or the length of the instruction starting there.
+	enum : unsigned char { UNSEEN = 0, BODY = 0x80 };
+	static const size_t MAX_DATA_LINE = 6;  // bytes, as many as fit the hex column
+
+	void TraceFrom(size_t index);
+	size_t NearTarget(size_t index, const Instruction& ins) const;
+	size_t FarTarget(const Operand& o) const;
+
+	const unsigned char* data_;
+	size_t size_;
+	ListingOrigin origin_;
+	vector<unsigned char> state_;
+	vector<size_t> pending_;
+};
+
+void Disassembler::Trace()
+{
+	while (!pending_.empty()) {
+		size_t index = pending_.back();
+		pending_.pop_back();
+		TraceFrom(index);
+	}
+}
+
+// Decodes straight-line code from index until control cannot fall through,
+// queueing the targets of branches and calls on the way. Undefined opcodes,
+// the end of the image and bytes already claimed by other instructions end
+// the run as well.
+void Disassembler::TraceFrom(size_t index)
+{
+	Instruction ins;
+	while (index < size_ && state_[index] == UNSEEN) {
+		Memory::ParseOneInstrument(data_ + index, min<size_t>(16, size_ - index), ins);
+		if (ins.mnemonic == Mnemonic::DB) {
+			return;
+		}
+		size_t length = ins.length;
+		unsigned char* state = &state_[index];
+		for (size_t i = 1; i < length; ++i) {
+			if (state[i] != UNSEEN) {
+				return;
+			}
+		}
+		state[0] = static_cast<unsigned char>(length);
+		for (size_t i = 1; i < length; ++i) {
+			state[i] = BODY;
+		}
+
+		const Operand& o = ins.operands[0];
+		switch (ins.mnemonic) {
+		case Mnemonic::JMP:
+			if (o.type == OT_REL) {
+				AddEntry(NearTarget(index, ins));
+			}
+			return;
+		case Mnemonic::JMPF:
+			if (o.type == OT_FAR) {
+				AddEntry(FarTarget(o));
+			}
+			return;
+		case Mnemonic::CALLF:
+			if (o.type == OT_FAR) {
+				AddEntry(FarTarget(o));
+			}
+			break;
+		case Mnemonic::RET:
+		case Mnemonic::RETF:
+		case Mnemonic::IRET:
+		case Mnemonic::HLT:
+			return;
+		case Mnemonic::INT:
+			if (o.disp == 0x20) {
+				return;  // program terminate
+			}
+			break;
+		default:
+			// CALL, conditional jumps, LOOPs and JCXZ
+			if (o.type == OT_REL) {
+				AddEntry(NearTarget(index, ins));
+			}
+			break;
+		}
+		index += length;
+	}
+}
+
+size_t Disassembler::NearTarget(size_t index, const Instruction& ins) const
+{
+	size_t address = origin_.offset + index;
+	size_t target = (address & ~size_t(0xFFFF)) | ((address + ins.length + ins.operands[0].disp) & 0xFFFF);
+	return target >= origin_.offset ? target - origin_.offset : size_;
+}
+
+size_t Disassembler::FarTarget(const Operand& o) const
+{
+	size_t base = (size_t(origin_.seg) << 4) + origin_.offset;
+	size_t target = (size_t(o.seg) << 4) + o.disp;
+	return target >= base ? target - base : size_;
+}
+
+// Lists the image in address order, formatting each line in place in a large
+// buffer that is streamed the way Memory::Dump streams its lines.
+void Disassembler::Write() const
+{
+	static const size_t BUFFER_SIZE = 1024 * LISTING_LINE_SIZE;
+
+	vector<char> buf(BUFFER_SIZE);
+	char* out = buf.data();
+	Instruction ins;
+	for (size_t index = 0; index < size_; ) {
+		size_t length = state_[index];
+		if (length != UNSEEN) {
+			Memory::ParseOneInstrument(data_ + index, length, ins);
+			out = FormatListingLine(out, origin_, index, data_ + index, ins);
+		} else {
+			// A data line stops at the next instruction and at the end of
+			// the 64KB frame, so that its address stays exact.
+			do {
+				++length;
+			} while (length < MAX_DATA_LINE && index + length < size_ &&
+					state_[index + length] == UNSEEN && ((origin_.offset + index + length) & 0xFFFF) != 0);
+			char* text = FormatListingPrefix(out, origin_, index, data_ + index, length);
+			out = AppendText(text, text + LISTING_TEXT_SIZE, "DB      ");
+			for (size_t i = 0; i < length; ++i) {
+				out = AppendHex(out, text + LISTING_TEXT_SIZE, data_[index + i], 2);
+				*out++ = ',';
+			}
+			out[-1] = '\n';
+		}
+		if (out + LISTING_LINE_SIZE > buf.data() + buf.size()) {
+			WriteOut(buf.data(), out - buf.data());
+			out = buf.data();
+		}
+		index += length;
+	}
+	fwrite(buf.data(), 1, out - buf.data(), stdout);
+}
+
+// Linear sweep of an image, decoded in chunks on a pool of threads. Each
+// chunk is decoded from its first byte on speculation. The merge, in image
+// order, knows where the instruction before a chunk really ends; if that is
+// not one of the chunk's own instruction starts, it decodes on from there
+// until it lands on one, after which both agree and the rest of the chunk's
+// lines are used as they are. x86 code falls into step within a few bytes.
+// Only a window of chunks is held at a time, so memory stays bounded.
+class SweepDisassembler
+{
+public:
+	SweepDisassembler(const unsigned char* data, size_t size, const ListingOrigin& origin, unsigned threads)
+		: data_(data), size_(size), origin_(origin), threads_(max(threads, 1u)) {}
+
+	void Write();
+private:
+	static const size_t CHUNK_SIZE = 64 << 10;
+
+	struct Chunk
+	{
+		vector<size_t> starts;  // instruction starts, in image order
+		vector<size_t> ends;    // where the line of each start ends in text
+		vector<char> text;
+		size_t end = 0;         // where the last instruction ends
+	};
+
+	void Work();
+	void Decode(size_t first, Chunk& chunk) const;
+	char* DecodeOne(size_t& index, char* out) const;
+
+	const unsigned char* data_;
+	size_t size_;
+	ListingOrigin origin_;
+	unsigned threads_;
+
+	mutex lock_;
+	condition_variable changed_;
+	vector<unique_ptr<Chunk>> chunks_;  // decoded and not yet merged
+	size_t next_ = 0;    // chunk for the next worker to take
+	size_t merged_ = 0;  // chunks written so far
+	size_t window_ = 0;  // chunks that may be in flight beyond merged_
+};
+
+void SweepDisassembler::Write()
+{
+	static const size_t BUFFER_SIZE = 1024 * LISTING_LINE_SIZE;
+
+	size_t count = (size_ + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	chunks_.clear();
+	chunks_.resize(count);
+	next_ = merged_ = 0;
+	window_ = 2 * threads_;
+	vector<thread> workers;
+	for (unsigned worker = 0; worker < min<size_t>(threads_, count); ++worker) {
+		workers.emplace_back(&SweepDisassembler::Work, this);
+	}
+
+	vector<char> buf(BUFFER_SIZE);
+	char* out = buf.data();
+	size_t index = 0;  // where the next instruction really starts
+	for (size_t k = 0; k < count; ++k) {
+		unique_ptr<Chunk> chunk;
+		{
+			unique_lock<mutex> guard(lock_);
+			changed_.wait(guard, [&]() { return chunks_[k] != nullptr; });
+			chunk = move(chunks_[k]);
+			merged_ = k + 1;
+		}
+		changed_.notify_all();
+
+		size_t last = min(size_, (k + 1) * CHUNK_SIZE);
+		auto start = lower_bound(chunk->starts.begin(), chunk->starts.end(), index);
+		while (index < last && (start == chunk->starts.end() || *start != index)) {
+			out = DecodeOne(index, out);
+			if (out + LISTING_LINE_SIZE > buf.data() + buf.size()) {
+				WriteOut(buf.data(), out - buf.data());
+				out = buf.data();
+			}
+			start = lower_bound(start, chunk->starts.end(), index);
+		}
+		if (index < last) {
+			size_t line = start - chunk->starts.begin();
+			size_t from = line > 0 ? chunk->ends[line - 1] : 0;
+			WriteOut(buf.data(), out - buf.data());
+			out = buf.data();
+			WriteOut(chunk->text.data() + from, chunk->text.size() - from);
+			index = chunk->end;
+		}
+	}
+	for (thread& worker : workers) {
+		worker.join();
+	}
+	fwrite(buf.data(), 1, out - buf.data(), stdout);
+}
+
+void SweepDisassembler::Work()
+{
+	for (;;) {
+		size_t k;
+		{
+			unique_lock<mutex> guard(lock_);
+			changed_.wait(guard, [&]() { return next_ == chunks_.size() || next_ < merged_ + window_; });
+			if (next_ == chunks_.size()) {
+				return;
+			}
+			k = next_++;
+		}
+		auto chunk = make_unique<Chunk>();
+		Decode(k * CHUNK_SIZE, *chunk);
+		{
+			lock_guard<mutex> guard(lock_);
+			chunks_[k] = move(chunk);
+		}
+		changed_.notify_all();
+	}
+}
+
+// Decodes the chunk that starts at first, up to the instruction that
+// crosses its end.
+void SweepDisassembler::Decode(size_t first, Chunk& chunk) const
+{
+	size_t last = min(size_, first + CHUNK_SIZE);
+	chunk.starts.reserve(CHUNK_SIZE / 2);
+	chunk.ends.reserve(CHUNK_SIZE / 2);
+	chunk.text.resize(CHUNK_SIZE * 16);
+	char* out = chunk.text.data();
+	size_t index = first;
+	while (index < last) {
+		if (out + LISTING_LINE_SIZE > chunk.text.data() + chunk.text.size()) {
+			size_t used = out - chunk.text.data();
+			chunk.text.resize(2 * chunk.text.size() + LISTING_LINE_SIZE);
+			out = chunk.text.data() + used;
+		}
+		chunk.starts.push_back(index);
+		out = DecodeOne(index, out);
+		chunk.ends.push_back(out - chunk.text.data());
+	}
+	chunk.text.resize(out - chunk.text.data());
+	chunk.end = index;
+}
+
+// Lists the instruction at index and moves index past it.
+char* SweepDisassembler::DecodeOne(size_t& index, char* out) const
+{
+	Instruction ins;
+	Memory::ParseOneInstrument(data_ + index, min<size_t>(16, size_ - index), ins);
+	out = FormatListingLine(out, origin_, index, data_ + index, ins);
+	index += ins.length;
+	return out;
+}
+
+} // namespace
+
+void Memory::Unassemble(unsigned short seg, unsigned short start, unsigned long long count) const
+{
+	unsigned linear = Linear(seg, start);
+	vector<unsigned char> image(min<unsigned long long>(count, MEMORY_SIZE));
+	size_t first = min<size_t>(image.size(), MEMORY_SIZE - linear);
+	CopyOut(linear, image.data(), first);
+	CopyOut(0, image.data() + first, image.size() - first);
+
+	Disassembler disassembler(image.data(), image.size(), ListingOrigin{seg, start, false});
+	disassembler.AddEntry(0);
+	disassembler.Trace();
+	disassembler.Write();
+}
+
+namespace {
+
+// Files are listed as if loaded at 0000:0000 when they fit in memory.
+ListingOrigin FileOrigin(const MappedFile& file)
+{
+	return ListingOrigin{0, 0, file.GetSize() > Memory::MEMORY_SIZE};
+}
+
+} // namespace
+
+// Disassembles a file mapped at 0000:0000 without loading it into guest
+// memory; entries are offsets into the file, the start of it if none given.
+bool DisassembleFile(const string& filename, const vector<size_t>& entries)
+{
+	MappedFile file;
+	if (!file.Open(filename)) {
+		return false;
+	}
+	Disassembler disassembler(file.GetData(), file.GetSize(), FileOrigin(file));
+	for (size_t entry : entries) {
+		disassembler.AddEntry(entry);
+	}
+	if (entries.empty()) {
+		disassembler.AddEntry(0);
+	}
+	disassembler.Trace();
+	disassembler.Write();
+	return true;
+}
+
+// Disassembles every byte of a file mapped at 0000:0000 in a linear sweep,
+// the way U does, decoding on the given number of threads.
+bool SweepFile(const string& filename, unsigned threads)
+{
+	MappedFile file;
+	if (!file.Open(filename)) {
+		return false;
+	}
+	SweepDisassembler disassembler(file.GetData(), file.GetSize(), FileOrigin(file), threads);
+	disassembler.Write();
+	return true;
+}
+
+void Processor::SetProcessorType(ProcessorType type)
+{
+	processor = type;
+}
+
+void Processor::SetCoProcessorType(CoProcessorType type)
+{
+	coprocessor = type;
+}
+
+void Processor::ShowProcessorType()
+{
+	switch (processor) {
+	case ProcessorType::PT_8086: cout << "8086/88"; break;
+	case ProcessorType::PT_186:  cout << "186";     break;
+	case ProcessorType::PT_286:  cout << "286";     break;
+	case ProcessorType::PT_386:  cout << "386";     break;
+	case ProcessorType::PT_486:  cout << "486";     break;
+	case ProcessorType::PT_586:  cout << "586";     break;
+	case ProcessorType::PT_686:  cout << "686";     break;
+	default: cout.setstate(ios_base::failbit);
+	}
+
+	cout << " ";
+
+	switch (coprocessor) {
+	case CoProcessorType::CPT_NONE: cout << "without coprocessor"; break;
+	case CoProcessorType::CPT_287:  cout << "with 287";            break;
+	case CoProcessorType::CPT_387:  cout << "with coprocessor";    break;
+	default: cout.setstate(ios_base::failbit);
+	}
+
+	cout << endl;
+}
+
+namespace {
+
+struct ParityTable
+{
+	bool even[256];
+
+	constexpr ParityTable() : even()
+	{
+		for (unsigned i = 0; i < 256; ++i) {
+			unsigned bits = 0;
+			for (unsigned v = i; v != 0; v >>= 1) {
+				bits += v & 1;
+			}
+			even[i] = (bits % 2 == 0);
+		}
+	}
+};
+
+constexpr ParityTable kParity;
+
+inline unsigned WidthMask(unsigned width) { return width == 1 ? 0xFF : 0xFFFF; }
+inline unsigned SignBit(unsigned width) { return width == 1 ? 0x80 : 0x8000; }
+
+} // namespace
+
+void Memory::MarkCode(unsigned firstPage, unsigned lastPage)
+{
+	for (unsigned page = firstPage; page <= lastPage; ++page) {
+		pageAttr_[page % PAGE_COUNT] |= PA_CODE;
+	}
+}
+
+void Memory::UnmarkCode(unsigned firstPage, unsigned lastPage)
+{
+	for (unsigned page = firstPage; page <= lastPage; ++page) {
+		pageAttr_[page % PAGE_COUNT] &= ~PA_CODE;
+	}
+}
+
+void Memory::BeforeWrite(unsigned linear, size_t size)
+{
+	if (size == 0) {
+		return;
+	}
+	unsigned firstPage = linear >> PAGE_SHIFT;
+	unsigned lastPage = static_cast<unsigned>((linear + size - 1) >> PAGE_SHIFT);
+	for (unsigned page = firstPage; page <= lastPage; ++page) {
+		if (pageAttr_[page % PAGE_COUNT] != 0) {
+			OnPageWrite(page % PAGE_COUNT);
+		}
+	}
+}
+
+// Like BeforeWrite, for a range that is about to be overwritten completely:
+// fresh pages lying fully inside it skip the power-on pattern.
+void Memory::PrepareOverwrite(unsigned linear, size_t size)
+{
+	unsigned firstFull = (linear + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	unsigned endFull = static_cast<unsigned>((linear + size) >> PAGE_SHIFT);
+	for (unsigned page = firstFull; page < endFull; ++page) {
+		pageAttr_[page % PAGE_COUNT] &= ~PA_FRESH;
+	}
+	BeforeWrite(linear, size);
+}
+
+void Memory::OnPageWrite(unsigned page)
+{
+	if (pageAttr_[page] & PA_FRESH) {
+		Materialize(page);
+	}
+	MarkDirty(page);
+	if (pageAttr_[page] & PA_SHARED) {
+		// First write since the last image: the image page stops being shared.
+		unsigned imagePage = page / PAGES_PER_IMAGE_PAGE;
+		for (unsigned i = 0; i < PAGES_PER_IMAGE_PAGE; ++i) {
+			pageAttr_[imagePage * PAGES_PER_IMAGE_PAGE + i] &= ~PA_SHARED;
+		}
+		changedPages_.push_back(imagePage);
+	}
+	if (pageAttr_[page] & PA_CODE) {
+		pageAttr_[page] &= ~PA_CODE;
+		if (codeWriteHandler_) {
+			codeWriteHandler_(page);
+		}
+	}
+}
+
+void Memory::AddWatch(unsigned linear, unsigned size)
+{
+	if (size == 0) {
+		return;
+	}
+	watches_.push_back({linear & (MEMORY_SIZE - 1), min(size, static_cast<unsigned>(MEMORY_SIZE))});
+	MarkWatched(watches_.back(), true);
+}
+
+// Removes the watches starting at linear; false if there are none.
+bool Memory::RemoveWatch(unsigned linear)
+{
+	linear &= MEMORY_SIZE - 1;
+	auto end = remove_if(watches_.begin(), watches_.end(),
+			[linear](const WatchRange& watch) { return watch.linear == linear; });
+	if (end == watches_.end()) {
+		return false;
+	}
+	for (auto it = end; it != watches_.end(); ++it) {
+		MarkWatched(*it, false);
+	}
+	watches_.erase(end, watches_.end());
+	for (const WatchRange& watch : watches_) {
+		MarkWatched(watch, true);  // pages shared with the removed ones
+	}
+	return true;
+}
+
+void Memory::ClearWatches()
+{
+	for (const WatchRange& watch : watches_) {
+		MarkWatched(watch, false);
+	}
+	watches_.clear();
+}
+
+void Memory::MarkWatched(const WatchRange& watch, bool on)
+{
+	unsigned firstPage = watch.linear >> PAGE_SHIFT;
+	unsigned lastPage = (watch.linear + watch.size - 1) >> PAGE_SHIFT;
+	for (unsigned page = firstPage; page <= lastPage; ++page) {
+		if (on) {
+			pageAttr_[page % PAGE_COUNT] |= PA_WATCH;
+		} else {
+			pageAttr_[page % PAGE_COUNT] &= ~PA_WATCH;
+		}
+	}
+}
+
+void Memory::CheckWatch(unsigned linear)
+{
+	for (const WatchRange& watch : watches_) {
+		if (((linear - watch.linear) & (MEMORY_SIZE - 1)) < watch.size) {
+			if (watchHandler_) {
+				watchHandler_(linear);
+			}
+			return;
+		}
+	}
+}
+
+void Memory::MarkDirty(unsigned page)
+{
+	if (pageAttr_[page] & PA_CLEAN) {
+		pageAttr_[page] &= ~PA_CLEAN;
+		dirtyPages_.push_back(page);
+	}
+}
+
+vector<pair<unsigned, unsigned>> Memory::DirtyRanges() const
+{
+	vector<unsigned> pages(dirtyPages_);
+	sort(pages.begin(), pages.end());
+	vector<pair<unsigned, unsigned>> ranges;
+	for (unsigned page : pages) {
+		unsigned linear = page << PAGE_SHIFT;
+		if (!ranges.empty() && ranges.back().first + ranges.back().second == linear) {
+			ranges.back().second += PAGE_SIZE;
+		} else {
+			ranges.push_back({linear, PAGE_SIZE});
+		}
+	}
+	return ranges;
+}
+
+void Memory::ClearDirty()
+{
+	for (unsigned page : dirtyPages_) {
+		pageAttr_[page] |= PA_CLEAN;
+	}
+	dirtyPages_.clear();
+}
+
+// Takes a copy of only the image pages written since the previous Capture
+// or Restore; all other pages are shared with it.
+Memory::Image Memory::Capture()
+{
+	for (unsigned imagePage : changedPages_) {
+		unsigned linear = imagePage << IMAGE_PAGE_SHIFT;
+		Touch(linear, IMAGE_PAGE_SIZE);
+		auto copy = make_shared<array<unsigned char, IMAGE_PAGE_SIZE>>();
+		memcpy(copy->data(), data_ + linear, IMAGE_PAGE_SIZE);
+		basePages_[imagePage] = move(copy);
+		for (unsigned i = 0; i < PAGES_PER_IMAGE_PAGE; ++i) {
+			pageAttr_[imagePage * PAGES_PER_IMAGE_PAGE + i] |= PA_SHARED;
+		}
+	}
+	changedPages_.clear();
+	return Image{basePages_};
+}
+
+// Copies back only the pages that differ from the image: those written since
+// the last Capture or Restore, and those the image holds a different copy of.
+void Memory::Restore(const Image& image)
+{
+	for (unsigned imagePage = 0; imagePage < IMAGE_PAGE_COUNT; ++imagePage) {
+		unsigned firstPage = imagePage * PAGES_PER_IMAGE_PAGE;
+		bool changed = !(pageAttr_[firstPage] & PA_SHARED);
+		if (!changed && basePages_[imagePage] == image.pages[imagePage]) {
+			continue;
+		}
+		for (unsigned i = 0; i < PAGES_PER_IMAGE_PAGE; ++i) {
+			if (pageAttr_[firstPage + i] & PA_CODE) {
+				pageAttr_[firstPage + i] &= ~PA_CODE;
+				if (codeWriteHandler_) {
+					codeWriteHandler_(firstPage + i);
+				}
+			}
+		}
+
+		unsigned char* p = data_ + (imagePage << IMAGE_PAGE_SHIFT);
+		const ImagePage& source = image.pages[imagePage];
+		unsigned char attr = PA_SHARED;
+		if (source) {
+			memcpy(p, source->data(), IMAGE_PAGE_SIZE);
+		} else if (fillMode_ == FillMode::ZERO) {
+			memset(p, 0, IMAGE_PAGE_SIZE);
+		} else {
+			attr |= PA_FRESH;  // the pattern is regenerated on the next touch
+		}
+		for (unsigned i = 0; i < PAGES_PER_IMAGE_PAGE; ++i) {
+			MarkDirty(firstPage + i);
+			pageAttr_[firstPage + i] = attr | (pageAttr_[firstPage + i] & PA_WATCH);
+		}
+		basePages_[imagePage] = source;
+	}
+	changedPages_.clear();
+}
+
+const unsigned char* Memory::GetCode(unsigned short seg, unsigned short offset, unsigned char* buf) const
+{
+	static const size_t MAX_INSTRUCTION = 16;
+	size_t linear = Linear(seg, offset);
+	if (offset <= 0x10000 - MAX_INSTRUCTION && linear + MAX_INSTRUCTION <= MEMORY_SIZE) {
+		Touch(linear, MAX_INSTRUCTION);
+		return &data_[linear];
+	}
+	Fetch(seg, offset, buf, MAX_INSTRUCTION);
+	return buf;
+}
+
+bool Processor::CF() const
+{
+	switch (lazyOp_) {
+	case FO_ADD: case FO_SUB: return (lazyResult_ >> (lazyWidth_ * 8)) & 1;
+	case FO_LOGIC: return false;
+	default: return (flags_ & Registers::FLAG_CF) != 0;
+	}
+}
+
+bool Processor::PF() const
+{
+	if (lazyOp_ == FO_NONE) {
+		return (flags_ & Registers::FLAG_PF) != 0;
+	}
+	return kParity.even[lazyResult_ & 0xFF];
+}
+
+bool Processor::AF() const
+{
+	switch (lazyOp_) {
+	case FO_NONE: return (flags_ & Registers::FLAG_AF) != 0;
+	case FO_LOGIC: return false;
+	default: return ((lazyDst_ ^ lazySrc_ ^ lazyResult_) & 0x10) != 0;
+	}
+}
+
+bool Processor::ZF() const
+{
+	if (lazyOp_ == FO_NONE) {
+		return (flags_ & Registers::FLAG_ZF) != 0;
+	}
+	return (lazyResult_ & WidthMask(lazyWidth_)) == 0;
+}
+
+bool Processor::SF() const
+{
+	if (lazyOp_ == FO_NONE) {
+		return (flags_ & Registers::FLAG_SF) != 0;
+	}
+	return (lazyResult_ & SignBit(lazyWidth_)) != 0;
+}
+
+bool Processor::OF() const
+{
+	unsigned sign = SignBit(lazyWidth_);
+	switch (lazyOp_) {
+	case FO_ADD: case FO_INC:
+		return ((lazyDst_ ^ lazyResult_) & (lazySrc_ ^ lazyResult_) & sign) != 0;
+	case FO_SUB: case FO_DEC:
+		return ((lazyDst_ ^ lazySrc_) & (lazyDst_ ^ lazyResult_) & sign) != 0;
+	case FO_LOGIC:
+		return false;
+	default:
+		return (flags_ & Registers::FLAG_OF) != 0;
+	}
+}
+
+unsigned Processor::GetFlags() const
+{
+	if (lazyOp_ == FO_NONE) {
+		return flags_;
+	}
+	// One pass over the lazy state rather than a call per flag: a trace
+	// being recorded asks for the flags after every instruction.
+	unsigned sign = SignBit(lazyWidth_);
+	bool carry = (lazyResult_ >> (lazyWidth_ * 8)) & 1;
+	bool addOverflow = ((lazyDst_ ^ lazyResult_) & (lazySrc_ ^ lazyResult_) & sign) != 0;
+	bool subOverflow = ((lazyDst_ ^ lazySrc_) & (lazyDst_ ^ lazyResult_) & sign) != 0;
+	bool cf = false;
+	bool af = ((lazyDst_ ^ lazySrc_ ^ lazyResult_) & 0x10) != 0;
+	bool of = false;
+	switch (lazyOp_) {
+	case FO_ADD: cf = carry; of = addOverflow; break;
+	case FO_INC: cf = (flags_ & Registers::FLAG_CF) != 0; of = addOverflow; break;
+	case FO_SUB: cf = carry; of = subOverflow; break;
+	case FO_DEC: cf = (flags_ & Registers::FLAG_CF) != 0; of = subOverflow; break;
+	default: af = false; break;  // FO_LOGIC
+	}
+	unsigned flags = flags_ & ~(Registers::FLAG_CF | Registers::FLAG_PF | Registers::FLAG_AF |
+			Registers::FLAG_ZF | Registers::FLAG_SF | Registers::FLAG_OF);
+	if (cf) flags |= Registers::FLAG_CF;
+	if (kParity.even[lazyResult_ & 0xFF]) flags |= Registers::FLAG_PF;
+	if (af) flags |= Registers::FLAG_AF;
+	if ((lazyResult_ & WidthMask(lazyWidth_)) == 0) flags |= Registers::FLAG_ZF;
+	if (lazyResult_ & sign) flags |= Registers::FLAG_SF;
+	if (of) flags |= Registers::FLAG_OF;
+	return flags;
+}
+
+void Processor::SetFlag(unsigned flag, bool on)
+{
+	unsigned flags = GetFlags();
+	SetFlags(on ? (flags | flag) : (flags & ~flag));
+}
+
+void Processor::SetResultFlags(unsigned value, unsigned width)
+{
+	unsigned flags = GetFlags() & ~(Registers::FLAG_PF | Registers::FLAG_ZF | Registers::FLAG_SF);
+	value &= WidthMask(width);
+	if (kParity.even[value & 0xFF]) flags |= Registers::FLAG_PF;
+	if (value == 0) flags |= Registers::FLAG_ZF;
+	if (value & SignBit(width)) flags |= Registers::FLAG_SF;
+	SetFlags(flags);
+}
+
+void Processor::SetLazy(FlagOp op, unsigned width, unsigned dst, unsigned src, unsigned result)
+{
+	if (op == FO_INC || op == FO_DEC) {
+		// INC and DEC leave CF alone, so park the current value in flags_.
+		flags_ = (flags_ & ~Registers::FLAG_CF) | (CF() ? Registers::FLAG_CF : 0);
+	}
+	lazyOp_ = op;
+	lazyWidth_ = static_cast<unsigned char>(width);
+	lazyDst_ = dst;
+	lazySrc_ = src;
+	lazyResult_ = result;
+}
+
+unsigned char Processor::GetReg8(unsigned n) const
+{
+	return registers_.GetByte(n);
+}
+
+void Processor::SetReg8(unsigned n, unsigned char value)
+{
+	int index = Registers::AX + (n & 3);
+	unsigned short old = Reg(index);
+	SetReg(index, n & 4 ? (old & 0x00FF) | (value << 8) : (old & 0xFF00) | value);
+}
+
+Processor::Location Processor::Locate(const Instruction& ins, const Operand& o) const
+{
+	Location loc{o.type, o.reg, 0, o.disp};
+	if (o.type != OT_MEM) {
+		return loc;
+	}
+	int seg = Registers::DS;
+	unsigned offset = o.disp;
+	switch (o.reg) {
+	case 0: offset += Reg(Registers::BX) + Reg(Registers::SI); break;
+	case 1: offset += Reg(Registers::BX) + Reg(Registers::DI); break;
+	case 2: offset += Reg(Registers::BP) + Reg(Registers::SI); seg = Registers::SS; break;
+	case 3: offset += Reg(Registers::BP) + Reg(Registers::DI); seg = Registers::SS; break;
+	case 4: offset += Reg(Registers::SI); break;
+	case 5: offset += Reg(Registers::DI); break;
+	case 6: offset += Reg(Registers::BP); seg = Registers::SS; break;
+	case 7: offset += Reg(Registers::BX); break;
+	default: break; // direct address
+	}
+	if (ins.segment != Instruction::NO_SEGMENT) {
+		seg = Registers::ES + ins.segment;
+	}
+	loc.seg = Reg(seg);
+	loc.offset = static_cast<unsigned short>(offset);
+	return loc;
+}
+
+unsigned Processor::Load(const Location& loc, unsigned width) const
+{
+	switch (loc.type) {
+	case OT_REG8:  return GetReg8(loc.reg);
+	case OT_REG16: return Reg(Registers::AX + loc.reg);
+	case OT_SREG:  return Reg(Registers::ES + loc.reg);
+	case OT_MEM:
+		return width == 1 ? memory_.ReadByte(loc.seg, loc.offset) : memory_.ReadWord(loc.seg, loc.offset);
+	default:
+		return loc.offset & WidthMask(width);
+	}
+}
+
+void Processor::Store(const Location& loc, unsigned width, unsigned value)
+{
+	switch (loc.type) {
+	case OT_REG8:  SetReg8(loc.reg, static_cast<unsigned char>(value)); break;
+	case OT_REG16: SetReg(Registers::AX + loc.reg, value); break;
+	case OT_SREG:  SetReg(Registers::ES + loc.reg, value); break;
+	case OT_MEM:
+		if (width == 1) {
+			memory_.WriteByte(loc.seg, loc.offset, static_cast<unsigned char>(value));
+		} else {
+			memory_.WriteWord(loc.seg, loc.offset, static_cast<unsigned short>(value));
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void Processor::Push(unsigned short value)
+{
+	unsigned short sp = static_cast<unsigned short>(Reg(Registers::SP) - 2);
+	SetReg(Registers::SP, sp);
+	memory_.WriteWord(Reg(Registers::SS), sp, value);
+}
+
+unsigned short Processor::Pop()
+{
+	unsigned short sp = Reg(Registers::SP);
+	unsigned short value = memory_.ReadWord(Reg(Registers::SS), sp);
+	SetReg(Registers::SP, sp + 2);
+	return value;
+}
+
+void Processor::FarJump(unsigned short seg, unsigned short offset)
+{
+	SetReg(Registers::CS, seg);
+	SetReg(Registers::IP, offset);
+}
+
+unsigned Processor::Alu(Mnemonic m, unsigned width, unsigned a, unsigned b)
+{
+	unsigned r;
+	switch (m) {
+	case Mnemonic::ADD: r = a + b; SetLazy(FO_ADD, width, a, b, r); break;
+	case Mnemonic::ADC: r = a + b + CF(); SetLazy(FO_ADD, width, a, b, r); break;
+	case Mnemonic::SUB:
+	case Mnemonic::CMP: r = a - b; SetLazy(FO_SUB, width, a, b, r); break;
+	case Mnemonic::SBB: r = a - b - CF(); SetLazy(FO_SUB, width, a, b, r); break;
+	case Mnemonic::OR:  r = a | b; SetLazy(FO_LOGIC, width, a, b, r); break;
+	case Mnemonic::XOR: r = a ^ b; SetLazy(FO_LOGIC, width, a, b, r); break;
+	default:            r = a & b; SetLazy(FO_LOGIC, width, a, b, r); break; // AND, TEST
+	}
+	return r & WidthMask(width);
+}
+
+unsigned Processor::Shift(Mnemonic m, unsigned width, unsigned value, unsigned count)
+{
+	count &= 0x1F; // 186 and later mask the count, and it keeps long shifts cheap
+	if (count == 0) {
+		return value;
+	}
+	unsigned bits = width * 8;
+	unsigned mask = WidthMask(width);
+	unsigned sign = SignBit(width);
+	bool cf = CF();
+	bool of = OF();
+	switch (m) {
+	case Mnemonic::ROL: {
+		unsigned c = count % bits;
+		value = ((value << c) | (value >> (bits - c))) & mask;
+		cf = value & 1;
+		of = ((value & sign) != 0) != cf;
+		break;
+	}
+	case Mnemonic::ROR: {
+		unsigned c = count % bits;
+		value = ((value >> c) | (value << (bits - c))) & mask;
+		cf = (value & sign) != 0;
+		of = ((value ^ (value << 1)) & sign) != 0;
+		break;
+	}
+	case Mnemonic::RCL:
+		for (unsigned i = 0; i < count; ++i) {
+			bool out = (value & sign) != 0;
+			value = ((value << 1) | cf) & mask;
+			cf = out;
+		}
+		of = ((value & sign) != 0) != cf;
+		break;
+	case Mnemonic::RCR:
+		for (unsigned i = 0; i < count; ++i) {
+			bool out = value & 1;
+			value = (value >> 1) | (cf ? sign : 0);
+			cf = out;
+		}
+		of = ((value ^ (value << 1)) & sign) != 0;
+		break;
+	case Mnemonic::SHL:
+		cf = count <= bits && ((value >> (bits - count)) & 1);
+		value = (value << count) & mask;
+		of = ((value & sign) != 0) != cf;
+		break;
+	case Mnemonic::SHR:
+		cf = count <= bits && ((value >> (count - 1)) & 1);
+		of = (value & sign) != 0;
+		value >>= count;
+		break;
+	default: { // SAR
+		int signedValue = (width == 1) ? static_cast<signed char>(value) : static_cast<short>(value);
+		unsigned c = count < bits ? count : bits;
+		cf = (signedValue >> (c - 1)) & 1;
+		value = static_cast<unsigned>(signedValue >> (c < bits ? c : bits - 1)) & mask;
+		of = false;
+		break;
+	}
+	}
+	if (m == Mnemonic::SHL || m == Mnemonic::SHR || m == Mnemonic::SAR) {
+		SetResultFlags(value, width);
+		SetFlag(Registers::FLAG_AF, false);
+	}
+	SetFlag(Registers::FLAG_CF, cf);
+	SetFlag(Registers::FLAG_OF, of);
+	return value;
+}
+
+bool Processor::MulDiv(Mnemonic m, unsigned width, unsigned value)
+{
+	bool overflow = false;
+	if (width == 1) {
+		unsigned short ax = Reg(Registers::AX);
+		switch (m) {
+		case Mnemonic::MUL: {
+			unsigned r = (ax & 0xFF) * value;
+			SetReg(Registers::AX, r);
+			overflow = (r & 0xFF00) != 0;
+			break;
+		}
+		case Mnemonic::IMUL: {
+			int r = static_cast<signed char>(ax) * static_cast<signed char>(value);
+			SetReg(Registers::AX, r);
+			overflow = (r != static_cast<signed char>(r));
+			break;
+		}
+		case Mnemonic::DIV: {
+			if (value == 0 || ax / value > 0xFF) {
+				return false;
+			}
+			SetReg(Registers::AX, ((ax % value) << 8) | (ax / value));
+			return true;
+		}
+		default: { // IDIV
+			int n = static_cast<short>(ax);
+			int d = static_cast<signed char>(value);
+			if (d == 0 || n / d > 127 || n / d < -127) {
+				return false;
+			}
+			SetReg(Registers::AX, ((n % d & 0xFF) << 8) | (n / d & 0xFF));
+			return true;
+		}
+		}
+	} else {
+		unsigned ax = Reg(Registers::AX);
+		unsigned dx = Reg(Registers::DX);
+		switch (m) {
+		case Mnemonic::MUL: {
+			unsigned r = ax * value;
+			SetReg(Registers::AX, r);
+			SetReg(Registers::DX, r >> 16);
+			overflow = (r >> 16) != 0;
+			break;
+		}
+		case Mnemonic::IMUL: {
+			int r = static_cast<short>(ax) * static_cast<short>(value);
+			SetReg(Registers::AX, r);
+			SetReg(Registers::DX, r >> 16);
+			overflow = (r != static_cast<short>(r));
+			break;
+		}
+		case Mnemonic::DIV: {
+			unsigned n = (dx << 16) | ax;
+			if (value == 0 || n / value > 0xFFFF) {
+				return false;
+			}
+			SetReg(Registers::AX, n / value);
+			SetReg(Registers::DX, n % value);
+			return true;
+		}
+		default: { // IDIV
+			long long n = static_cast<int>((dx << 16) | ax);
+			long long d = static_cast<short>(value);
+			if (d == 0 || n / d > 32767 || n / d < -32767) {
+				return false;
+			}
+			SetReg(Registers::AX, static_cast<unsigned>(n / d));
+			SetReg(Registers::DX, static_cast<unsigned>(n % d));
+			return true;
+		}
+		}
+	}
+	SetFlag(Registers::FLAG_CF, overflow);
+	SetFlag(Registers::FLAG_OF, overflow);
+	return true;
+}
+
+bool Processor::Condition(Mnemonic m) const
+{
+	switch (m) {
+	case Mnemonic::JO:  return OF();
+	case Mnemonic::JNO: return !OF();
+	case Mnemonic::JB:  return CF();
+	case Mnemonic::JNB: return !CF();
+	case Mnemonic::JZ:  return ZF();
+	case Mnemonic::JNZ: return !ZF();
+	case Mnemonic::JBE: return CF() || ZF();
+	case Mnemonic::JA:  return !CF() && !ZF();
+	case Mnemonic::JS:  return SF();
+	case Mnemonic::JNS: return !SF();
+	case Mnemonic::JPE: return PF();
+	case Mnemonic::JPO: return !PF();
+	case Mnemonic::JL:  return SF() != OF();
+	case Mnemonic::JGE: return SF() == OF();
+	case Mnemonic::JLE: return ZF() || SF() != OF();
+	default:            return !ZF() && SF() == OF(); // JG
+	}
+}
+
+bool Breakpoints::Condition::Holds(const Registers& registers) const
+{
+	if (op == NONE) {
+		return true;
+	}
+	unsigned short current = registers.GetAny(reg);
+	switch (op) {
+	case EQ: return current == value;
+	case NE: return current != value;
+	case LT: return current < value;
+	case LE: return current <= value;
+	case GT: return current > value;
+	default: return current >= value;  // GE
+	}
+}
+
+void Breakpoints::Set(unsigned linear)
+{
+	Set(linear, Condition());
+}
+
+void Breakpoints::Set(unsigned linear, const Condition& condition)
+{
+	if (bits_.empty()) {
+		bits_.resize(Memory::MEMORY_SIZE / 64);
+	}
+	linear &= Memory::MEMORY_SIZE - 1;
+	bits_[linear >> 6] |= 1ULL << (linear & 63);
+	conditions_[linear] = condition;
+}
+
+bool Breakpoints::Clear(unsigned linear)
+{
+	linear &= Memory::MEMORY_SIZE - 1;
+	if (conditions_.erase(linear) == 0) {
+		return false;
+	}
+	bits_[linear >> 6] &= ~(1ULL << (linear & 63));
+	return true;
+}
+
+void Breakpoints::ClearAll()
+{
+	conditions_.clear();
+	fill(bits_.begin(), bits_.end(), 0);
+}
+
+bool Breakpoints::AnyIn(unsigned linear, unsigned size) const
+{
+	if (bits_.empty() || size == 0) {
+		return false;
+	}
+	unsigned first = linear;
+	unsigned last = linear + size - 1;
+	for (unsigned word = first >> 6; word <= last >> 6; ++word) {
+		unsigned long long bits = bits_[word % bits_.size()];
+		if (word == first >> 6) {
+			bits &= ~0ULL << (first & 63);
+		}
+		if (word == last >> 6) {
+			bits &= ~0ULL >> (63 - (last & 63));
+		}
+		if (bits != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Breakpoints::Stops(unsigned linear, const Registers& registers) const
+{
+	auto it = conditions_.find(linear);
+	return it != conditions_.end() && it->second.Holds(registers);
+}
+
+namespace {
+
+const char kTraceMagic[8] = { 'X', '8', '6', 'T', 'R', 'A', 'C', 'E' };
+const unsigned kTraceVersion = 1;
+enum { TRACE_KEYFRAME = 1, TRACE_END = 3 };
+
+// Registers in the order of the mask bits of a step record. IP changes with
+// every instruction and takes the lowest bit, so most tags fit one byte.
+const unsigned char kTraceRegs[Registers::MAX_REG_INDEX] = {
+	Registers::IP, Registers::FLAGS,
+	Registers::AX, Registers::CX, Registers::DX, Registers::BX,
+	Registers::SP, Registers::BP, Registers::SI, Registers::DI,
+	Registers::ES, Registers::CS, Registers::SS, Registers::DS
+};
+
+unsigned char* PutVarint(unsigned char* p, unsigned long long value)
+{
+	while (value >= 0x80) {
+		*p++ = static_cast<unsigned char>(value | 0x80);
+		value >>= 7;
+	}
+	*p++ = static_cast<unsigned char>(value);
+	return p;
+}
+
+unsigned ZigZag(int value)
+{
+	return (static_cast<unsigned>(value) << 1) ^ static_cast<unsigned>(value >> 31);
+}
+
+int UnZigZag(unsigned long long value)
+{
+	return static_cast<int>(value >> 1) ^ -static_cast<int>(value & 1);
+}
+
+bool WriteAll(int fd, const unsigned char* buf, size_t size)
+{
+	while (size > 0) {
+		ssize_t n = write(fd, buf, size);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf += n;
+		size -= n;
+	}
+	return true;
+}
+
+// Reads trace records, clearing ok instead of running past the end.
+struct TraceCursor
+{
+	const unsigned char* p;
+	const unsigned char* end;
+	bool ok;
+
+	unsigned long long Varint()
+	{
+		unsigned long long value = 0;
+		for (unsigned shift = 0; shift < 64 && p != end; shift += 7) {
+			unsigned char b = *p++;
+			value |= static_cast<unsigned long long>(b & 0x7F) << shift;
+			if (!(b & 0x80)) {
+				return value;
+			}
+		}
+		ok = false;
+		return 0;
+	}
+	const unsigned char* Bytes(size_t size)
+	{
+		if (static_cast<size_t>(end - p) < size) {
+			ok = false;
+			p = end;
+			return nullptr;
+		}
+		p += size;
+		return p - size;
+	}
+};
+
+// Reads the rest of a keyframe record into regs and image; image may be
+// null to skip the pages. Returns the step the keyframe was taken at.
+unsigned long long ReadKeyframe(TraceCursor& in, unsigned short* regs, unsigned char* image)
+{
+	unsigned long long step = in.Varint();
+	const unsigned char* words = in.Bytes(Registers::MAX_REG_INDEX * 2);
+	if (words) {
+		for (unsigned r = 0; r < Registers::MAX_REG_INDEX; ++r) {
+			regs[r] = static_cast<unsigned short>(words[r * 2] | words[r * 2 + 1] << 8);
+		}
+	}
+	unsigned long long count = in.Varint();
+	unsigned long long page = 0;
+	for (unsigned long long i = 0; i < count && in.ok; ++i) {
+		page += in.Varint();
+		const unsigned char* bytes = in.Bytes(Memory::PAGE_SIZE);
+		if (page >= Memory::PAGE_COUNT) {
+			in.ok = false;
+		} else if (bytes && image) {
+			memcpy(image + (page << Memory::PAGE_SHIFT), bytes, Memory::PAGE_SIZE);
+		}
+	}
+	return step;
+}
+
+// Applies the rest of a step record with the given tag; image may be null.
+void ReadStep(TraceCursor& in, unsigned long long tag, unsigned short* regs,
+		unsigned char* image, unsigned& lastWrite)
+{
+	unsigned long long mask = tag >> 2;
+	for (unsigned i = 0; i < Registers::MAX_REG_INDEX; ++i) {
+		if (mask & (1u << i)) {
+			unsigned short& reg = regs[kTraceRegs[i]];
+			reg = static_cast<unsigned short>(reg + UnZigZag(in.Varint()));
+		}
+	}
+	if (tag & 2) {
+		unsigned long long count = in.Varint();
+		for (unsigned long long i = 0; i < count && in.ok; ++i) {
+			lastWrite = (lastWrite + UnZigZag(in.Varint())) & (Memory::MEMORY_SIZE - 1);
+			const unsigned char* value = in.Bytes(1);
+			if (value && image) {
+				image[lastWrite] = *value;
+			}
+		}
+	}
+}
+
+} // namespace
+
+TraceRecorder::~TraceRecorder()
+{
+	Close();
+}
+
+bool TraceRecorder::Open(const string& filename)
+{
+	fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd_ < 0) {
+		return false;
+	}
+	chunk_.resize(CHUNK_SIZE);
+	unsigned char* p = Room(sizeof(kTraceMagic) + 10);
+	memcpy(p, kTraceMagic, sizeof(kTraceMagic));
+	used_ = PutVarint(p + sizeof(kTraceMagic), kTraceVersion) - chunk_.data();
+	writer_ = thread(&TraceRecorder::WriterLoop, this);
+	return true;
+}
+
+// Ends the trace and waits for the writer thread; false if any write failed.
+bool TraceRecorder::Close()
+{
+	if (fd_ < 0) {
+		return true;
+	}
+	unsigned char* p = PutVarint(Room(20), TRACE_END);
+	used_ = PutVarint(p, step_) - chunk_.data();
+	Submit();
+	{
+		lock_guard<mutex> lock(lock_);
+		closing_ = true;
+	}
+	queued_.notify_one();
+	writer_.join();
+	bool ok = !failed_;
+	if (close(fd_) != 0) {
+		ok = false;
+	}
+	fd_ = -1;
+	return ok;
+}
+
+void TraceRecorder::Sync(const Registers& registers, unsigned flags, const Memory& memory)
+{
+	Keyframe(registers, flags, memory, false);
+}
+
+void TraceRecorder::Step(const Registers& registers, unsigned written, unsigned flags,
+		const Memory& memory, vector<unsigned>& writes)
+{
+	// Deltas are gathered in the order of the mask bits: IP, FLAGS, then
+	// the others by index.
+	unsigned deltas[Registers::MAX_REG_INDEX];
+	unsigned count = 0;
+	unsigned mask = 0;
+	unsigned short ip = registers.Get(Registers::IP);
+	if (ip != regs_[Registers::IP]) {
+		mask |= 1;
+		deltas[count++] = ZigZag(static_cast<short>(ip - regs_[Registers::IP]));
+		regs_[Registers::IP] = ip;
+	}
+	if (static_cast<unsigned short>(flags) != regs_[Registers::FLAGS]) {
+		mask |= 2;
+		deltas[count++] = ZigZag(static_cast<short>(flags - regs_[Registers::FLAGS]));
+		regs_[Registers::FLAGS] = static_cast<unsigned short>(flags);
+	}
+	written &= ~(1u << Registers::IP | 1u << Registers::FLAGS);
+	for (; written != 0; written &= written - 1) {
+		unsigned r = __builtin_ctz(written);
+		unsigned short value = registers.Get(r);
+		if (value != regs_[r]) {
+			mask |= 1u << (r + 1);
+			deltas[count++] = ZigZag(static_cast<short>(value - regs_[r]));
+			regs_[r] = value;
+		}
+	}
+
+	unsigned char* p = Room(3 + Registers::MAX_REG_INDEX * 3 + 10);
+	p = PutVarint(p, mask << 2 | (writes.empty() ? 0 : 2));
+	for (unsigned i = 0; i < count; ++i) {
+		p = PutVarint(p, deltas[i]);
+	}
+	if (!writes.empty()) {
+		p = PutVarint(p, writes.size());
+	}
+	used_ = p - chunk_.data();
+
+	// The bytes are taken after the instruction, so a location written
+	// twice shows its final value both times.
+	for (unsigned linear : writes) {
+		unsigned char value = memory.ReadLinear(linear);
+		p = PutVarint(Room(4), ZigZag(static_cast<int>(linear - lastWrite_)));
+		*p++ = value;
+		used_ = p - chunk_.data();
+		lastWrite_ = linear;
+		shadow_[linear] = value;
+		touched_[linear >> Memory::PAGE_SHIFT] = true;
+	}
+	writes.clear();
+
+	++step_;
+	if (++sinceKeyframe_ >= KEYFRAME_INTERVAL) {
+		Keyframe(registers, flags, memory, true);
+	}
+}
+
+// Emits the registers and the pages that differ from the previous keyframe,
+// either because instructions wrote them or because they were changed
+// from outside between runs.
+void TraceRecorder::Keyframe(const Registers& registers, unsigned flags, const Memory& memory, bool always)
+{
+	unsigned short regs[Registers::MAX_REG_INDEX];
+	for (unsigned r = 0; r < Registers::MAX_REG_INDEX; ++r) {
+		regs[r] = registers.Get(r);
+	}
+	regs[Registers::FLAGS] = static_cast<unsigned short>(flags);
+	bool first = shadow_.empty();
+	if (first) {
+		shadow_.resize(Memory::MEMORY_SIZE);
+	}
+	vector<unsigned> pages;
+	unsigned char buf[Memory::PAGE_SIZE];
+	for (unsigned page = 0; page < Memory::PAGE_COUNT; ++page) {
+		unsigned char* old = shadow_.data() + (page << Memory::PAGE_SHIFT);
+		memory.CopyOut(page << Memory::PAGE_SHIFT, buf, sizeof(buf));
+		if (first || touched_[page] || memcmp(buf, old, sizeof(buf)) != 0) {
+			memcpy(old, buf, sizeof(buf));
+			pages.push_back(page);
+		}
+	}
+	if (!always && pages.empty() && equal(regs, regs + Registers::MAX_REG_INDEX, regs_)) {
+		return;
+	}
+
+	unsigned char* p = Room(10 + 10 + sizeof(regs) + 10);
+	p = PutVarint(p, TRACE_KEYFRAME);
+	p = PutVarint(p, step_);
+	for (unsigned r = 0; r < Registers::MAX_REG_INDEX; ++r) {
+		*p++ = static_cast<unsigned char>(regs[r]);
+		*p++ = static_cast<unsigned char>(regs[r] >> 8);
+	}
+	used_ = PutVarint(p, pages.size()) - chunk_.data();
+	unsigned last = 0;
+	for (unsigned page : pages) {
+		p = PutVarint(Room(3 + Memory::PAGE_SIZE), page - last);
+		memcpy(p, shadow_.data() + (page << Memory::PAGE_SHIFT), Memory::PAGE_SIZE);
+		used_ = p + Memory::PAGE_SIZE - chunk_.data();
+		last = page;
+	}
+
+	copy(regs, regs + Registers::MAX_REG_INDEX, regs_);
+	touched_.reset();
+	lastWrite_ = 0;
+	sinceKeyframe_ = 0;
+}
+
+// Returns room for size more bytes, handing the chunk to the writer first
+// when it is full.
+unsigned char* TraceRecorder::Room(size_t size)
+{
+	if (used_ + size > chunk_.size()) {
+		Submit();
+	}
+	return chunk_.data() + used_;
+}
+
+void TraceRecorder::Submit()
+{
+	chunk_.resize(used_);
+	unique_lock<mutex> lock(lock_);
+	drained_.wait(lock, [this] { return queue_.size() < MAX_QUEUED; });
+	queue_.push_back(move(chunk_));
+	chunk_.clear();
+	if (!spare_.empty()) {
+		chunk_ = move(spare_.back());
+		spare_.pop_back();
+	}
+	lock.unlock();
+	queued_.notify_one();
+	chunk_.resize(CHUNK_SIZE);
+	used_ = 0;
+}
+
+void TraceRecorder::WriterLoop()
+{
+	unique_lock<mutex> lock(lock_);
+	for (;;) {
+		queued_.wait(lock, [this] { return !queue_.empty() || closing_; });
+		if (queue_.empty()) {
+			return;
+		}
+		vector<unsigned char> chunk = move(queue_.front());
+		queue_.pop_front();
+		drained_.notify_one();
+		lock.unlock();
+		bool ok = WriteAll(fd_, chunk.data(), chunk.size());
+		lock.lock();
+		failed_ = failed_ || !ok;
+		spare_.push_back(move(chunk));
+	}
+}
+
+// Indexes the keyframes. A trace that was cut short is usable up to its
+// last complete record.
+bool TraceReader::Open(const string& filename)
+{
+	data_.clear();
+	keyframes_.clear();
+	steps_ = 0;
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	for (;;) {
+		unsigned char buf[0x10000];
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n <= 0) {
+			break;
+		}
+		data_.insert(data_.end(), buf, buf + n);
+	}
+	close(fd);
+	if (data_.size() < sizeof(kTraceMagic) || memcmp(data_.data(), kTraceMagic, sizeof(kTraceMagic)) != 0) {
+		return false;
+	}
+
+	TraceCursor in = { data_.data() + sizeof(kTraceMagic), data_.data() + data_.size(), true };
+	if (in.Varint() != kTraceVersion || !in.ok) {
+		return false;
+	}
+	unsigned short regs[Registers::MAX_REG_INDEX];
+	unsigned lastWrite = 0;
+	unsigned long long step = 0;
+	while (in.p != in.end) {
+		size_t offset = in.p - data_.data();
+		unsigned long long tag = in.Varint();
+		if (tag == TRACE_END) {
+			break;
+		} else if (tag == TRACE_KEYFRAME) {
+			if (ReadKeyframe(in, regs, nullptr) != step || !in.ok) {
+				break;
+			}
+			keyframes_.push_back({step, offset});
+		} else if (tag & 1 || keyframes_.empty()) {
+			break;
+		} else {
+			ReadStep(in, tag, regs, nullptr, lastWrite);
+			if (!in.ok) {
+				break;
+			}
+			++step;
+		}
+	}
+	steps_ = step;
+	return true;
+}
+
+bool TraceReader::Seek(unsigned long long step, Registers& registers, Memory& memory) const
+{
+	if (keyframes_.empty() || step > steps_) {
+		return false;
+	}
+	auto last = upper_bound(keyframes_.begin(), keyframes_.end(), step,
+			[](unsigned long long s, const Keyframe& k) { return s < k.step; }) - 1;
+
+	vector<unsigned char> image(Memory::MEMORY_SIZE);
+	unsigned short regs[Registers::MAX_REG_INDEX];
+	TraceCursor in = { nullptr, data_.data() + data_.size(), true };
+	for (auto k = keyframes_.begin(); k <= last; ++k) {
+		in.p = data_.data() + k->offset;
+		in.Varint();
+		ReadKeyframe(in, regs, image.data());
+	}
+	unsigned lastWrite = 0;
+	for (unsigned long long at = last->step; at < step && in.ok; ++at) {
+		ReadStep(in, in.Varint(), regs, image.data(), lastWrite);
+	}
+	if (!in.ok) {
+		return false;
+	}
+
+	memory.CopyIn(0, image.data(), image.size());
+	for (unsigned r = 0; r < Registers::MAX_REG_INDEX; ++r) {
+		registers.Set(r, regs[r]);
+	}
+	return true;
+}
+
+Processor::Processor()
+{
+	pageBlocks_.resize(Memory::PAGE_COUNT);
+	memory_.SetCodeWriteHandler([this](unsigned page) { InvalidateCodePage(page); });
+	memory_.SetWatchHandler([this](unsigned linear) {
+		watchHit_ = true;
+		watchAddress_ = linear;
+		leaveBlock_ = true;
+	});
+}
+
+Processor::State Processor::Snapshot()
+{
+	return State{registers_, memory_.Capture(), hooked_, exitCode_};
+}
+
+void Processor::Restore(const State& state)
+{
+	registers_ = state.registers;
+	memory_.Restore(state.memory);
+	hooked_ = state.hooked;
+	exitCode_ = state.exitCode;
+}
+
+bool Processor::StartTrace(const string& filename)
+{
+	auto trace = make_unique<TraceRecorder>();
+	if (!trace->Open(filename)) {
+		return false;
+	}
+	StopTrace();
+	trace_ = move(trace);
+	return true;
+}
+
+bool Processor::StopTrace()
+{
+	bool ok = !trace_ || trace_->Close();
+	trace_.reset();
+	return ok;
+}
+
+void Processor::SetProfiling(bool on)
+{
+	if (on && profileCounts_.empty()) {
+		profileCounts_.resize(Memory::MEMORY_SIZE);
+	}
+	profile_ = on ? profileCounts_.data() : nullptr;
+}
+
+void Processor::ClearProfile()
+{
+	fill(profileCounts_.begin(), profileCounts_.end(), 0);
+}
+
+bool Processor::EndsBlock(const Instruction& ins)
+{
+	switch (ins.mnemonic) {
+	case Mnemonic::JO: case Mnemonic::JNO: case Mnemonic::JB: case Mnemonic::JNB:
+	case Mnemonic::JZ: case Mnemonic::JNZ: case Mnemonic::JBE: case Mnemonic::JA:
+	case Mnemonic::JS: case Mnemonic::JNS: case Mnemonic::JPE: case Mnemonic::JPO:
+	case Mnemonic::JL: case Mnemonic::JGE: case Mnemonic::JLE: case Mnemonic::JG:
+	case Mnemonic::LOOP: case Mnemonic::LOOPZ: case Mnemonic::LOOPNZ: case Mnemonic::JCXZ:
+	case Mnemonic::JMP: case Mnemonic::JMPF: case Mnemonic::CALL: case Mnemonic::CALLF:
+	case Mnemonic::RET: case Mnemonic::RETF: case Mnemonic::IRET:
+	case Mnemonic::INT: case Mnemonic::INTO: case Mnemonic::BOUND:
+	case Mnemonic::HLT: case Mnemonic::DB:
+		return true;
+	case Mnemonic::MOV: case Mnemonic::POP:
+		return ins.operands[0].type == OT_SREG && ins.operands[0].reg == 1; // CS changes
+	default:
+		return false;
+	}
+}
+
+bool Processor::IsFault(StopReason reason)
+{
+	// Faulting instructions leave CS:IP pointing at themselves.
+	return reason == StopReason::DIVIDE_ERROR || reason == StopReason::INVALID_OPCODE ||
+		reason == StopReason::INTERRUPT;
+}
+
+Processor::Block* Processor::FindBlock(unsigned short cs, unsigned short ip)
+{
+	unsigned linear = Memory::Linear(cs, ip);
+	Block*& slot = blockLookup_[linear % BLOCK_LOOKUP_SIZE];
+	if (!slot || slot->linear != linear) {
+		auto it = blocks_.find(linear);
+		slot = (it != blocks_.end()) ? it->second.get() : Translate(cs, ip, linear);
+	}
+	if (slot && ip + slot->bytes > 0x10000) {
+		return nullptr; // entered through a segment where IP would wrap inside the block
+	}
+	return slot;
+}
+
+Processor::Block* Processor::Translate(unsigned short cs, unsigned short ip, unsigned linear)
+{
+	static const unsigned MAX_INSTRUCTION = 16;
+
+	auto block = make_unique<Block>();
+	block->linear = linear;
+	block->bytes = 0;
+	while (block->ops.size() < MAX_BLOCK_OPS) {
+		if (ip + block->bytes + MAX_INSTRUCTION > 0x10000 ||
+				linear + block->bytes + MAX_INSTRUCTION > (1 << 20)) {
+			break;
+		}
+		unsigned char buf[MAX_INSTRUCTION];
+		CachedOp op;
+		Memory::ParseOneInstrument(memory_.GetCode(cs, static_cast<unsigned short>(ip + block->bytes), buf),
+				MAX_INSTRUCTION, op.ins);
+		op.handler = HandlerFor(op.ins.mnemonic);
+		block->ops.push_back(op);
+		block->bytes += op.ins.length;
+		if (EndsBlock(op.ins)) {
+			break;
+		}
+	}
+	if (block->ops.empty()) {
+		return nullptr;
+	}
+
+	unsigned firstPage = linear >> Memory::PAGE_SHIFT;
+	unsigned lastPage = (linear + block->bytes - 1) >> Memory::PAGE_SHIFT;
+	memory_.MarkCode(firstPage, lastPage);
+	for (unsigned page = firstPage; page <= lastPage; ++page) {
+		pageBlocks_[page].push_back(linear);
+	}
+	Block* result = block.get();
+	blocks_[linear] = move(block);
+	return result;
+}
+
+void Processor::InvalidateCodePage(unsigned page)
+{
+	for (unsigned linear : pageBlocks_[page]) {
+		auto it = blocks_.find(linear);
+		if (it == blocks_.end()) {
+			continue;
+		}
+		Block*& slot = blockLookup_[linear % BLOCK_LOOKUP_SIZE];
+		if (slot == it->second.get()) {
+			slot = nullptr;
+		}
+		retired_.push_back(move(it->second));
+		blocks_.erase(it);
+	}
+	pageBlocks_[page].clear();
+	leaveBlock_ = true;
+}
+
+void Processor::FlushBlocks()
+{
+	for (unsigned page = 0; page < Memory::PAGE_COUNT; ++page) {
+		if (!pageBlocks_[page].empty()) {
+			InvalidateCodePage(page);
+			memory_.UnmarkCode(page, page);
+		}
+	}
+	retired_.clear();
+}
+
+StopReason Processor::Run(unsigned long long count, const Breakpoints& breakpoints)
+{
+	static const unsigned long long BREAK_CHECK_INTERVAL = 0x10000;
+
+	SetFlags(registers_.Get(Registers::FLAGS));
+	if (trace_) {
+		trace_->Sync(registers_, GetFlags(), memory_);
+		memory_.SetWriteLog(&traceWrites_);
+		writtenRegs_ = 0;
+	}
+	breakRequested_ = 0;
+	watchHit_ = false;
+	StopReason reason = StopReason::NONE;
+	unsigned long long executed = 0;
+	unsigned long long nextBreakCheck = BREAK_CHECK_INTERVAL;
+	while (reason == StopReason::NONE) {
+		if (watchHit_) {
+			reason = StopReason::WATCHPOINT;
+			break;
+		}
+		if (executed >= count) {
+			reason = StopReason::COUNT;
+			break;
+		}
+		if (executed >= nextBreakCheck) {
+			nextBreakCheck = executed + BREAK_CHECK_INTERVAL;
+			if (breakRequested_) {
+				reason = StopReason::USER_BREAK;
+				break;
+			}
+		}
+		retired_.clear();
+		if (blocks_.size() > MAX_BLOCKS) {
+			FlushBlocks();
+		}
+		leaveBlock_ = false;
+
+		unsigned short ip = Reg(Registers::IP);
+		Block* block = FindBlock(Reg(Registers::CS), ip);
+		if (!block) {
+			unsigned linear = Memory::Linear(Reg(Registers::CS), ip);
+			if (executed > 0 && !breakpoints.IsEmpty() && breakpoints.Hit(linear, registers_)) {
+				reason = StopReason::BREAKPOINT;
+				break;
+			}
+			if (profile_) {
+				++profile_[linear];
+			}
+			reason = Step();
+			++executed;
+			if (trace_) {
+				trace_->Step(registers_, writtenRegs_, GetFlags(), memory_, traceWrites_);
+				writtenRegs_ = 0;
+			}
+			continue;
+		}
+
+		if (trace_ || profile_) {
+			reason = RunBlockInstrumented(*block, ip, executed, count, breakpoints);
+		} else {
+			reason = RunBlock(*block, ip, executed, count, breakpoints);
+		}
+	}
+	memory_.SetWriteLog(nullptr);
+	registers_.Set(Registers::FLAGS, static_cast<unsigned short>(GetFlags()));
+	executed_ = executed;
+	return reason;
+}
+
+#ifndef X86_DEBUG_THREADED_DISPATCH
+
+StopReason Processor::RunBlock(const Block& block, unsigned short ip, unsigned long long& executed,
+		unsigned long long count, const Breakpoints& breakpoints)
+{
+	bool checkBreakpoints = !breakpoints.IsEmpty() && breakpoints.AnyIn(block.linear, block.bytes);
+	unsigned linear = block.linear;
+	for (const CachedOp& op : block.ops) {
+		if (checkBreakpoints && executed > 0 && breakpoints.Hit(linear, registers_)) {
+			return StopReason::BREAKPOINT;
+		}
+		SetReg(Registers::IP, ip + op.ins.length);
+		StopReason reason = Dispatch(op.handler, op.ins, ip);
+		++executed;
+		if (reason != StopReason::NONE) {
+			if (IsFault(reason)) {
+				SetReg(Registers::IP, ip);
+			}
+			return reason;
+		}
+		if (leaveBlock_ || executed >= count) {
+			break;
+		}
+		ip = static_cast<unsigned short>(ip + op.ins.length);
+		linear += op.ins.length;
+	}
+	return StopReason::NONE;
+}
+
+#else
+
+// Threaded backend: every handler ends with its own indirect jump to the
+// next one (GCC labels-as-values), which gives the branch predictor one
+// history slot per handler instead of a single shared switch jump.
+StopReason Processor::RunBlock(const Block& block, unsigned short ip, unsigned long long& executed,
+		unsigned long long count, const Breakpoints& breakpoints)
+{
+	static void* const dispatch[HK_COUNT] = {
+		&&alu, &&muldiv, &&shift, &&decimal, &&stack, &&move,
+		&&jcc, &&branch, &&string, &&system
+	};
+
+	bool checkBreakpoints = !breakpoints.IsEmpty() && breakpoints.AnyIn(block.linear, block.bytes);
+	unsigned linear = block.linear;
+	const CachedOp* op = block.ops.data();
+	const CachedOp* end = op + block.ops.size();
+	StopReason reason;
+
+#define DISPATCH() \
+	do { \
+		if (op == end) \
+			return StopReason::NONE; \
+		if (checkBreakpoints && executed > 0 && breakpoints.Hit(linear, registers_)) \
+			return StopReason::BREAKPOINT; \
+		SetReg(Registers::IP, ip + op->ins.length); \
+		goto *dispatch[op->handler]; \
+	} while (0)
+#define NEXT() \
+	do { \
+		++executed; \
+		if (reason != StopReason::NONE) \
+			goto stop; \
+		if (leaveBlock_ || executed >= count) \
+			return StopReason::NONE; \
+		ip = static_cast<unsigned short>(ip + op->ins.length); \
+		linear += op->ins.length; \
+		++op; \
+		DISPATCH(); \
+	} while (0)
+
+	DISPATCH();
+alu:
+	reason = ExecAlu(op->ins, ip);
+	NEXT();
+muldiv:
+	reason = ExecMulDiv(op->ins, ip);
+	NEXT();
+shift:
+	reason = ExecShift(op->ins, ip);
+	NEXT();
+decimal:
+	reason = ExecDecimal(op->ins, ip);
+	NEXT();
+stack:
+	reason = ExecStack(op->ins, ip);
+	NEXT();
+move:
+	reason = ExecMove(op->ins, ip);
+	NEXT();
+jcc:
+	reason = ExecJcc(op->ins, ip);
+	NEXT();
+branch:
+	reason = ExecBranch(op->ins, ip);
+	NEXT();
+string:
+	reason = ExecString(op->ins, ip);
+	NEXT();
+system:
+	reason = ExecSystem(op->ins, ip);
+	NEXT();
+
+#undef NEXT
+#undef DISPATCH
+
+stop:
+	if (IsFault(reason)) {
+		SetReg(Registers::IP, ip);
+	}
+	return reason;
+}
+
+#endif
+
+// RunBlock with every instruction going to the trace and the profile
+// counters; kept apart so that plain runs pay nothing for either.
+StopReason Processor::RunBlockInstrumented(const Block& block, unsigned short ip, unsigned long long& executed,
+		unsigned long long count, const Breakpoints& breakpoints)
+{
+	bool checkBreakpoints = !breakpoints.IsEmpty() && breakpoints.AnyIn(block.linear, block.bytes);
+	unsigned linear = block.linear;
+	for (const CachedOp& op : block.ops) {
+		if (checkBreakpoints && executed > 0 && breakpoints.Hit(linear, registers_)) {
+			return StopReason::BREAKPOINT;
+		}
+		if (profile_) {
+			++profile_[linear & (Memory::MEMORY_SIZE - 1)];
+		}
+		SetReg(Registers::IP, ip + op.ins.length);
+		StopReason reason = Dispatch(op.handler, op.ins, ip);
+		if (IsFault(reason)) {
+			SetReg(Registers::IP, ip);
+		}
+		++executed;
+		if (trace_) {
+			trace_->Step(registers_, writtenRegs_, GetFlags(), memory_, traceWrites_);
+			writtenRegs_ = 0;
+		}
+		if (reason != StopReason::NONE) {
+			return reason;
+		}
+		if (leaveBlock_ || executed >= count) {
+			break;
+		}
+		ip = static_cast<unsigned short>(ip + op.ins.length);
+		linear += op.ins.length;
+	}
+	return StopReason::NONE;
+}
+
+StopReason Processor::Step()
+{
+	unsigned short cs = Reg(Registers::CS);
+	unsigned short ip = Reg(Registers::IP);
+	unsigned char buf[16];
+	Instruction ins;
+	Memory::ParseOneInstrument(memory_.GetCode(cs, ip, buf), sizeof(buf), ins);
+	SetReg(Registers::IP, ip + ins.length);
+	StopReason reason = Execute(ins, ip);
+	if (IsFault(reason)) {
+		SetReg(Registers::IP, ip);
+	}
+	return reason;
+}
+
+Processor::HandlerKind Processor::HandlerFor(Mnemonic m)
+{
+	switch (m) {
+	case Mnemonic::ADD: case Mnemonic::OR: case Mnemonic::ADC: case Mnemonic::SBB:
+	case Mnemonic::AND: case Mnemonic::SUB: case Mnemonic::XOR: case Mnemonic::CMP:
+	case Mnemonic::TEST: case Mnemonic::INC: case Mnemonic::DEC:
+	case Mnemonic::NOT: case Mnemonic::NEG:
+		return HK_ALU;
+	case Mnemonic::MUL: case Mnemonic::IMUL: case Mnemonic::DIV: case Mnemonic::IDIV:
+	case Mnemonic::AAM: case Mnemonic::AAD:
+		return HK_MULDIV;
+	case Mnemonic::ROL: case Mnemonic::ROR: case Mnemonic::RCL: case Mnemonic::RCR:
+	case Mnemonic::SHL: case Mnemonic::SHR: case Mnemonic::SAR:
+		return HK_SHIFT;
+	case Mnemonic::DAA: case Mnemonic::DAS: case Mnemonic::AAA: case Mnemonic::AAS:
+		return HK_DECIMAL;
+	case Mnemonic::PUSH: case Mnemonic::POP: case Mnemonic::PUSHA: case Mnemonic::POPA:
+	case Mnemonic::PUSHF: case Mnemonic::POPF: case Mnemonic::ENTER: case Mnemonic::LEAVE:
+		return HK_STACK;
+	case Mnemonic::MOV: case Mnemonic::XCHG: case Mnemonic::LEA: case Mnemonic::LES:
+	case Mnemonic::LDS: case Mnemonic::XLAT: case Mnemonic::CBW: case Mnemonic::CWD:
+	case Mnemonic::SAHF: case Mnemonic::LAHF:
+		return HK_MOVE;
+	case Mnemonic::JO: case Mnemonic::JNO: case Mnemonic::JB: case Mnemonic::JNB:
+	case Mnemonic::JZ: case Mnemonic::JNZ: case Mnemonic::JBE: case Mnemonic::JA:
+	case Mnemonic::JS: case Mnemonic::JNS: case Mnemonic::JPE: case Mnemonic::JPO:
+	case Mnemonic::JL: case Mnemonic::JGE: case Mnemonic::JLE: case Mnemonic::JG:
+		return HK_JCC;
+	case Mnemonic::LOOP: case Mnemonic::LOOPZ: case Mnemonic::LOOPNZ: case Mnemonic::JCXZ:
+	case Mnemonic::JMP: case Mnemonic::CALL: case Mnemonic::JMPF: case Mnemonic::CALLF:
+	case Mnemonic::RET: case Mnemonic::RETF: case Mnemonic::IRET:
+		return HK_BRANCH;
+	case Mnemonic::MOVSB: case Mnemonic::MOVSW: case Mnemonic::CMPSB: case Mnemonic::CMPSW:
+	case Mnemonic::STOSB: case Mnemonic::STOSW: case Mnemonic::LODSB: case Mnemonic::LODSW:
+	case Mnemonic::SCASB: case Mnemonic::SCASW: case Mnemonic::INSB: case Mnemonic::INSW:
+	case Mnemonic::OUTSB: case Mnemonic::OUTSW:
+		return HK_STRING;
+	default:
+		return HK_SYSTEM;
+	}
+}
+
+StopReason Processor::Execute(const Instruction& ins, unsigned short ip)
+{
+	return Dispatch(HandlerFor(ins.mnemonic), ins, ip);
+}
+
+StopReason Processor::Dispatch(HandlerKind kind, const Instruction& ins, unsigned short ip)
+{
+	switch (kind) {
+	case HK_ALU: return ExecAlu(ins, ip);
+	case HK_MULDIV: return ExecMulDiv(ins, ip);
+	case HK_SHIFT: return ExecShift(ins, ip);
+	case HK_DECIMAL: return ExecDecimal(ins, ip);
+	case HK_STACK: return ExecStack(ins, ip);
+	case HK_MOVE: return ExecMove(ins, ip);
+	case HK_JCC: return ExecJcc(ins, ip);
+	case HK_BRANCH: return ExecBranch(ins, ip);
+	case HK_STRING: return ExecString(ins, ip);
+	default: return ExecSystem(ins, ip);
+	}
+}
+
+StopReason Processor::ExecAlu(const Instruction& ins, unsigned short ip)
+{
+	const Operand* ops = ins.operands;
+	unsigned width = ins.width;
+	switch (ins.mnemonic) {
+	case Mnemonic::ADD: case Mnemonic::OR: case Mnemonic::ADC: case Mnemonic::SBB:
+	case Mnemonic::AND: case Mnemonic::SUB: case Mnemonic::XOR: {
+		Location dst = Locate(ins, ops[0]);
+		unsigned r = Alu(ins.mnemonic, width, Load(dst, width), Load(Locate(ins, ops[1]), width));
+		Store(dst, width, r);
+		break;
+	}
+	case Mnemonic::CMP: case Mnemonic::TEST:
+		Alu(ins.mnemonic, width, Load(Locate(ins, ops[0]), width), Load(Locate(ins, ops[1]), width));
+		break;
+	case Mnemonic::INC: case Mnemonic::DEC: {
+		Location dst = Locate(ins, ops[0]);
+		unsigned a = Load(dst, width);
+		bool inc = (ins.mnemonic == Mnemonic::INC);
+		unsigned r = inc ? a + 1 : a - 1;
+		SetLazy(inc ? FO_INC : FO_DEC, width, a, 1, r);
+		Store(dst, width, r & WidthMask(width));
+		break;
+	}
+	case Mnemonic::NOT: {
+		Location dst = Locate(ins, ops[0]);
+		Store(dst, width, ~Load(dst, width) & WidthMask(width));
+		break;
+	}
+	case Mnemonic::NEG: {
+		Location dst = Locate(ins, ops[0]);
+		unsigned a = Load(dst, width);
+		unsigned r = 0 - a;
+		SetLazy(FO_SUB, width, 0, a, r);
+		Store(dst, width, r & WidthMask(width));
+		break;
+	}
+	default:
+		break;
+	}
+	return StopReason::NONE;
+}
+
+StopReason Processor::ExecMulDiv(const Instruction& ins, unsigned short ip)
+{
+	const Operand* ops = ins.operands;
+	unsigned width = ins.width;
+	switch (ins.mnemonic) {
+	case Mnemonic::MUL: case Mnemonic::IMUL: case Mnemonic::DIV: case Mnemonic::IDIV:
+		if (ops[1].type != OT_NONE) {
+			// 186 three-operand form: IMUL reg, r/m, imm
+			int r = static_cast<short>(Load(Locate(ins, ops[1]), 2)) * static_cast<short>(ops[2].disp);
+			Store(Locate(ins, ops[0]), 2, static_cast<unsigned>(r));
+			SetFlag(Registers::FLAG_CF, r != static_cast<short>(r));
+			SetFlag(Registers::FLAG_OF, r != static_cast<short>(r));
+		} else if (!MulDiv(ins.mnemonic, width, Load(Locate(ins, ops[0]), width))) {
+			return Interrupt(0);
+		}
+		break;
+	case Mnemonic::AAM: {
+		unsigned base = ops[0].disp & 0xFF;
+		if (base == 0) {
+			return Interrupt(0);
+		}
+		unsigned al = GetReg8(0);
+		SetReg(Registers::AX, ((al / base) << 8) | (al % base));
+		SetResultFlags(al % base, 1);
+		break;
+	}
+	case Mnemonic::AAD: {
+		unsigned al = (GetReg8(0) + GetReg8(4) * (ops[0].disp & 0xFF)) & 0xFF;
+		SetReg(Registers::AX, al);
+		SetResultFlags(al, 1);
+		break;
+	}
+	default:
+		break;
+	}
+	return StopReason::NONE;
+}
+
+StopReason Processor::ExecShift(const Instruction& ins, unsigned short ip)
+{
+	const Operand* ops = ins.operands;
+	unsigned width = ins.width;
+	switch (ins.mnemonic) {
+	case Mnemonic::ROL: case Mnemonic::ROR: case Mnemonic::RCL: case Mnemonic::RCR:
+	case Mnemonic::SHL: case Mnemonic::SHR: case Mnemonic::SAR: {
+		Location dst = Locate(ins, ops[0]);
+		unsigned count = Load(Locate(ins, ops[1]), 1);
+		Store(dst, width, Shift(ins.mnemonic, width, Load(dst, width), count));
+		break;
+	}
+	default:
+		break;
+	}
+	return StopReason::NONE;
+}
+
+StopReason Processor::ExecDecimal(const Instruction& ins, unsigned short ip)
+{
+	switch (ins.mnemonic) {
+	case Mnemonic::DAA: case Mnemonic::DAS: {
+		unsigned al = GetReg8(0);
+		bool cf = CF();
+		bool af = AF();
+		int sign = (ins.mnemonic == Mnemonic::DAA) ? 1 : -1;
+		unsigned r = al;
+		if ((al & 0x0F) > 9 || af) {
+			r += sign * 6;
+			af = true;
+		}
+		if (al > 0x99 || cf) {
+			r += sign * 0x60;
+			cf = true;
+		}
+		SetReg8(0, static_cast<unsigned char>(r));
+		SetResultFlags(r, 1);
+		SetFlag(Registers::FLAG_AF, af);
+		SetFlag(Registers::FLAG_CF, cf);
+		break;
+	}
+	case Mnemonic::AAA: case Mnemonic::AAS: {
+		unsigned ax = Reg(Registers::AX);
+		bool adjust = (ax & 0x0F) > 9 || AF();
+		if (adjust) {
+			ax = (ins.mnemonic == Mnemonic::AAA) ? ax + 0x106 : ax - 0x106;
+		}
+		SetReg(Registers::AX, ax & 0xFF0F);
+		SetFlag(Registers::FLAG_AF, adjust);
+		SetFlag(Registers::FLAG_CF, adjust);
+		break;
+	}
+	default:
+		break;
+	}
+	return StopReason::NONE;
+}
+
+StopReason Processor::ExecStack(const Instruction& ins, unsigned short ip)
+{
+	const Operand* ops = ins.operands;
+	switch (ins.mnemonic) {
+	case Mnemonic::PUSH:
+		if (ops[0].type == OT_REG16 && ops[0].reg == 4) {
+			Push(Reg(Registers::SP) - 2); // 8086 pushes the decremented SP
+		} else {
+			Push(static_cast<unsigned short>(Load(Locate(ins, ops[0]), 2)));
+		}
+		break;
+	case Mnemonic::POP: {
+		unsigned short value = Pop();
+		Store(Locate(ins, ops[0]), 2, value);
+		break;
+	}
+	case Mnemonic::PUSHA: {
+		unsigned short sp = Reg(Registers::SP);
+		for (int r = Registers::AX; r <= Registers::DI; ++r) {
+			Push(r == Registers::SP ? sp : Reg(r));
+		}
+		break;
+	}
+	case Mnemonic::POPA:
+		for (int r = Registers::DI; r >= Registers::AX; --r) {
+			unsigned short value = Pop();
+			if (r != Registers::SP) {
+				SetReg(r, value);
+			}
+		}
+		break;
+	case Mnemonic::PUSHF: {
+		bool legacy = (processor == ProcessorType::PT_8086 || processor == ProcessorType::PT_186);
+		Push(static_cast<unsigned short>(GetFlags() | (legacy ? 0xF002 : 0x0002)));
+		break;
+	}
+	case Mnemonic::POPF:
+		SetFlags(Pop() & 0x0FD5);
+		break;
+	case Mnemonic::ENTER: {
+		unsigned short size = ops[0].disp;
+		unsigned level = ops[1].disp & 0x1F;
+		Push(Reg(Registers::BP));
+		unsigned short frame = Reg(Registers::SP);
+		for (unsigned i = 1; i < level; ++i) {
+			SetReg(Registers::BP, Reg(Registers::BP) - 2);
+			Push(memory_.ReadWord(Reg(Registers::SS), Reg(Registers::BP)));
+		}
+		if (level > 0) {
+			Push(frame);
+		}
+		SetReg(Registers::BP, frame);
+		SetReg(Registers::SP, Reg(Registers::SP) - size);
+		break;
+	}
+	case Mnemonic::LEAVE:
+		SetReg(Registers::SP, Reg(Registers::BP));
+		SetReg(Registers::BP, Pop());
+		break;
+	default:
+		break;
+	}
+	return StopReason::NONE;
+}
+
+StopReason Processor::ExecMove(const Instruction& ins, unsigned short ip)
+{
+	const Operand* ops = ins.operands;
+	unsigned width = ins.width;
+	switch (ins.mnemonic) {
+	case Mnemonic::MOV:
+		Store(Locate(ins, ops[0]), width, Load(Locate(ins, ops[1]), width));
+		break;
+	case Mnemonic::XCHG: {
+		Location a = Locate(ins, ops[0]);
+		Location b = Locate(ins, ops[1]);
+		unsigned va = Load(a, width);
+		Store(a, width, Load(b, width));
+		Store(b, width, va);
+		break;
+	}
+	case Mnemonic::LEA:
+		Store(Locate(ins, ops[0]), 2, Locate(ins, ops[1]).offset);
+		break;
+	case Mnemonic::LES: case Mnemonic::LDS: {
+		Location src = Locate(ins, ops[1]);
+		Store(Locate(ins, ops[0]), 2, memory_.ReadWord(src.seg, src.offset));
+		SetReg(ins.mnemonic == Mnemonic::LES ? Registers::ES : Registers::DS,
+				memory_.ReadWord(src.seg, static_cast<unsigned short>(src.offset + 2)));
+		break;
+	}
+	case Mnemonic::XLAT: {
+		int seg = ins.segment == Instruction::NO_SEGMENT ? Registers::DS : Registers::ES + ins.segment;
+		SetReg8(0, memory_.ReadByte(Reg(seg), static_cast<unsigned short>(Reg(Registers::BX) + GetReg8(0))));
+		break;
+	}
+	case Mnemonic::CBW:
+		SetReg(Registers::AX, static_cast<unsigned short>(static_cast<signed char>(GetReg8(0))));
+		break;
+	case Mnemonic::CWD:
+		SetReg(Registers::DX, (Reg(Registers::AX) & 0x8000) ? 0xFFFF : 0);
+		break;
+	case Mnemonic::SAHF:
+		SetFlags((GetFlags() & 0xFF00) | (GetReg8(4) & 0xD5));
+		break;
+	case Mnemonic::LAHF:
+		SetReg8(4, static_cast<unsigned char>(GetFlags() | 0x02));
+		break;
+	default:
+		break;
+	}
+	return StopReason::NONE;
+}
+
+StopReason Processor::ExecJcc(const Instruction& ins, unsigned short ip)
+{
+	if (Condition(ins.mnemonic)) {
+		SetReg(Registers::IP, Reg(Registers::IP) + ins.operands[0].disp);
+	}
+	return StopReason::NONE;
+}
+
+StopReason Processor::ExecBranch(const Instruction& ins, unsigned short ip)
+{
+	const Operand* ops = ins.operands;
+	switch (ins.mnemonic) {
+	case Mnemonic::LOOP: case Mnemonic::LOOPZ: case Mnemonic::LOOPNZ: {
+		unsigned short cx = static_cast<unsigned short>(Reg(Registers::CX) - 1);
+		SetReg(Registers::CX, cx);
+		bool taken = (cx != 0);
+		if (ins.mnemonic == Mnemonic::LOOPZ) {
+			taken = taken && ZF();
+		} else if (ins.mnemonic == Mnemonic::LOOPNZ) {
+			taken = taken && !ZF();
+		}
+		if (taken) {
+			SetReg(Registers::IP, Reg(Registers::IP) + ops[0].disp);
+		}
+		break;
+	}
+	case Mnemonic::JCXZ:
+		if (Reg(Registers::CX) == 0) {
+			SetReg(Registers::IP, Reg(Registers::IP) + ops[0].disp);
+		}
+		break;
+	case Mnemonic::JMP:
+		if (ops[0].type == OT_REL) {
+			SetReg(Registers::IP, Reg(Registers::IP) + ops[0].disp);
+		} else {
+			SetReg(Registers::IP, Load(Locate(ins, ops[0]), 2));
+		}
+		break;
+	case Mnemonic::CALL: {
+		unsigned short target = (ops[0].type == OT_REL)
+				? static_cast<unsigned short>(Reg(Registers::IP) + ops[0].disp)
+				: static_cast<unsigned short>(Load(Locate(ins, ops[0]), 2));
+		Push(Reg(Registers::IP));
+		SetReg(Registers::IP, target);
+		break;
+	}
+	case Mnemonic::JMPF: case Mnemonic::CALLF: {
+		unsigned short seg = ops[0].seg;
+		unsigned short offset = ops[0].disp;
+		if (ops[0].type == OT_MEM) {
+			Location src = Locate(ins, ops[0]);
+			offset = memory_.ReadWord(src.seg, src.offset);
+			seg = memory_.ReadWord(src.seg, static_cast<unsigned short>(src.offset + 2));
+		}
+		if (ins.mnemonic == Mnemonic::CALLF) {
+			Push(Reg(Registers::CS));
+			Push(Reg(Registers::IP));
+		}
+		FarJump(seg, offset);
+		break;
+	}
+	case Mnemonic::RET:
+		SetReg(Registers::IP, Pop());
+		SetReg(Registers::SP, Reg(Registers::SP) + ops[0].disp);
+		break;
+	case Mnemonic::RETF: {
+		unsigned short offset = Pop();
+		FarJump(Pop(), offset);
+		SetReg(Registers::SP, Reg(Registers::SP) + ops[0].disp);
+		break;
+	}
+	case Mnemonic::IRET: {
+		unsigned short offset = Pop();
+		FarJump(Pop(), offset);
+		SetFlags(Pop() & 0x0FD5);
+		break;
+	}
+	default:
+		break;
+	}
+	return StopReason::NONE;
+}
+
+StopReason Processor::ExecSystem(const Instruction& ins, unsigned short ip)
+{
+	const Operand* ops = ins.operands;
+	unsigned width = ins.width;
+	switch (ins.mnemonic) {
+	case Mnemonic::BOUND: {
+		Location src = Locate(ins, ops[1]);
+		short index = static_cast<short>(Load(Locate(ins, ops[0]), 2));
+		short low = static_cast<short>(memory_.ReadWord(src.seg, src.offset));
+		short high = static_cast<short>(memory_.ReadWord(src.seg, static_cast<unsigned short>(src.offset + 2)));
+		if (index < low || index > high) {
+			SetReg(Registers::IP, ip);
+			return Interrupt(5);
+		}
+		break;
+	}
+	case Mnemonic::INT:
+		return Interrupt(static_cast<unsigned char>(ops[0].disp));
+	case Mnemonic::INTO:
+		if (OF()) {
+			return Interrupt(4);
+		}
+		break;
+	case Mnemonic::IN:
+		Store(Locate(ins, ops[0]), width, 0xFFFF); // no devices attached
+		break;
+	case Mnemonic::OUT:
+		break;
+	case Mnemonic::CLC: SetFlag(Registers::FLAG_CF, false); break;
+	case Mnemonic::STC: SetFlag(Registers::FLAG_CF, true); break;
+	case Mnemonic::CMC: SetFlag(Registers::FLAG_CF, !CF()); break;
+	case Mnemonic::CLI: SetFlag(Registers::FLAG_IF, false); break;
+	case Mnemonic::STI: SetFlag(Registers::FLAG_IF, true); break;
+	case Mnemonic::CLD: SetFlag(Registers::FLAG_DF, false); break;
+	case Mnemonic::STD: SetFlag(Registers::FLAG_DF, true); break;
+	case Mnemonic::NOP: case Mnemonic::WAIT: case Mnemonic::ESC:
+		break;
+	case Mnemonic::HLT:
+		return StopReason::HALT;
+	default:
+		return StopReason::INVALID_OPCODE;
+	}
+	return StopReason::NONE;
+}
+
+StopReason Processor::ExecString(const Instruction& ins, unsigned short ip)
+{
+	unsigned width = ins.width;
+	bool repeat = (ins.repeat != Instruction::REP_NONE);
+	int srcSeg = ins.segment == Instruction::NO_SEGMENT ? Registers::DS : Registers::ES + ins.segment;
+	unsigned short delta = static_cast<unsigned short>((flags_ & Registers::FLAG_DF) ? -width : width);
+	bool compares = false;
+
+	while (!repeat || Reg(Registers::CX) != 0) {
+		unsigned short si = Reg(Registers::SI);
+		unsigned short di = Reg(Registers::DI);
+		Location src{OT_MEM, 0, Reg(srcSeg), si};
+		Location dst{OT_MEM, 0, Reg(Registers::ES), di};
+		Location acc{width == 1 ? OT_REG8 : OT_REG16, 0, 0, 0};
+		switch (ins.mnemonic) {
+		case Mnemonic::MOVSB: case Mnemonic::MOVSW:
+			Store(dst, width, Load(src, width));
+			SetReg(Registers::SI, si + delta);
+			SetReg(Registers::DI, di + delta);
+			break;
+		case Mnemonic::CMPSB: case Mnemonic::CMPSW:
+			Alu(Mnemonic::CMP, width, Load(src, width), Load(dst, width));
+			SetReg(Registers::SI, si + delta);
+			SetReg(Registers::DI, di + delta);
+			compares = true;
+			break;
+		case Mnemonic::STOSB: case Mnemonic::STOSW:
+			Store(dst, width, Load(acc, width));
+			SetReg(Registers::DI, di + delta);
+			break;
+		case Mnemonic::LODSB: case Mnemonic::LODSW:
+			Store(acc, width, Load(src, width));
+			SetReg(Registers::SI, si + delta);
+			break;
+		case Mnemonic::SCASB: case Mnemonic::SCASW:
+			Alu(Mnemonic::CMP, width, Load(acc, width), Load(dst, width));
+			SetReg(Registers::DI, di + delta);
+			compares = true;
+			break;
+		case Mnemonic::INSB: case Mnemonic::INSW:
+			Store(dst, width, 0xFFFF);
+			SetReg(Registers::DI, di + delta);
+			break;
+		default: // OUTSB, OUTSW
+			SetReg(Registers::SI, si + delta);
+			break;
+		}
+		if (!repeat) {
+			break;
+		}
+		SetReg(Registers::CX, Reg(Registers::CX) - 1);
+		if (compares && ZF() != (ins.repeat == Instruction::REP_Z)) {
+			break;
+		}
 	}
-	return s;
+	return StopReason::NONE;
 }
 
-void ConsoleUI::ChangeRegisters(const Command& cmd, Registers& registers)
+StopReason Processor::Interrupt(unsigned char vector)
 {
-	auto words = cmd.GetWords();
-	if (cmd.GetWords().size() > 3) {
-		ShowError(words[3].first, "Unexpected argument");
-		return;
+	lastVector_ = vector;
+	if (hooked_[vector]) {
+		Push(static_cast<unsigned short>(GetFlags()));
+		Push(Reg(Registers::CS));
+		Push(Reg(Registers::IP));
+		SetFlag(Registers::FLAG_IF, false);
+		SetFlag(Registers::FLAG_TF, false);
+		FarJump(memory_.ReadWord(0, vector * 4 + 2), memory_.ReadWord(0, vector * 4));
+		return StopReason::NONE;
 	}
-	string regName = words[1].second;
-	unsigned short value;
-	if (cmd.GetWords().size() == 2) {
-		if (!registers.Get(regName, value)) {
-			ShowError(words[1].first, "Invalid register name '%s'", regName.c_str());
-			return;
-		}
-		printf("%s %04X  :", regName.c_str(), value);
-		char buf[32];
-		fgets(buf, sizeof(buf), stdin);
-		string s = Trim(buf);
-		if (s.empty()) {
-			return;
+
+	// Without a resident DOS, the commonly used BIOS and DOS services are
+	// emulated here and behave as if the debugger had stepped over them.
+	unsigned char ah = GetReg8(4);
+	switch (vector) {
+	case 0x00:
+		return StopReason::DIVIDE_ERROR;
+	case 0x03:
+		return StopReason::BREAKPOINT;
+	case 0x10:
+		if (ah == 0x0E) {
+			GuestOutput(GetReg8(0));
+		} else if (ah == 0x0F) {
+			SetReg(Registers::AX, 0x5003);
+			SetReg8(7, 0);
 		}
-		if (!ParseHex(s, value)) {
-			ShowError(10, "Invalid hex value '%s'", s.c_str());
-			return;
+		return StopReason::NONE;
+	case 0x16:
+		if (ah == 0x00 || ah == 0x10) {
+			int c = GuestInput();
+			SetReg(Registers::AX, c == EOF ? 0x1A : c);
+		} else if (ah == 0x01 || ah == 0x11) {
+			SetFlag(Registers::FLAG_ZF, true);
 		}
-	} else {
-		if (!ParseHex(words[2].second, value)) {
-			ShowError(words[2].first, "Invalid hex value '%s'", words[2].second.c_str());
-			return;
+		return StopReason::NONE;
+	case 0x1A:
+		if (ah == 0x00) {
+			unsigned long ticks = static_cast<unsigned long>(clock()) * 182 / (10 * CLOCKS_PER_SEC);
+			SetReg(Registers::CX, ticks >> 16);
+			SetReg(Registers::DX, ticks);
+			SetReg8(0, 0);
 		}
-	}
-	if (!registers.Set(regName, value)) {
-		ShowError(words[1].first, "Invalid register name '%s'", regName.c_str());
-		return;
+		return StopReason::NONE;
+	case 0x20:
+		exitCode_ = 0;
+		return StopReason::TERMINATED;
+	case 0x21:
+		return DosService();
+	default:
+		return StopReason::INTERRUPT;
 	}
 }
 
-void ConsoleUI::Process(const Command& cmd, Processor& processor)
+StopReason Processor::DosService()
 {
-	if (cmd.IsEmpty()) {
-		return;
-	}
-	auto words = cmd.GetWords();
-
-	switch (tolower(words[0].second[0])) {
-	case 'q':
-		exit(0);
-	case '?':
-		PrintUsage();
-		break;
-	case 'c':
-		CompareMemory(cmd, processor.GetRegisters(), processor.GetMemory());
+	unsigned short ds = Reg(Registers::DS);
+	unsigned short dx = Reg(Registers::DX);
+	switch (GetReg8(4)) {
+	case 0x00:
+		exitCode_ = 0;
+		return StopReason::TERMINATED;
+	case 0x01: case 0x07: case 0x08: {
+		int c = GuestInput();
+		c = (c == EOF ? 0x1A : c);
+		if (GetReg8(4) == 0x01) {
+			GuestOutput(static_cast<unsigned char>(c));
+		}
+		SetReg8(0, static_cast<unsigned char>(c));
 		break;
-	case 'd':
-		DumpMemory(cmd, processor.GetRegisters(), processor.GetMemory());
+	}
+	case 0x02:
+		GuestOutput(GetReg8(2));
+		SetReg8(0, GetReg8(2));
 		break;
-	case 'r':
-		if (cmd.GetWords().size() == 1) {
-			processor.GetRegisters().Dump();
+	case 0x06:
+		if (GetReg8(2) != 0xFF) {
+			GuestOutput(GetReg8(2));
 		} else {
-			ChangeRegisters(cmd, processor.GetRegisters());
+			SetReg8(0, 0);
+			SetFlag(Registers::FLAG_ZF, true);
 		}
 		break;
-	case 'm':
-		if (cmd.GetWords().size() == 4) {
-			CopyMemory(cmd, processor.GetRegisters(), processor.GetMemory());
-		} else {
-			SwitchProcessorType(cmd, processor);
+	case 0x09:
+		for (unsigned short i = dx; ; ++i) {
+			unsigned char c = memory_.ReadByte(ds, i);
+			if (c == '$' || static_cast<unsigned short>(i - dx) == 0xFFFF) {
+				break;
+			}
+			GuestOutput(c);
 		}
+		SetReg8(0, '$');
 		break;
-	case 'h':
-		HexCalc(cmd);
-		break;
-	case 'e':
-		EnterData(cmd, processor.GetRegisters(), processor.GetMemory());
-		break;
-	case 's':
-		SearchData(cmd, processor.GetRegisters(), processor.GetMemory());
-		break;
-	case 'f':
-		FillData(cmd, processor.GetRegisters(), processor.GetMemory());
+	case 0x25:
+		memory_.WriteWord(0, GetReg8(0) * 4, dx);
+		memory_.WriteWord(0, GetReg8(0) * 4 + 2, ds);
+		hooked_.set(GetReg8(0));
 		break;
-	case 'n':
-		if (!EnsureArgumentCount(cmd, 2, 2)) {
-			return;
+	case 0x2A: case 0x2C: {
+		time_t now = time(nullptr);
+		struct tm local;
+		struct tm* t = localtime_r(&now, &local);
+		if (GetReg8(4) == 0x2A) {
+			SetReg(Registers::CX, t->tm_year + 1900);
+			SetReg(Registers::DX, ((t->tm_mon + 1) << 8) | t->tm_mday);
+			SetReg8(0, static_cast<unsigned char>(t->tm_wday));
+		} else {
+			SetReg(Registers::CX, (t->tm_hour << 8) | t->tm_min);
+			SetReg(Registers::DX, t->tm_sec << 8);
 		}
-		SetFilename(words[1].second);
 		break;
-	case 'l':
-		LoadData(cmd, processor.GetRegisters(), processor.GetMemory());
+	}
+	case 0x30:
+		SetReg(Registers::AX, 0x0005);
+		SetReg(Registers::BX, 0);
+		SetReg(Registers::CX, 0);
 		break;
-	case 'w':
-		WriteData(cmd, processor.GetRegisters(), processor.GetMemory());
+	case 0x35:
+		SetReg(Registers::BX, memory_.ReadWord(0, GetReg8(0) * 4));
+		SetReg(Registers::ES, memory_.ReadWord(0, GetReg8(0) * 4 + 2));
 		break;
-	case 'u':
-		Unassemble(cmd, processor.GetRegisters(), processor.GetMemory());
+	case 0x3F: case 0x40: {
+		unsigned short handle = Reg(Registers::BX);
+		unsigned short count = Reg(Registers::CX);
+		bool reading = (GetReg8(4) == 0x3F);
+		if (reading ? handle != 0 : (handle != 1 && handle != 2)) {
+			SetReg(Registers::AX, 6); // invalid handle
+			SetFlag(Registers::FLAG_CF, true);
+			break;
+		}
+		unsigned short done = 0;
+		for (; done < count; ++done) {
+			unsigned short offset = static_cast<unsigned short>(dx + done);
+			if (reading) {
+				int c = GuestInput();
+				if (c == EOF) {
+					break;
+				}
+				memory_.WriteByte(ds, offset, static_cast<unsigned char>(c));
+				if (c == '\n') {
+					++done;
+					break;
+				}
+			} else {
+				GuestOutput(memory_.ReadByte(ds, offset), handle);
+			}
+		}
+		SetReg(Registers::AX, done);
+		SetFlag(Registers::FLAG_CF, false);
 		break;
+	}
+	case 0x4C:
+		exitCode_ = GetReg8(0);
+		return StopReason::TERMINATED;
 	default:
-		ShowError(words[0].first, "Unsupported command '%c'", words[0].second[0]);
+		return StopReason::INTERRUPT;
 	}
+	return StopReason::NONE;
 }
 
-Memory::Memory()
+void Processor::GuestOutput(unsigned char c, unsigned handle)
 {
-	data_.resize(1024 * 1024); // 1MB memory for 'real mode'
-
-	srand(123);
-	for (size_t i = 0; i < data_.size(); ++i) {
-		data_[i] = static_cast<unsigned char>(rand());
+	if (outputHandler_) {
+		outputHandler_(c, handle);
+	} else {
+		fputc(c, handle == 2 ? stderr : stdout);
 	}
 }
 
-void Memory::Dump(unsigned short seg, unsigned short start, unsigned short end)
+void Registers::Dump()
 {
-	unsigned short cursor = start & 0xFFF0;
-	size_t realStart = seg * 16 + start;
-	size_t realEnd = seg * 16 + end;
-	if (realEnd < realStart) {
-		realEnd = realStart;
-	}
-	bool exitFlag = false;
-	while (!exitFlag) {
-		printf("%04X:%04X ", seg, cursor);
-		for (int j = 0; j < 16; ++j) {
-			printf("%c", (j == 8 ? '-' : ' '));
-			size_t realOffset = seg * 16 + cursor + j;
-			if (realOffset < realStart || realOffset > realEnd) {
-				printf("  ");
-			} else {
-				printf("%02X", data_[realOffset]);
-			}
-		}
-		printf("   ");
-		for (int j = 0; j < 16; ++j) {
-			size_t realOffset = seg * 16 + cursor + j;
-			if (realOffset < realStart || realOffset > realEnd) {
-				printf(" ");
-			} else {
-				unsigned char c = data_[realOffset];
-				printf("%c", (c >= 0x20 && c < 0x7F) ? c : '.');
-			}
-			if (realOffset >= realEnd) {
-				exitFlag = true;
-			}
-		}
-		printf("\n");
-		cursor += 16;
-	}
+	printf("AX=%04X  BX=%04X  CX=%04X  DX=%04X  SP=%04X  BP=%04X  SI=%04X  DI=%04X\n",
+			regs_[AX], regs_[BX], regs_[CX], regs_[DX], regs_[SP], regs_[BP], regs_[SI], regs_[DI]);
+	printf("DS=%04X  ES=%04X  SS=%04X  CS=%04X  IP=%04X   %s %s %s %s %s %s %s %s\n",
+			regs_[DS], regs_[ES], regs_[SS], regs_[CS], regs_[IP],
+			((regs_[FLAGS] & 0x0800) != 0 ? "OV" : "NV"), // Bit 11 (of): 1000 0000 0010 = 802 - Overflow (OV)
+			((regs_[FLAGS] & 0x0400) != 0 ? "DN" : "UP"), // Bit 10 (df): 0100 0000 0010 = 402 - Direction Down (DN)
+			((regs_[FLAGS] & 0x0200) != 0 ? "EI" : "DI"), // Bit  9 (if): 0010 0000 0010 = 202 - Interrupt Enabled (EI)
+			((regs_[FLAGS] & 0x0080) != 0 ? "NG" : "PL"), // Bit  7 (sf): 0000 1000 0010 =  82 - Sign Negative (NG)
+			((regs_[FLAGS] & 0x0040) != 0 ? "ZR" : "NZ"), // Bit  6 (zf): 0000 0100 0010 =  42 - Zero (ZR)
+			((regs_[FLAGS] & 0x0010) != 0 ? "AC" : "NA"), // Bit  4 (af): 0000 0001 0010 =  12 - Auxiliary Carry (AC)
+			((regs_[FLAGS] & 0x0004) != 0 ? "PE" : "PO"), // Bit  2 (pf): 0000 0000 0110 =  06 - Parity Even (PE)
+			((regs_[FLAGS] & 0x0001) != 0 ? "CY" : "NC")  // Bit  0 (cf): 0000 0000 0011 =  03 - Carry (CY)
+			);
 }
 
-void Memory::Compare(unsigned short srcSeg, unsigned short srcStart, unsigned short srcEnd,
-		unsigned short dstSeg, unsigned short dstStart)
+namespace {
+
+struct RegisterName
 {
-	unsigned short srcOffset = srcStart;
-	unsigned short dstOffset = dstStart;
-	for (;;) {
-		size_t srcRealOffset = srcSeg * 16 + srcOffset;
-		size_t dstRealOffset = dstSeg * 16 + dstOffset;
-		if (data_[srcRealOffset] != data_[dstRealOffset]) {
-			printf("%04X:%04X  %02X %02X  %04X:%04X\n",
-					srcSeg, srcOffset, data_[srcRealOffset],
-					data_[dstRealOffset], dstSeg, dstOffset);
-		}
-		if (srcOffset == srcEnd) {
-			break;
-		}
-		++srcOffset;
-		++dstOffset;
-	}
-}
+	char text[3];
+	int reg;
+};
 
-void Memory::Copy(unsigned short srcSeg, unsigned short srcStart, unsigned short srcEnd,
-		unsigned short dstSeg, unsigned short dstStart)
+constexpr RegisterName kRegisterNames[] = {
+	{"AX", Registers::AX}, {"CX", Registers::CX}, {"DX", Registers::DX}, {"BX", Registers::BX},
+	{"SP", Registers::SP}, {"BP", Registers::BP}, {"SI", Registers::SI}, {"DI", Registers::DI},
+	{"ES", Registers::ES}, {"CS", Registers::CS}, {"SS", Registers::SS}, {"DS", Registers::DS},
+	{"IP", Registers::IP},
+	{"AL", Registers::BYTE_REG | 0}, {"CL", Registers::BYTE_REG | 1},
+	{"DL", Registers::BYTE_REG | 2}, {"BL", Registers::BYTE_REG | 3},
+	{"AH", Registers::BYTE_REG | 4}, {"CH", Registers::BYTE_REG | 5},
+	{"DH", Registers::BYTE_REG | 6}, {"BH", Registers::BYTE_REG | 7},
+};
+
+// Collision-free for the upper-case names above; other input lands in some
+// slot and is rejected by comparing the name stored there.
+constexpr unsigned RegisterHash(char first, char second)
 {
-	unsigned short srcOffset = srcStart;
-	unsigned short dstOffset = dstStart;
-	for (;;) {
-		size_t srcRealOffset = srcSeg * 16 + srcOffset;
-		size_t dstRealOffset = dstSeg * 16 + dstOffset;
-		data_[dstRealOffset] = data_[srcRealOffset];
-		if (srcOffset == srcEnd) {
-			break;
-		}
-		++srcOffset;
-		++dstOffset;
-	}
+	return (static_cast<unsigned char>(first) + static_cast<unsigned char>(second) * 11u) & 63;
 }
 
-void Memory::PutData(unsigned short seg, unsigned short start, vector<unsigned char> data)
+struct RegisterTable
 {
-	size_t offset = seg * 16 + start;
-	for (size_t i = 0; i < data.size(); ++i) {
-		data_[offset + i] = data[i];
+	signed char slots[64];  // index into kRegisterNames, or -1
+	bool perfect;
+};
+
+constexpr RegisterTable BuildRegisterTable()
+{
+	RegisterTable table{};
+	table.perfect = true;
+	for (signed char& slot : table.slots) {
+		slot = -1;
+	}
+	for (size_t i = 0; i < sizeof(kRegisterNames) / sizeof(kRegisterNames[0]); ++i) {
+		signed char& slot = table.slots[RegisterHash(kRegisterNames[i].text[0], kRegisterNames[i].text[1])];
+		table.perfect = table.perfect && slot < 0;
+		slot = static_cast<signed char>(i);
 	}
+	return table;
 }
 
-unsigned char Memory::GetChar(unsigned short seg, unsigned short offset) const
+constexpr RegisterTable kRegisterTable = BuildRegisterTable();
+static_assert(kRegisterTable.perfect, "register names collide in RegisterHash");
+
+} // namespace
+
+int Registers::Find(const char* name, size_t size)
 {
-	size_t realOffset = seg * 16 + offset;
-	return data_[realOffset];
+	if (size != 2) {
+		return NO_REG;
+	}
+	// Clearing bit 5 upper-cases ASCII letters and maps nothing else onto them.
+	char first = static_cast<char>(name[0] & ~0x20);
+	char second = static_cast<char>(name[1] & ~0x20);
+	int slot = kRegisterTable.slots[RegisterHash(first, second)];
+	if (slot < 0 || kRegisterNames[slot].text[0] != first || kRegisterNames[slot].text[1] != second) {
+		return NO_REG;
+	}
+	return kRegisterNames[slot].reg;
 }
 
-void Memory::SearchData(unsigned short seg, unsigned short start, unsigned short end,
-		const vector<unsigned char>& data)
+const char* Registers::Name(int reg)
 {
-	for (unsigned short offset = start; offset + data.size() != end; ++offset) {
-		size_t realOffset = seg * 16 + offset;
-		bool match = true;
-		for (size_t i = 0; i < data.size(); ++i) {
-			if (data_[realOffset + i] != data[i]) {
-				match = false;
-				break;
-			}
-		}
-		if (match) {
-			printf("%04X:%04X\n", seg, offset);
+	for (const RegisterName& name : kRegisterNames) {
+		if (name.reg == reg) {
+			return name.text;
 		}
 	}
+	return "??";
 }
 
-void Memory::FillData(unsigned short seg, unsigned short start, unsigned short end,
-		const vector<unsigned char>& data)
+void Registers::SetAny(int reg, unsigned short value)
 {
-	size_t i = 0;
-	for (unsigned short offset = start; ; ++offset, ++i) {
-		size_t realOffset = seg * 16 + offset;
-		data_[realOffset] = data[i % data.size()];
-		if (offset == end) {
-			break;
-		}
+	if (reg & BYTE_REG) {
+		SetByte(reg & 7, static_cast<unsigned char>(value));
+	} else {
+		regs_[reg] = value;
 	}
 }
 
-bool Memory::Load(const string& filename, unsigned short seg,
-		unsigned short offset, unsigned short& size)
+bool Registers::GetSeg(string_view name, unsigned short& value) const
 {
-	unsigned short realOffset = seg * 16 + offset;
-	size = 0;
-	FILE* fp = fopen(filename.c_str(), "r");
-	if (!fp) {
+	int reg = Find(name);
+	if (!IsSegment(reg)) {
 		return false;
 	}
-	while (!feof(fp)) {
-		char buf[1024];
-		size_t n = fread(buf, 1, sizeof(buf), fp);
-		if (n > 0) {
-			memcpy(&data_[realOffset], buf, n);
-			realOffset += n;
-			size += n;
-		}
-	}
-	fclose(fp);
+	value = regs_[reg];
 	return true;
 }
 
-bool Memory::Write(const string& filename, unsigned short seg,
-		unsigned short offset, unsigned short size)
+bool Registers::Get(string_view name, unsigned short& value) const
 {
-	unsigned short realOffset = seg * 16 + offset;
-	FILE* fp = fopen(filename.c_str(), "w");
-	if (!fp) {
+	int reg = Find(name);
+	if (reg == NO_REG) {
 		return false;
 	}
-	unsigned short BLOCK_SIZE = 1024;
-	for (size_t i = 0; i < size; ) {
-		size_t count = size - i;
-		if (count > BLOCK_SIZE) {
-			count = BLOCK_SIZE;
-		}
-		size_t n = fwrite(&data_[realOffset], 1, count, fp);
-		realOffset += n;
-		i += n;
-	}
-	fclose(fp);
+	value = GetAny(reg);
 	return true;
 }
 
-string Memory::Hex(unsigned char x)
+bool Registers::Set(string_view name, unsigned short value)
 {
-	char buf[16] = "";
-	snprintf(buf, sizeof(buf), "%02X", x);
-	return buf;
-}
-
-bool Memory::ParseOneInstrument(const unsigned char* p, size_t& count, string& op, string& operands) const
-{
-	const char* reg[] = { "AX", "BX", "CX", "DX", "SP", "BP", "SI", "DI" };
-	if (*p >= 0x50 && *p <= 0x57) {
-		op = "PUSH";
-		operands = reg[*p - 0x50];
-		count = 1;
-	} else if (*p >= 0x58 && *p <= 0x5F) {
-		op = "POP";
-		operands = reg[*p - 0x58];
-		count = 1;
-	} else if (*p == 0x58) {
-		op = "POP";
-		operands = "AX";
-		count = 1;
-	} else {
-		op = "DB";
-		operands = Hex(*p);
-		count = 1;
+	int reg = Find(name);
+	if (reg == NO_REG) {
+		return false;
 	}
+	SetAny(reg, value);
 	return true;
 }
 
-bool Memory::Unassemble(unsigned short seg, unsigned short offset) const
+RunPool::RunPool(unsigned threads, unsigned long long limit, Memory::FillMode fillMode)
+	: threads_(max(threads, 1u)), limit_(limit), fillMode_(fillMode)
 {
-	for (unsigned short x = offset; x < offset + 32; ) {
-		size_t count = 0;
-		string op;
-		string operands;
-		ParseOneInstrument(&data_[seg * 16 + x], count, op, operands);
+}
 
-		string data;
-		for (size_t i = 0; i < count; ++i) {
-			data += Hex(data_[seg * 16 + x + i]);
+vector<RunPool::Result> RunPool::Run(const vector<Job>& jobs)
+{
+	vector<Result> results(jobs.size());
+	unsigned threads = static_cast<unsigned>(min<size_t>(threads_, max<size_t>(jobs.size(), 1)));
+	// Neighbouring jobs start on the same worker; thieves take from the far end.
+	queues_.clear();
+	for (unsigned worker = 0; worker < threads; ++worker) {
+		queues_.push_back(make_unique<Queue>());
+		for (size_t job = jobs.size() * worker / threads; job < jobs.size() * (worker + 1) / threads; ++job) {
+			queues_.back()->jobs.push_back(job);
 		}
-		printf("%04X:%04X %-14s%-8s%s\n", seg, x, data.c_str(), op.c_str(), operands.c_str());
-		x += count;
 	}
-	return true;
+
+	vector<thread> workers;
+	for (unsigned worker = 1; worker < threads; ++worker) {
+		workers.emplace_back(&RunPool::Work, this, worker, cref(jobs), ref(results));
+	}
+	Work(0, jobs, results);
+	for (thread& worker : workers) {
+		worker.join();
+	}
+	queues_.clear();
+	return results;
 }
 
-void Processor::SetProcessorType(ProcessorType type)
+bool RunPool::Take(unsigned worker, size_t& job)
 {
-	processor = type;
+	{
+		Queue& own = *queues_[worker];
+		lock_guard<mutex> guard(own.lock);
+		if (!own.jobs.empty()) {
+			job = own.jobs.front();
+			own.jobs.pop_front();
+			return true;
+		}
+	}
+	for (size_t i = 1; i < queues_.size(); ++i) {
+		Queue& victim = *queues_[(worker + i) % queues_.size()];
+		lock_guard<mutex> guard(victim.lock);
+		if (!victim.jobs.empty()) {
+			job = victim.jobs.back();
+			victim.jobs.pop_back();
+			return true;
+		}
+	}
+	return false;
 }
 
-void Processor::SetCoProcessorType(CoProcessorType type)
+// A worker reuses one machine for all its jobs: restoring the power-on
+// snapshot copies back only what the previous guest changed.
+void RunPool::Work(unsigned worker, const vector<Job>& jobs, vector<Result>& results)
 {
-	coprocessor = type;
+	Processor processor;
+	processor.GetMemory().SetFillMode(fillMode_);
+	Processor::State initial = processor.Snapshot();
+	size_t job;
+	while (Take(worker, job)) {
+		processor.Restore(initial);
+		RunJob(processor, jobs[job], results[job]);
+	}
 }
 
-void Processor::ShowProcessorType()
+void RunPool::RunJob(Processor& processor, const Job& job, Result& result)
 {
-	switch (processor) {
-	case ProcessorType::PT_8086: cout << "8086/88"; break;
-	case ProcessorType::PT_186:  cout << "186";     break;
-	case ProcessorType::PT_286:  cout << "286";     break;
-	case ProcessorType::PT_386:  cout << "386";     break;
-	case ProcessorType::PT_486:  cout << "486";     break;
-	case ProcessorType::PT_586:  cout << "586";     break;
-	case ProcessorType::PT_686:  cout << "686";     break;
-	default: cout.setstate(ios_base::failbit);
+	string input;
+	if (!job.input.empty() && !ReadWholeFile(job.input, input)) {
+		result.error = "cannot read " + job.input;
+		return;
 	}
-
-	cout << " ";
-
-	switch (coprocessor) {
-	case CoProcessorType::CPT_NONE: cout << "without coprocessor"; break;
-	case CoProcessorType::CPT_287:  cout << "with 287";            break;
-	case CoProcessorType::CPT_387:  cout << "with coprocessor";    break;
-	default: cout.setstate(ios_base::failbit);
+	Registers& registers = processor.GetRegisters();
+	unsigned size;
+	bool executable;
+	if (!LoadProgram(job.image, {}, registers, processor.GetMemory(), size, executable)) {
+		result.error = "cannot load " + job.image;
+		return;
 	}
 
-	cout << endl;
-}
+	size_t position = 0;
+	processor.SetInputHandler([&]() {
+		return position < input.size() ? static_cast<unsigned char>(input[position++]) : EOF;
+	});
+	processor.SetOutputHandler([&](unsigned char c, unsigned) { result.output += static_cast<char>(c); });
+	result.reason = processor.Run(limit_, Breakpoints());
+	processor.SetInputHandler(nullptr);
+	processor.SetOutputHandler(nullptr);
 
-void Registers::Dump()
-{
-	printf("AX=%04X  BX=%04X  CX=%04X  DX=%04X  SP=%04X  BP=%04X  SI=%04X  DI=%04X\n",
-			regs_[AX], regs_[BX], regs_[CX], regs_[DX], regs_[SP], regs_[BP], regs_[SI], regs_[DI]);
-	printf("DS=%04X  ES=%04X  SS=%04X  CS=%04X  IP=%04X   %s %s %s %s %s %s %s %s\n",
-			regs_[DS], regs_[ES], regs_[SS], regs_[CS], regs_[IP],
-			((regs_[FLAGS] & 0x0800) != 0 ? "OV" : "NV"), // Bit 11 (of): 1000 0000 0010 = 802 - Overflow (OV)
-			((regs_[FLAGS] & 0x0400) != 0 ? "DN" : "UP"), // Bit 10 (df): 0100 0000 0010 = 402 - Direction Down (DN)
-			((regs_[FLAGS] & 0x0200) != 0 ? "EI" : "DI"), // Bit  9 (if): 0010 0000 0010 = 202 - Interrupt Enabled (EI)
-			((regs_[FLAGS] & 0x0080) != 0 ? "NG" : "PL"), // Bit  7 (sf): 0000 1000 0010 =  82 - Sign Negative (NG)
-			((regs_[FLAGS] & 0x0040) != 0 ? "ZR" : "NZ"), // Bit  6 (zf): 0000 0100 0010 =  42 - Zero (ZR)
-			((regs_[FLAGS] & 0x0010) != 0 ? "AC" : "NA"), // Bit  4 (af): 0000 0001 0010 =  12 - Auxiliary Carry (AC)
-			((regs_[FLAGS] & 0x0004) != 0 ? "PE" : "PO"), // Bit  2 (pf): 0000 0000 0110 =  06 - Parity Even (PE)
-			((regs_[FLAGS] & 0x0001) != 0 ? "CY" : "NC")  // Bit  0 (cf): 0000 0000 0011 =  03 - Carry (CY)
-			);
-	printf("%04X:%04X F60000        TEST    BYTE PTR [BX+SI],00                  DS:0000=CD\n", regs_[CS], regs_[IP]);
+	result.exitCode = processor.GetExitCode();
+	result.executed = processor.GetExecuted();
+	result.registers = registers;
 }
 
-string ToUpper(const string& s)
+#ifndef X86_DEBUG_NO_MAIN
+namespace {
+
+const char* StopReasonName(StopReason reason)
 {
-	string r = s;
-	for (auto& c : r) {
-		c = toupper(c);
-	}
-	return r;
+	static const char* const names[] = {
+		"none", "limit", "breakpoint", "halt", "terminated", "interrupt",
+		"divide-error", "invalid-opcode", "break", "watchpoint"
+	};
+	return names[static_cast<int>(reason)];
 }
 
-bool Registers::GetSeg(const string& name, unsigned short& value) const
+// --run-many: each line of the list names a COM image and optionally a file
+// for its standard input; blank lines and lines starting with # are skipped.
+// One result line per job is printed in list order.
+int RunMany(const string& listFile, unsigned threads, unsigned long long limit, Memory::FillMode fillMode)
 {
-	auto uname = ToUpper(name);
-	if (uname == "DS") {
-		value = regs_[DS];
-	} else if (uname == "ES") {
-		value = regs_[ES];
-	} else if (uname == "SS") {
-		value = regs_[SS];
-	} else if (uname == "CS") {
-		value = regs_[CS];
-	} else {
-		return false;
+	string list;
+	if (!ReadWholeFile(listFile, list)) {
+		cerr << "Error: Cannot read job list " << listFile << endl;
+		return 1;
+	}
+	vector<RunPool::Job> jobs;
+	size_t lineStart = 0;
+	while (lineStart < list.size()) {
+		size_t lineEnd = list.find('\n', lineStart);
+		if (lineEnd == string::npos) {
+			lineEnd = list.size();
+		}
+		vector<string> words;
+		for (size_t i = lineStart; i < lineEnd; ) {
+			while (i < lineEnd && isspace(static_cast<unsigned char>(list[i]))) {
+				++i;
+			}
+			size_t start = i;
+			while (i < lineEnd && !isspace(static_cast<unsigned char>(list[i]))) {
+				++i;
+			}
+			if (i > start) {
+				words.emplace_back(list, start, i - start);
+			}
+		}
+		lineStart = lineEnd + 1;
+		if (words.empty() || words[0][0] == '#') {
+			continue;
+		}
+		if (words.size() > 2) {
+			cerr << "Error: Expected 'image [input]' in job list: " << words[0] << endl;
+			return 1;
+		}
+		jobs.push_back(RunPool::Job{words[0], words.size() > 1 ? words[1] : string()});
 	}
-	return true;
-}
 
-bool Registers::Get(const string& name, unsigned short& value) const
-{
-	auto uname = ToUpper(name);
-	if (uname == "DS") {
-		value = regs_[DS];
-	} else if (uname == "ES") {
-		value = regs_[ES];
-	} else if (uname == "SS") {
-		value = regs_[SS];
-	} else if (uname == "CS") {
-		value = regs_[CS];
-	} else if (uname == "IP") {
-		value = regs_[IP];
-	} else if (uname == "AX") {
-		value = regs_[AX];
-	} else if (uname == "BX") {
-		value = regs_[BX];
-	} else if (uname == "CX") {
-		value = regs_[CX];
-	} else if (uname == "DX") {
-		value = regs_[DX];
-	} else if (uname == "SP") {
-		value = regs_[SP];
-	} else if (uname == "BP") {
-		value = regs_[BP];
-	} else if (uname == "SI") {
-		value = regs_[SI];
-	} else if (uname == "DI") {
-		value = regs_[DI];
-	} else {
-		return false;
+	RunPool pool(threads, limit, fillMode);
+	vector<RunPool::Result> results = pool.Run(jobs);
+	int status = 0;
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		const RunPool::Result& result = results[i];
+		if (!result.error.empty()) {
+			printf("%s  error: %s\n", jobs[i].image.c_str(), result.error.c_str());
+			status = 1;
+			continue;
+		}
+		// FNV-1a of the output, so runs can be compared against a baseline.
+		unsigned long long hash = 0xCBF29CE484222325ULL;
+		for (char c : result.output) {
+			hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001B3ULL;
+		}
+		const Registers& r = result.registers;
+		printf("%s  %s  exit=%02X  steps=%llu  AX=%04X BX=%04X CX=%04X DX=%04X SP=%04X BP=%04X SI=%04X DI=%04X"
+				" DS=%04X ES=%04X SS=%04X CS=%04X IP=%04X FL=%04X  output=%zu:%016llX\n",
+				jobs[i].image.c_str(), StopReasonName(result.reason), result.exitCode, result.executed,
+				r.Get(Registers::AX), r.Get(Registers::BX), r.Get(Registers::CX), r.Get(Registers::DX),
+				r.Get(Registers::SP), r.Get(Registers::BP), r.Get(Registers::SI), r.Get(Registers::DI),
+				r.Get(Registers::DS), r.Get(Registers::ES), r.Get(Registers::SS), r.Get(Registers::CS),
+				r.Get(Registers::IP), r.Get(Registers::FLAGS), result.output.size(), hash);
 	}
-	return true;
+	return status;
 }
 
-bool Registers::Set(const string& name, unsigned short value)
-{
-	auto uname = ToUpper(name);
-	if (uname == "DS") {
-		regs_[DS] = value;
-	} else if (uname == "ES") {
-		regs_[DS] = value;
-	} else if (uname == "SS") {
-		regs_[SS] = value;
-	} else if (uname == "CS") {
-		regs_[CS] = value;
-	} else if (uname == "IP") {
-		regs_[IP] = value;
-	} else if (uname == "AX") {
-		regs_[AX] = value;
-	} else if (uname == "BX") {
-		regs_[BX] = value;
-	} else if (uname == "CX") {
-		regs_[CX] = value;
-	} else if (uname == "DX") {
-		regs_[DX] = value;
-	} else if (uname == "SP") {
-		regs_[SP] = value;
-	} else if (uname == "BP") {
-		regs_[BP] = value;
-	} else if (uname == "SI") {
-		regs_[SI] = value;
-	} else if (uname == "DI") {
-		regs_[DI] = value;
-	} else {
-		return false;
-	}
-	return true;
+bool ParseCount(const string& text, unsigned long long& value)
+{
+	char* end;
+	errno = 0;
+	value = strtoull(text.c_str(), &end, 0);
+	return !text.empty() && *end == '\0' && errno == 0 && isdigit(static_cast<unsigned char>(text[0]));
 }
 
+} // namespace
+
 int main(int argc, char* const* argv)
 {
 	vector<string> args(argv + 1, argv + argc);
 	Processor processor;
 
+	bool batch = !isatty(STDIN_FILENO);
+	string batchFile = "-";
+	string runList;
+	string disasmFile;
+	string sweepFile;
+	unsigned long long jobs = max(thread::hardware_concurrency(), 1u);
+	unsigned long long limit = 100000000;
+	Memory::FillMode fillMode = Memory::FillMode::PATTERN;
+	while (!args.empty() && args[0].compare(0, 2, "--") == 0) {
+		if (args[0] == "--zero-memory") {
+			fillMode = Memory::FillMode::ZERO;
+			processor.GetMemory().SetFillMode(fillMode);
+		} else if (args[0] == "--run-many" && args.size() > 1) {
+			runList = args[1];
+			args.erase(args.begin());
+		} else if (args[0] == "--disasm" && args.size() > 1) {
+			disasmFile = args[1];
+			args.erase(args.begin());
+		} else if (args[0] == "--sweep" && args.size() > 1) {
+			sweepFile = args[1];
+			args.erase(args.begin());
+		} else if ((args[0] == "--jobs" || args[0] == "--limit") && args.size() > 1) {
+			unsigned long long& value = args[0] == "--jobs" ? jobs : limit;
+			if (!ParseCount(args[1], value) || value == 0) {
+				cerr << "Error: Invalid count " << args[1] << " for " << args[0] << endl;
+				return 1;
+			}
+			args.erase(args.begin());
+		} else if (args[0] == "--trace" && args.size() > 1) {
+			if (!processor.StartTrace(args[1])) {
+				cerr << "Error: Cannot create trace file " << args[1] << endl;
+				return 1;
+			}
+			args.erase(args.begin());
+		} else if (args[0] == "--batch" && args.size() > 1) {
+			batch = true;
+			batchFile = args[1];
+			args.erase(args.begin());
+		} else {
+			cerr << "Error: Unknown option " << args[0] << endl;
+			return 1;
+		}
+		args.erase(args.begin());
+	}
+	if (!runList.empty()) {
+		return RunMany(runList, static_cast<unsigned>(min(jobs, 1024ULL)), limit, fillMode);
+	}
+	if (!sweepFile.empty()) {
+		if (!SweepFile(sweepFile, static_cast<unsigned>(min(jobs, 1024ULL)))) {
+			cerr << "Error: Cannot read " << sweepFile << endl;
+			return 1;
+		}
+		return 0;
+	}
+	if (!disasmFile.empty()) {
+		vector<size_t> entries;
+		for (const string& arg : args) {
+			char* end;
+			entries.push_back(strtoull(arg.c_str(), &end, 16));
+			if (arg.empty() || *end != '\0' || !isxdigit(static_cast<unsigned char>(arg[0]))) {
+				cerr << "Error: Invalid entry point " << arg << endl;
+				return 1;
+			}
+		}
+		if (!DisassembleFile(disasmFile, entries)) {
+			cerr << "Error: Cannot read " << disasmFile << endl;
+			return 1;
+		}
+		return 0;
+	}
+
 	ConsoleUI ui;
+	if (batch && !ui.SetBatchInput(batchFile)) {
+		cerr << "Error: Cannot read batch file " << batchFile << endl;
+		return 1;
+	}
 	if (!ui.Init(processor.GetRegisters(), processor.GetMemory(), args)) {
 		cerr << "Error: Failed to initialize console UI!" << endl;
 		return 1;
 	}
 
-	for (;;) {
-		auto cmd = ui.GetCommand();
+	Command cmd;
+	while (ui.GetCommand(cmd)) {
 		ui.Process(cmd, processor);
+		if (ui.Failed()) {
+			return 1;
+		}
 	}
 	return 0;
 }
+#endif // X86_DEBUG_NO_MAIN